@@ -61,6 +61,8 @@ void init_stuff (int argc, char *argv[])
   g_mkdir(tmppath, 0700); // safer (MRU data may be confidential)
   ui.mrufile = g_build_filename(tmppath, MRU_FILE, NULL);
   ui.configfile = g_build_filename(tmppath, CONFIG_FILE, NULL);
+  ui.cachedir = g_build_filename(tmppath, CACHE_DIR, NULL);
+  g_mkdir(ui.cachedir, 0700);
   g_free(tmppath);
 
   // initialize preferences
@@ -348,6 +350,9 @@ main (int argc, char *argv[])
   textdomain (GETTEXT_PACKAGE);
 #endif
   
+#if !GLIB_CHECK_VERSION(2,32,0)
+  if (!g_thread_supported()) g_thread_init(NULL); // for background saves
+#endif
   gtk_set_locale ();
   gtk_init (&argc, &argv);
 
@@ -374,6 +379,7 @@ main (int argc, char *argv[])
   
   gtk_main ();
   
+  wait_for_background_save();
   if (bgpdf.status != STATUS_NOT_INIT) shutdown_bgpdf();
 
   save_mru_list();
@@ -38,6 +38,7 @@
 #include "xo-shapes.h"
 #include "xo-clipboard.h"
 #include "xo-image.h"
+#include "xo-layer.h"
 
 void
 on_fileNew_activate                    (GtkMenuItem     *menuitem,
@@ -180,6 +181,32 @@ on_fileOpen_activate                   (GtkMenuItem     *menuitem,
 }
 
 
+// completion of a background save started by File/Save or File/Save As
+
+void file_save_done(struct SaveJob *job)
+{
+  GtkWidget *dialog;
+  
+  if (job->success) {
+    autosave_cleanup(&ui.autosave_filename_list);
+    return;
+  }
+  ui.saved = FALSE;
+  editlog_reset(NULL);
+  dialog = gtk_message_dialog_new(GTK_WINDOW (winMain), GTK_DIALOG_DESTROY_WITH_PARENT,
+    GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, _("Error saving file '%s'"), job->filename);
+  wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+  gtk_widget_destroy(dialog);
+}
+
+// same for File/Save As: the journal only takes the new name once it's there
+
+void file_save_as_done(struct SaveJob *job)
+{
+  if (job->success) update_file_name(g_strdup(job->filename));
+  file_save_done(job);
+}
+
 void
 on_fileSave_activate                   (GtkMenuItem     *menuitem,
                                         gpointer         user_data)
@@ -191,9 +218,17 @@ on_fileSave_activate                   (GtkMenuItem     *menuitem,
     on_fileSaveAs_activate(menuitem, user_data);
     return;
   }
+  if (ui.background_save) {
+    wait_for_background_save();
+    ui.saved = TRUE; // edits made during the save will reset this
+    editlog_reset(ui.filename);
+    save_journal_background(ui.filename, FALSE, file_save_done, NULL);
+    return;
+  }
   set_cursor_busy(TRUE);
   if (save_journal(ui.filename, FALSE)) { // success
     autosave_cleanup(&ui.autosave_filename_list);
+    editlog_reset(ui.filename);
     set_cursor_busy(FALSE);
     ui.saved = TRUE;
     return;
@@ -271,12 +306,21 @@ on_fileSaveAs_activate                 (GtkMenuItem     *menuitem,
 
   gtk_widget_destroy(dialog);
 
+  if (ui.background_save) {
+    wait_for_background_save();
+    ui.saved = TRUE; // edits made during the save will reset this
+    editlog_reset(filename);
+    save_journal_background(filename, FALSE, file_save_as_done, NULL);
+    g_free(filename);
+    return;
+  }
   set_cursor_busy(TRUE);
   if (save_journal(filename, FALSE)) { // success
     autosave_cleanup(&ui.autosave_filename_list);
     ui.saved = TRUE;
     set_cursor_busy(FALSE);
     update_file_name(filename);
+    editlog_reset(filename);
     return;
   }
   set_cursor_busy(FALSE);
@@ -463,6 +507,8 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
   if (undo == NULL) return; // nothing to undo!
   reset_selection(); // safer
   reset_recognizer(); // safer
+  materialize_undo_pages(undo);
+  unbatch_undo_items(undo);
   if (undo->type == ITEM_STROKE || undo->type == ITEM_TEXT || undo->type == ITEM_IMAGE) {
     // we're keeping the stroke info, but deleting the canvas item
     gtk_object_destroy(GTK_OBJECT(undo->item->canvas_item));
@@ -513,9 +559,10 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       undo->val_x = tmp_x;
       undo->val_y = tmp_y;
       make_page_clipbox(undo->page);
+      journal_pages_changed(journal_page_number(undo->page));
     }
     update_canvas_bg(undo->page);
-    do_switch_page(g_list_index(journal.pages, undo->page), TRUE, TRUE);
+    do_switch_page(journal_page_number(undo->page), TRUE, TRUE);
   }
   else if (undo->type == ITEM_NEW_DEFAULT_BG) {
     tmp_bg = ui.default_page.bg;
@@ -534,8 +581,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
       // also destroys the background and layer's canvas items
     undo->page->group = NULL;
     undo->page->bg->canvas_item = NULL;
-    journal.pages = g_list_remove(journal.pages, undo->page);
-    journal.npages--;
+    journal_remove_page(undo->page);
     if (ui.cur_page == undo->page) ui.cur_page = NULL;
         // so do_switch_page() won't try to remap the layers of the defunct page
     if (ui.pageno >= undo->val) ui.pageno--;
@@ -543,8 +589,7 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     do_switch_page(ui.pageno, TRUE, TRUE);
   }
   else if (undo->type == ITEM_DELETE_PAGE) {
-    journal.pages = g_list_insert(journal.pages, undo->page, undo->val);
-    journal.npages++;
+    journal_insert_page(undo->page, undo->val);
     make_canvas_items(); // re-create the canvas items
     do_switch_page(undo->val, TRUE, TRUE);
   }
@@ -628,7 +673,8 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     tmpstr = undo->str;
     undo->str = undo->item->text;
     undo->item->text = tmpstr;
-    gnome_canvas_item_set(undo->item->canvas_item, "text", tmpstr, NULL);
+    if (undo->item->canvas_item != NULL)
+      gnome_canvas_item_set(undo->item->canvas_item, "text", tmpstr, NULL);
     update_item_bbox(undo->item);
   }
   else if (undo->type == ITEM_TEXT_ATTRIB) {
@@ -641,12 +687,14 @@ on_editUndo_activate                   (GtkMenuItem     *menuitem,
     g_memmove(&tmp_brush, undo->brush, sizeof(struct Brush));
     g_memmove(undo->brush, &(undo->item->brush), sizeof(struct Brush));
     g_memmove(&(undo->item->brush), &tmp_brush, sizeof(struct Brush));
-    gnome_canvas_item_set(undo->item->canvas_item, 
-      "fill-color-rgba", undo->item->brush.color_rgba, NULL);
+    if (undo->item->canvas_item != NULL)
+      gnome_canvas_item_set(undo->item->canvas_item, 
+        "fill-color-rgba", undo->item->brush.color_rgba, NULL);
     update_text_item_displayfont(undo->item);
     update_item_bbox(undo->item);
   }
   
+  editlog_note_undo(undo);
   // move item from undo to redo stack
   u = undo;
   undo = undo->next;
@@ -678,6 +726,8 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
   if (redo == NULL) return; // nothing to redo!
   reset_selection(); // safer
   reset_recognizer(); // safer
+  materialize_undo_pages(redo);
+  unbatch_undo_items(redo);
   if (redo->type == ITEM_STROKE || redo->type == ITEM_TEXT || redo->type == ITEM_IMAGE) {
     // re-create the canvas_item
     make_canvas_item_one(redo->layer->group, redo->item);
@@ -722,9 +772,10 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
       redo->val_x = tmp_x;
       redo->val_y = tmp_y;
       make_page_clipbox(redo->page);
+      journal_pages_changed(journal_page_number(redo->page));
     }
     update_canvas_bg(redo->page);
-    do_switch_page(g_list_index(journal.pages, redo->page), TRUE, TRUE);
+    do_switch_page(journal_page_number(redo->page), TRUE, TRUE);
   }
   else if (redo->type == ITEM_NEW_DEFAULT_BG) {
     tmp_bg = ui.default_page.bg;
@@ -748,13 +799,12 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
       redo->page->group, gnome_canvas_group_get_type(), NULL);
     
-    journal.pages = g_list_insert(journal.pages, redo->page, redo->val);
-    journal.npages++;
+    journal_insert_page(redo->page, redo->val);
     do_switch_page(redo->val, TRUE, TRUE);
   }
   else if (redo->type == ITEM_DELETE_PAGE) {
     // unmap all the canvas items
-    gtk_object_destroy(GTK_OBJECT(redo->page->group));
+    if (redo->page->group != NULL) gtk_object_destroy(GTK_OBJECT(redo->page->group));
     redo->page->group = NULL;
     redo->page->bg->canvas_item = NULL;
     for (list = redo->page->layers; list!=NULL; list = list->next) {
@@ -763,8 +813,7 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
         ((struct Item *)itemlist->data)->canvas_item = NULL;
       l->group = NULL;
     }
-    journal.pages = g_list_remove(journal.pages, redo->page);
-    journal.npages--;
+    journal_remove_page(redo->page);
     if (ui.pageno > redo->val || ui.pageno == journal.npages) ui.pageno--;
     ui.cur_page = NULL;
       // so do_switch_page() won't try to remap the layers of the defunct page
@@ -848,7 +897,8 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     tmpstr = redo->str;
     redo->str = redo->item->text;
     redo->item->text = tmpstr;
-    gnome_canvas_item_set(redo->item->canvas_item, "text", tmpstr, NULL);
+    if (redo->item->canvas_item != NULL)
+      gnome_canvas_item_set(redo->item->canvas_item, "text", tmpstr, NULL);
     update_item_bbox(redo->item);
   }
   else if (redo->type == ITEM_TEXT_ATTRIB) {
@@ -861,12 +911,14 @@ on_editRedo_activate                   (GtkMenuItem     *menuitem,
     g_memmove(&tmp_brush, redo->brush, sizeof(struct Brush));
     g_memmove(redo->brush, &(redo->item->brush), sizeof(struct Brush));
     g_memmove(&(redo->item->brush), &tmp_brush, sizeof(struct Brush));
-    gnome_canvas_item_set(redo->item->canvas_item, 
-      "fill-color-rgba", redo->item->brush.color_rgba, NULL);
+    if (redo->item->canvas_item != NULL)
+      gnome_canvas_item_set(redo->item->canvas_item, 
+        "fill-color-rgba", redo->item->brush.color_rgba, NULL);
     update_text_item_displayfont(redo->item);
     update_item_bbox(redo->item);
   }
   
+  editlog_note_undo(redo);
   // move item from redo to undo stack
   u = redo;
   redo = redo->next;
@@ -1089,8 +1141,7 @@ on_journalNewPageBefore_activate       (GtkMenuItem     *menuitem,
   end_text();
   reset_selection();
   pg = new_page(ui.cur_page);
-  journal.pages = g_list_insert(journal.pages, pg, ui.pageno);
-  journal.npages++;
+  journal_insert_page(pg, ui.pageno);
   do_switch_page(ui.pageno, TRUE, TRUE);
   
   prepare_new_undo();
@@ -1109,8 +1160,7 @@ on_journalNewPageAfter_activate        (GtkMenuItem     *menuitem,
   end_text();
   reset_selection();
   pg = new_page(ui.cur_page);
-  journal.pages = g_list_insert(journal.pages, pg, ui.pageno+1);
-  journal.npages++;
+  journal_insert_page(pg, ui.pageno+1);
   do_switch_page(ui.pageno+1, TRUE, TRUE);
 
   prepare_new_undo();
@@ -1128,9 +1178,8 @@ on_journalNewPageEnd_activate          (GtkMenuItem     *menuitem,
 
   end_text();
   reset_selection();
-  pg = new_page((struct Page *)g_list_last(journal.pages)->data);
-  journal.pages = g_list_append(journal.pages, pg);
-  journal.npages++;
+  pg = new_page(journal_page(journal.npages-1));
+  journal_insert_page(pg, journal.npages);
   do_switch_page(journal.npages-1, TRUE, TRUE);
 
   prepare_new_undo();
@@ -1167,8 +1216,7 @@ on_journalDeletePage_activate          (GtkMenuItem     *menuitem,
     l->group = NULL;
   }
   
-  journal.pages = g_list_remove(journal.pages, ui.cur_page);
-  journal.npages--;
+  journal_remove_page(ui.cur_page);
   if (ui.pageno == journal.npages) ui.pageno--;
   ui.cur_page = NULL;
      // so do_switch_page() won't try to remap the layers of the defunct page
@@ -1327,6 +1375,7 @@ on_journalPaperSize_activate           (GtkMenuItem     *menuitem,
     update_canvas_bg(pg);
     if (!ui.bg_apply_all_pages) break;
   }
+  journal_pages_changed(ui.bg_apply_all_pages ? 0 : ui.pageno);
   do_switch_page(ui.pageno, TRUE, TRUE);
 }
 
@@ -1539,13 +1588,12 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
       pg = new_page_with_bg(bg, 
               gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale,
               gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale);
-      journal.pages = g_list_append(journal.pages, pg);
-      journal.npages++;
+      journal_insert_page(pg, pageno);
       undo->val = pageno;
       undo->page = pg;
     } else
     {
-      pg = g_list_nth_data(journal.pages, pageno);
+      pg = journal_page(pageno);
       undo->type = ITEM_NEW_BG_RESIZE;
       undo->page = pg;
       undo->bg = pg->bg;
@@ -1557,6 +1605,7 @@ on_journalLoadBackground_activate      (GtkMenuItem     *menuitem,
       pg->width = gdk_pixbuf_get_width(bg->pixbuf)/bg->pixbuf_scale;
       pg->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
       make_page_clipbox(pg);
+      journal_pages_changed(pageno);
       update_canvas_bg(pg);
     }
   }
@@ -1607,6 +1656,7 @@ on_journalScreenshot_activate          (GtkMenuItem     *menuitem,
   ui.cur_page->height = gdk_pixbuf_get_height(bg->pixbuf)/bg->pixbuf_scale;
 
   make_page_clipbox(ui.cur_page);
+  journal_pages_changed(ui.pageno);
   update_canvas_bg(ui.cur_page);
 
   if (ui.zoom != DEFAULT_ZOOM) {
@@ -2192,7 +2242,7 @@ on_toolsDefaultText_activate           (GtkMenuItem     *menuitem,
   ui.font_name = g_strdup(ui.default_font_name);
   ui.font_size = ui.default_font_size;
   if (ui.cur_item_type == ITEM_TEXT) {
-    refont_text_item(ui.cur_item, ui.font_name, ui.font_size);
+    refont_text_item(ui.cur_item, ui.cur_layer, ui.font_name, ui.font_size);
   }
   update_font_button();
   update_mapping_linkings(-1);
@@ -3007,26 +3057,31 @@ on_vscroll_changed                     (GtkAdjustment   *adjustment,
   gboolean need_update;
   double viewport_top, viewport_bottom;
   struct Page *tmppage;
+  int pageno;
+  static gdouble prev_value = 0;
   
   if (ui.view_continuous!=VIEW_MODE_CONTINUOUS) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
+  if (adjustment->value != prev_value)
+    ui.scroll_direction = (adjustment->value < prev_value) ? -1 : 1;
+  prev_value = adjustment->value;
+  load_visible_pages();
+  rescale_bg_pixmaps(); // also marks the pages in view for the PDF cache
   need_update = FALSE;
   viewport_top = adjustment->value / ui.zoom;
   viewport_bottom = (adjustment->value + adjustment->page_size) / ui.zoom;
   tmppage = ui.cur_page;
-  while (viewport_top > tmppage->voffset + tmppage->height) {
-    if (ui.pageno == journal.npages-1) break;
-    need_update = TRUE;
-    ui.pageno++;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
-  while (viewport_bottom < tmppage->voffset) {
-    if (ui.pageno == 0) break;
-    need_update = TRUE;
-    ui.pageno--;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
+  pageno = ui.pageno;
+  if (viewport_top > tmppage->voffset + tmppage->height) {
+    pageno = page_at_offset(viewport_top);
+    tmppage = journal_page(pageno);
+    if (viewport_top > tmppage->voffset + tmppage->height && pageno < journal.npages-1)
+      pageno++; // in the gap after that page
+  }
+  else if (viewport_bottom < tmppage->voffset)
+    pageno = page_at_offset(viewport_bottom);
+  need_update = (pageno != ui.pageno);
+  ui.pageno = pageno;
   if (need_update) {
     end_text();
     do_switch_page(ui.pageno, FALSE, FALSE);
@@ -3040,26 +3095,31 @@ on_hscroll_changed                     (GtkAdjustment   *adjustment,
   gboolean need_update;
   double viewport_left, viewport_right;
   struct Page *tmppage;
+  int pageno;
+  static gdouble prev_value = 0;
   
   if (ui.view_continuous!=VIEW_MODE_HORIZONTAL) return;
   
-  if (ui.progressive_bg) rescale_bg_pixmaps();
+  if (adjustment->value != prev_value)
+    ui.scroll_direction = (adjustment->value < prev_value) ? -1 : 1;
+  prev_value = adjustment->value;
+  load_visible_pages();
+  rescale_bg_pixmaps(); // also marks the pages in view for the PDF cache
   need_update = FALSE;
   viewport_left = adjustment->value / ui.zoom;
   viewport_right = (adjustment->value + adjustment->page_size) / ui.zoom;
   tmppage = ui.cur_page;
-  while (viewport_left > tmppage->hoffset + tmppage->width) {
-    if (ui.pageno == journal.npages-1) break;
-    need_update = TRUE;
-    ui.pageno++;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
-  while (viewport_right < tmppage->hoffset) {
-    if (ui.pageno == 0) break;
-    need_update = TRUE;
-    ui.pageno--;
-    tmppage = g_list_nth_data(journal.pages, ui.pageno);
-  }
+  pageno = ui.pageno;
+  if (viewport_left > tmppage->hoffset + tmppage->width) {
+    pageno = page_at_offset(viewport_left);
+    tmppage = journal_page(pageno);
+    if (viewport_left > tmppage->hoffset + tmppage->width && pageno < journal.npages-1)
+      pageno++; // in the gap after that page
+  }
+  else if (viewport_right < tmppage->hoffset)
+    pageno = page_at_offset(viewport_right);
+  need_update = (pageno != ui.pageno);
+  ui.pageno = pageno;
   if (need_update) {
     end_text();
     do_switch_page(ui.pageno, FALSE, FALSE);
@@ -3129,6 +3189,7 @@ on_journalDefaultBackground_activate   (GtkMenuItem     *menuitem,
     update_canvas_bg(pg);
     if (!ui.bg_apply_all_pages) break;
   }
+  journal_pages_changed(ui.bg_apply_all_pages ? 0 : ui.pageno);
   do_switch_page(ui.pageno, TRUE, TRUE);
 }
 
@@ -115,8 +115,9 @@ void selection_to_clip(void)
     else if (item->type == ITEM_IMAGE) {
       if (item->image_png == NULL) {
         set_cursor_busy(TRUE);
-        if (!gdk_pixbuf_save_to_buffer(item->image, &item->image_png, &item->image_png_len, "png", NULL, NULL))
-          item->image_png_len = 0;       // failed for some reason, so forget it
+        if (gdk_pixbuf_save_to_buffer(item->image, &item->image_png, &item->image_png_len, "png", NULL, NULL))
+          item->image_png = intern_image_data(item->image_png, item->image_png_len);
+        else item->image_png_len = 0;       // failed for some reason, so forget it
         set_cursor_busy(FALSE);
       }
       bufsz+= sizeof(int) // type
@@ -171,7 +172,9 @@ void selection_to_clip(void)
       if (item->image_png_len > 0) {
         g_memmove(p, item->image_png, item->image_png_len); p+= item->image_png_len;
       }
-      if (nitems==1) sel->image_data = gdk_pixbuf_copy(item->image); // single image
+      decode_image_item(item);
+      if (nitems==1 && item->image != NULL) 
+        sel->image_data = gdk_pixbuf_copy(item->image); // single image
     }
   }
   
@@ -293,8 +296,9 @@ void clipboard_paste_from_xournal(GtkSelectionData *sel_data)
       item->bbox.bottom += voffset;
       g_memmove(&item->image_png_len, p, sizeof(gsize)); p+= sizeof(gsize);
       if (item->image_png_len > 0) {
-        item->image_png = g_memdup(p, item->image_png_len);
-        item->image = pixbuf_from_buffer(item->image_png, item->image_png_len);
+        item->image_png = intern_image_data(g_memdup(p, item->image_png_len), item->image_png_len);
+        item->image = NULL;
+        decode_image_item(item); // shares the pixbuf of other copies
         p+= item->image_png_len;
       } else {
         item->image = NULL;
@@ -376,7 +380,7 @@ void clipboard_paste_text(gchar *text)
 }
 
 // paste an external image
-void clipboard_paste_image(GdkPixbuf *pixbuf)
+void clipboard_paste_image(GdkPixbuf *pixbuf, gchar *data, gsize datalen)
 {
   double pt[2];
 
@@ -385,7 +389,7 @@ void clipboard_paste_image(GdkPixbuf *pixbuf)
   get_current_pointer_coords(pt);
   set_current_page(pt);  
 
-  create_image_from_pixbuf(pixbuf, pt);
+  create_image_from_pixbuf(pixbuf, data, datalen, pt);
 }
 
 // work out what format the clipboard data is in, and paste accordingly
@@ -394,7 +398,11 @@ void clipboard_paste(void)
   GtkSelectionData *sel_data;
   GtkClipboard *clipboard;
   GdkPixbuf *pixbuf;
-  gchar *text;
+  gchar *text, *data;
+  gsize datalen;
+  gint len;
+  const gchar *image_targets[] = { "image/jpeg", "image/png", NULL };
+  int i;
 
   if (ui.cur_layer == NULL) return;
   
@@ -412,10 +420,29 @@ void clipboard_paste(void)
     clipboard_paste_from_xournal(sel_data);
     return;
   } 
-  // try image data
+  // try image data, preferably as encoded by the source
+  for (i=0; image_targets[i]!=NULL; i++) {
+    sel_data = gtk_clipboard_wait_for_contents(clipboard, 
+                 gdk_atom_intern(image_targets[i], FALSE));
+    if (sel_data == NULL) continue;
+    len = gtk_selection_data_get_length(sel_data); // -1 on failure
+    datalen = (len > 0) ? (gsize)len : 0;
+    data = NULL;
+    pixbuf = NULL;
+    if (len > 0 && image_data_format((const gchar *)gtk_selection_data_get_data(sel_data), datalen) != NULL) {
+      data = g_memdup(gtk_selection_data_get_data(sel_data), datalen);
+      pixbuf = pixbuf_from_buffer(data, datalen);
+    }
+    gtk_selection_data_free(sel_data);
+    if (pixbuf != NULL) {
+      clipboard_paste_image(pixbuf, data, datalen);
+      return;
+    }
+    g_free(data);
+  }
   pixbuf = gtk_clipboard_wait_for_image(clipboard);
   if (pixbuf != NULL) {
-    clipboard_paste_image(pixbuf);
+    clipboard_paste_image(pixbuf, NULL, 0);
     return;
   }
   // try text data
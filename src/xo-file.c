@@ -16,6 +16,9 @@
 #ifdef HAVE_CONFIG_H
 #  include <config.h>
 #endif
+#ifdef HAVE_COPY_FILE_RANGE
+#  define _GNU_SOURCE // for copy_file_range()
+#endif
 
 #include <signal.h>
 #include <memory.h>
@@ -30,6 +33,12 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 #include <poppler/glib/poppler.h>
+#ifndef WIN32
+ #include <unistd.h>
+#endif
+#ifdef __linux__
+ #include <sys/vfs.h>
+#endif
 
 #ifdef GDK_WINDOWING_X11
  #include <gdk/gdkx.h>
@@ -45,6 +54,7 @@
 #include "xo-paint.h"
 #include "xo-image.h"
 #include "xo-shapes.h"
+#include "xo-layer.h"
 
 const char *tool_names[NUM_TOOLS] = {"pen", "eraser", "highlighter", "text", "selectregion", "selectrect", "vertspace", "hand", "image"};
 const char *color_names[COLOR_MAX] = {"black", "blue", "red", "green",
@@ -79,6 +89,8 @@ void new_journal(void)
   journal.npages = 1;
   journal.pages = g_list_append(NULL, new_page(&ui.default_page));
   journal.last_attach_no = 0;
+  journal.image_ids = NULL;
+  reset_page_index();
   ui.pageno = 0;
   ui.layerno = 0;
   ui.cur_page = (struct Page *) journal.pages->data;
@@ -86,6 +98,7 @@ void new_journal(void)
   ui.saved = TRUE;
   ui.filename = NULL;
   update_file_name(NULL);
+  editlog_reset(NULL);
 }
 
 // check attachment names
@@ -103,202 +116,989 @@ void chk_attach_names(void)
   }
 }
 
+/* Multi-member gzip files. The journal is cut into chunks of GZMEMBER_SIZE
+   bytes which are compressed in parallel and written out as consecutive
+   gzip members; gzread() and gunzip read this as a single stream. Each
+   member header has an extra field (see RFC 1952) with subfield id "XJ"
+   giving the total size of the member and its uncompressed size, so that
+   a reader can find all the members without inflating them first. */
+
+#define GZMEMBER_SIZE 1048576
+#define GZMEMBER_HEADER 24
+#define GZMEMBER_TRAILER 8
+
+typedef struct GzMember {
+  GString *in;   // uncompressed data (freed once compressed)
+  guchar *data;  // the compressed member, header and trailer included
+  gsize len;
+  gsize offset;  // when reading: offset of the uncompressed data in the output
+  gsize ulen;
+  gboolean failed;
+} GzMember;
+
+int gzip_thread_count(void)
+{
+  if (ui.gzip_threads > 0) return ui.gzip_threads;
+#if GLIB_CHECK_VERSION(2,36,0)
+  return g_get_num_processors();
+#else
+  return 1;
+#endif
+}
+
+int render_thread_count(void)
+{
+  if (ui.pdf_render_threads > 0) return ui.pdf_render_threads;
+#if GLIB_CHECK_VERSION(2,36,0)
+  return g_get_num_processors();
+#else
+  return 1;
+#endif
+}
+
+void put_le32(guchar *p, guint32 val)
+{
+  p[0] = val & 0xff; p[1] = (val>>8) & 0xff;
+  p[2] = (val>>16) & 0xff; p[3] = (val>>24) & 0xff;
+}
+
+guint32 get_le32(const guchar *p)
+{
+  return p[0] | (p[1]<<8) | (p[2]<<16) | ((guint32)p[3]<<24);
+}
+
+// compresses one member (GThreadPool worker, or called directly)
+
+void gz_compress_member(gpointer data, gpointer user_data)
+{
+  struct GzMember *m = (struct GzMember *)data;
+  z_stream zs;
+  static const guchar header[16] = 
+    { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 12, 0, 'X', 'J', 8, 0 };
+
+  memset(&zs, 0, sizeof(zs));
+  if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, 
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    m->failed = TRUE;
+    g_string_free(m->in, TRUE);
+    m->in = NULL;
+    return;
+  }
+  m->ulen = m->in->len;
+  m->data = g_malloc(GZMEMBER_HEADER + deflateBound(&zs, m->ulen) + GZMEMBER_TRAILER);
+  zs.next_in = (Bytef *)m->in->str;
+  zs.avail_in = m->ulen;
+  zs.next_out = m->data + GZMEMBER_HEADER;
+  zs.avail_out = deflateBound(&zs, m->ulen);
+  if (deflate(&zs, Z_FINISH) != Z_STREAM_END) m->failed = TRUE;
+  m->len = GZMEMBER_HEADER + zs.total_out + GZMEMBER_TRAILER;
+  deflateEnd(&zs);
+
+  g_memmove(m->data, header, 16);
+  put_le32(m->data+16, m->len);
+  put_le32(m->data+20, m->ulen);
+  put_le32(m->data+m->len-8, crc32(crc32(0L, Z_NULL, 0), (Bytef *)m->in->str, m->ulen));
+  put_le32(m->data+m->len-4, m->ulen);
+  g_string_free(m->in, TRUE);
+  m->in = NULL;
+}
+
+// inflates one member into its place in the output buffer
+
+void gz_inflate_member(gpointer data, gpointer user_data)
+{
+  struct GzMember *m = (struct GzMember *)data;
+  guchar *out = (guchar *)((GString *)user_data)->str + m->offset;
+  z_stream zs;
+
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) { m->failed = TRUE; return; }
+  zs.next_in = m->data + GZMEMBER_HEADER;
+  zs.avail_in = m->len - GZMEMBER_HEADER - GZMEMBER_TRAILER;
+  zs.next_out = out;
+  zs.avail_out = m->ulen;
+  if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != m->ulen ||
+      crc32(crc32(0L, Z_NULL, 0), out, m->ulen) != get_le32(m->data+m->len-8))
+    m->failed = TRUE;
+  inflateEnd(&zs);
+}
+
+/* Reads a file written by write_journal_snapshot() and inflates its
+   members in parallel. Returns NULL if the file isn't in that format
+   (e.g. plain gzip from an older version), so that the caller can fall
+   back to gzread(). */
+
+GString *read_gz_members(const char *filename)
+{
+  gchar *raw;
+  gsize rawlen, pos, total;
+  GArray *members;
+  struct GzMember m, *pm;
+  GString *contents;
+  GThreadPool *pool;
+  gboolean valid;
+  int i, nthreads;
+  guchar magic[14];
+  FILE *f;
+
+  // check the first header before reading everything in
+  f = g_fopen(filename, "rb");
+  if (f == NULL) return NULL;
+  valid = (fread(magic, 1, 14, f) == 14 && magic[3] == 4 && 
+           magic[12] == 'X' && magic[13] == 'J');
+  fclose(f);
+  if (!valid) return NULL;
+  if (!g_file_get_contents(filename, &raw, &rawlen, NULL)) return NULL;
+  members = g_array_new(FALSE, TRUE, sizeof(struct GzMember));
+  valid = (rawlen > 0);
+  pos = total = 0;
+  while (valid && pos < rawlen) {
+    memset(&m, 0, sizeof(m));
+    m.data = (guchar *)raw + pos;
+    valid = (rawlen - pos >= GZMEMBER_HEADER + GZMEMBER_TRAILER &&
+       m.data[0] == 0x1f && m.data[1] == 0x8b && m.data[2] == 8 && m.data[3] == 4 &&
+       m.data[10] == 12 && m.data[11] == 0 && m.data[12] == 'X' && m.data[13] == 'J' &&
+       m.data[14] == 8 && m.data[15] == 0);
+    if (!valid) break;
+    m.len = get_le32(m.data+16);
+    m.ulen = get_le32(m.data+20);
+    m.offset = total;
+    valid = (m.len >= GZMEMBER_HEADER + GZMEMBER_TRAILER && m.len <= rawlen - pos &&
+             m.ulen == get_le32(m.data+m.len-4));
+    g_array_append_val(members, m);
+    pos += m.len;
+    total += m.ulen;
+  }
+  if (!valid) {
+    g_array_free(members, TRUE);
+    g_free(raw);
+    return NULL;
+  }
+
+  contents = g_string_sized_new(total+1);
+  g_string_set_size(contents, total);
+  nthreads = MIN(gzip_thread_count(), members->len);
+  pool = NULL;
+  if (nthreads > 1)
+    pool = g_thread_pool_new(gz_inflate_member, contents, nthreads, FALSE, NULL);
+  for (i=0; i<members->len; i++) {
+    pm = &g_array_index(members, struct GzMember, i);
+    if (pool != NULL) g_thread_pool_push(pool, pm, NULL);
+    else gz_inflate_member(pm, contents);
+  }
+  if (pool != NULL) g_thread_pool_free(pool, FALSE, TRUE); // waits for the workers
+  for (i=0; i<members->len; i++)
+    if (g_array_index(members, struct GzMember, i).failed) valid = FALSE;
+  g_array_free(members, TRUE);
+  g_free(raw);
+  if (!valid) { g_string_free(contents, TRUE); return NULL; }
+  return contents;
+}
+
+/* Buffered output for save_journal(). Calling gzprintf() once per coordinate
+   spends most of the time in varargs formatting and tiny zlib writes, so
+   we format into a large staging buffer and hand it on in big chunks. */
+
+#define SAVEBUF_SIZE 262144
+#define SAVEBUF_DOUBLE_MAX 320 // enough for "%.2f" of any double
+
+typedef struct SaveBuffer {
+  FILE *f;
+  GString *str; // if not NULL, output goes here instead of f
+  GString *chunk; // data for the next gzip member
+  GPtrArray *members; // the gzip members, in file order
+  GThreadPool *pool; // compresses the members (NULL: single-threaded)
+  char *buf;
+  int len;
+  gboolean failed;
+  gsize total; // uncompressed bytes written so far
+} SaveBuffer;
+
+void savebuf_push_member(struct SaveBuffer *sb)
+{
+  struct GzMember *m;
+
+  if (sb->chunk->len == 0) return;
+  m = g_new0(struct GzMember, 1);
+  m->in = sb->chunk;
+  g_ptr_array_add(sb->members, m);
+  sb->chunk = g_string_sized_new(GZMEMBER_SIZE + SAVEBUF_SIZE);
+  if (sb->pool != NULL) g_thread_pool_push(sb->pool, m, NULL);
+  else gz_compress_member(m, NULL);
+}
+
+void savebuf_output(struct SaveBuffer *sb, const char *s, int len)
+{
+  if (sb->str != NULL) g_string_append_len(sb->str, s, len);
+  else {
+    g_string_append_len(sb->chunk, s, len);
+    if (sb->chunk->len >= GZMEMBER_SIZE) savebuf_push_member(sb);
+  }
+  sb->total += len;
+}
+
+// waits for the compression to finish and writes the members to the file
+
+void savebuf_close(struct SaveBuffer *sb)
+{
+  struct GzMember *m;
+  int i;
+
+  if (sb->f == NULL) return;
+  savebuf_push_member(sb);
+  g_string_free(sb->chunk, TRUE);
+  if (sb->pool != NULL) g_thread_pool_free(sb->pool, FALSE, TRUE);
+  for (i=0; i<sb->members->len; i++) {
+    m = (struct GzMember *)g_ptr_array_index(sb->members, i);
+    if (m->failed || fwrite(m->data, 1, m->len, sb->f) != m->len) sb->failed = TRUE;
+    g_free(m->data);
+    g_free(m);
+  }
+  g_ptr_array_free(sb->members, TRUE);
+  if (fclose(sb->f) != 0) sb->failed = TRUE;
+}
+
+void savebuf_flush(struct SaveBuffer *sb)
+{
+  if (sb->len > 0) savebuf_output(sb, sb->buf, sb->len);
+  sb->len = 0;
+}
+
+void savebuf_write(struct SaveBuffer *sb, const char *s, int len)
+{
+  if (sb->len + len > SAVEBUF_SIZE) savebuf_flush(sb);
+  if (len > SAVEBUF_SIZE) { // too big to stage, e.g. image data
+    savebuf_output(sb, s, len);
+    return;
+  }
+  g_memmove(sb->buf + sb->len, s, len);
+  sb->len += len;
+}
+
+void savebuf_puts(struct SaveBuffer *sb, const char *s)
+{
+  savebuf_write(sb, s, strlen(s));
+}
+
+void savebuf_int(struct SaveBuffer *sb, int val)
+{
+  char tmp[16];
+  savebuf_write(sb, tmp, g_snprintf(tmp, 16, "%d", val));
+}
+
+void savebuf_rgba(struct SaveBuffer *sb, guint rgba)
+{
+  char tmp[16];
+  savebuf_write(sb, tmp, g_snprintf(tmp, 16, "#%08x", rgba));
+}
+
+/* format x exactly as printf("%.2f") does in the C locale, without going
+   through printf; returns the length written. dest must have room for
+   SAVEBUF_DOUBLE_MAX bytes. */
+
+int format_double2(char *dest, double x)
+{
+  double r, fl;
+  guint64 n;
+  char digits[24];
+  int i, len;
+
+  r = fabs(x) * 100.;
+  // huge or non-finite values: let printf handle them
+  if (!(r < 1e8)) 
+    return strlen(g_ascii_formatd(dest, SAVEBUF_DOUBLE_MAX, "%.2f", x));
+  // too close to a rounding tie to trust r: also defer to printf
+  fl = floor(r);
+  if (fabs(r - fl - 0.5) < 1e-6)
+    return strlen(g_ascii_formatd(dest, SAVEBUF_DOUBLE_MAX, "%.2f", x));
+
+  n = (guint64)fl + ((r - fl > 0.5) ? 1 : 0);
+  len = 0;
+  if (signbit(x)) dest[len++] = '-';
+  i = 0;
+  do { digits[i++] = '0' + (n%10); n /= 10; } while (n > 0 || i < 3);
+  while (i > 2) dest[len++] = digits[--i];
+  dest[len++] = '.';
+  dest[len++] = digits[1];
+  dest[len++] = digits[0];
+  dest[len] = 0;
+  return len;
+}
+
+void savebuf_double(struct SaveBuffer *sb, double x)
+{
+  if (sb->len + SAVEBUF_DOUBLE_MAX > SAVEBUF_SIZE) savebuf_flush(sb);
+  sb->len += format_double2(sb->buf + sb->len, x);
+}
+
 /* Write image to file: returns true on success, false on error.
-   The image is written as a base64 encoded PNG. */
+   The image is written as base64 encoded PNG or JPEG data, which
+   snapshot_item() has already generated if needed. */
 
-gboolean write_image(gzFile f, Item *item)
+gboolean write_image(struct SaveBuffer *sb, Item *item)
 {
   gchar *base64_str;
 
-  if (item->image_png == NULL) {
-    if (!gdk_pixbuf_save_to_buffer(item->image, &item->image_png, &item->image_png_len, "png", NULL, NULL)) {
+  if (item->image_png == NULL) return FALSE;
+  base64_str = g_base64_encode(item->image_png, item->image_png_len);
+  savebuf_puts(sb, base64_str);
+  g_free(base64_str);
+  return TRUE;
+}
+
+/* Attached backgrounds are only encoded when they need to be: each pixbuf
+   remembers a file holding it (see struct BgFile), and so does bgpdf. If
+   the file is still as we left it (same size and modification time), it
+   is copied, or left alone if it's the very file we're about to write. */
+
+#define BGFILE_KEY "xournal-bgfile"
+
+struct BgFile *bgfile_new(const char *path)
+{
+  struct BgFile *bf;
+  struct stat stat_buf;
+
+  if (g_stat(path, &stat_buf) != 0) return NULL;
+  bf = g_new(struct BgFile, 1);
+  bf->path = g_strdup(path);
+  bf->size = stat_buf.st_size;
+  bf->mtime = stat_buf.st_mtime;
+  return bf;
+}
+
+struct BgFile *bgfile_copy(struct BgFile *bf)
+{
+  struct BgFile *copy;
+
+  if (bf == NULL) return NULL;
+  copy = g_memdup(bf, sizeof(struct BgFile));
+  copy->path = g_strdup(bf->path);
+  return copy;
+}
+
+void bgfile_free(gpointer data)
+{
+  struct BgFile *bf = (struct BgFile *)data;
+  
+  if (bf == NULL) return;
+  g_free(bf->path);
+  g_free(bf);
+}
+
+gboolean bgfile_unchanged(struct BgFile *bf)
+{
+  struct stat stat_buf;
+
+  if (bf == NULL || g_stat(bf->path, &stat_buf) != 0) return FALSE;
+  return (stat_buf.st_size == bf->size && (gint64)stat_buf.st_mtime == bf->mtime);
+}
+
+// copy a file of known size in place of dest, in kernel if possible
+
+#define ATTACH_COPY_CHUNK 65536
+
+gboolean copy_attachment_file(const char *src, const char *dest, gsize size)
+{
+  FILE *fin, *fout;
+  gchar *buf;
+  gsize done = 0, n;
+  gboolean success;
+
+  fin = g_fopen(src, "rb");
+  if (fin == NULL) return FALSE;
+  fout = g_fopen(dest, "wb");
+  if (fout == NULL) { fclose(fin); return FALSE; }
+#ifdef HAVE_COPY_FILE_RANGE
+  // shares the blocks on filesystems with reflinks, else copies in kernel;
+  // if it fails (older kernel, across filesystems) we carry on below
+  while (done < size) {
+    ssize_t r = copy_file_range(fileno(fin), NULL, fileno(fout), NULL, size - done, 0);
+    if (r <= 0) break;
+    done += r;
+  }
+  if (done > 0) { fseek(fin, done, SEEK_SET); fseek(fout, done, SEEK_SET); }
+#endif
+  buf = g_malloc(ATTACH_COPY_CHUNK);
+  while (done < size && (n = fread(buf, 1, ATTACH_COPY_CHUNK, fin)) > 0) {
+    if (fwrite(buf, 1, n, fout) != n) break;
+    done += n;
+  }
+  g_free(buf);
+  fclose(fin);
+  success = (fclose(fout) == 0 && done == size);
+  return success;
+}
+
+/* write an attachment from its file: returns false if it must be encoded.
+   A hard link is the cheapest; it is safe because we only ever replace
+   attachment files, never rewrite them (a PDF being annotated in place
+   by another program would change under both names, though). Otherwise
+   the file is copied. Either way it goes to a temporary name first, and
+   replaces dest only when complete. */
+
+gboolean write_attachment(struct BgFile *src, const char *dest)
+{
+  gchar *tmpfn;
+  gboolean success = FALSE;
+
+  if (!bgfile_unchanged(src)) return FALSE;
+  if (!strcmp(src->path, dest)) return TRUE; // nothing to do
+  tmpfn = g_strdup_printf("%s.tmp", dest);
+  g_unlink(tmpfn);
+#ifndef WIN32
+  success = (link(src->path, tmpfn) == 0);
+#endif
+  if (!success) success = copy_attachment_file(src->path, tmpfn, src->size);
+#ifdef WIN32
+  if (success) g_unlink(dest); // rename() won't replace it
+#endif
+  if (success) success = (g_rename(tmpfn, dest) == 0);
+  if (!success) g_unlink(tmpfn);
+  g_free(tmpfn);
+  return success;
+}
+
+// note the files holding the page's attached background, if any
+
+void snapshot_bg_file(struct SaveJob *job, struct Page *pg)
+{
+  struct BgFile *bf;
+
+  if (pg->bg->type != BG_PIXMAP || pg->bg->file_domain != DOMAIN_ATTACH ||
+      pg->bg->pixbuf == NULL) return;
+  bf = (struct BgFile *)g_object_get_data(G_OBJECT(pg->bg->pixbuf), BGFILE_KEY);
+  if (bf == NULL) return;
+  if (job->bg_files == NULL)
+    job->bg_files = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, bgfile_free);
+  g_hash_table_insert(job->bg_files, pg->bg->pixbuf, bgfile_copy(bf));
+}
+
+/* Saving is split in three steps so that the slow part can run on a worker
+   thread: save_journal_snapshot() copies what we need out of the journal
+   (main thread, cheap), write_journal_snapshot() serializes and compresses
+   the copy (any thread), and finish_save_job() reports the outcome and
+   frees the copy (main thread again). The snapshot shares the refcounted
+   pieces (bg filenames, bg pixbufs, stroke coordinates and widths) with the
+   journal, so it must only be freed from the main thread. Text is small and
+   still copied. */
+
+struct Item *snapshot_item(struct Item *item)
+{
+  struct Item *copy;
+
+  if (item->type == ITEM_IMAGE && item->image_png == NULL && item->image != NULL) {
+    // encode now: the worker thread shouldn't touch the live pixbuf
+    if (gdk_pixbuf_save_to_buffer(item->image, &item->image_png, &item->image_png_len, "png", NULL, NULL))
+      item->image_png = intern_image_data(item->image_png, item->image_png_len);
+    else {
+      item->image_png = NULL;
       item->image_png_len = 0;       // failed for some reason, so forget it
-      return FALSE;
     }
   }
+  copy = g_memdup(item, sizeof(struct Item));
+  copy->canvas_item = NULL;
+  copy->erasure = NULL;
+  copy->widget = NULL;
+  copy->image = NULL;
+  copy->path = NULL;
+  copy->widths = NULL;
+  copy->text = NULL;
+  copy->font_name = NULL;
+  copy->image_png = NULL;
+  if (item->type == ITEM_STROKE) { // shared, see unshare_stroke()
+    copy->path = gnome_canvas_points_ref(item->path);
+    if (item->brush.variable_width) copy->widths = lend_widths(item->widths);
+  }
+  if (item->type == ITEM_TEXT) {
+    copy->text = g_strdup(item->text);
+    copy->font_name = g_strdup(item->font_name);
+  }
+  if (item->type == ITEM_IMAGE) // shared, so copies of an image stay recognizable
+    copy->image_png = ref_image_data(item->image_png, item->image_png_len);
+  return copy;
+}
 
-  base64_str = g_base64_encode(item->image_png, item->image_png_len);
-  gzputs(f, base64_str);
-  g_free(base64_str);
-  return TRUE;
+struct Page *snapshot_page(struct Page *pg)
+{
+  struct Page *copypg;
+  struct Layer *layer, *copylayer;
+  GList *layerlist, *itemlist;
+
+  // ids of shared images are numbered anew when saving, so parse them first
+  if (lazy_page_has_image_ids(pg)) load_page(pg);
+  copypg = g_new0(struct Page, 1);
+  copypg->width = pg->width;
+  copypg->height = pg->height;
+  copypg->bg = g_memdup(pg->bg, sizeof(struct Background));
+  copypg->bg->canvas_item = NULL;
+  if (copypg->bg->filename != NULL) refstring_ref(copypg->bg->filename);
+  if (copypg->bg->type == BG_PIXMAP && copypg->bg->pixbuf != NULL)
+    g_object_ref(copypg->bg->pixbuf);
+  else copypg->bg->pixbuf = NULL;
+  if (pg->lazy_layers != NULL) copypg->lazy_layers = refstring_ref(pg->lazy_layers);
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    layer = (struct Layer *)layerlist->data;
+    copylayer = g_new0(struct Layer, 1);
+    for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next)
+      copylayer->items = g_list_prepend(copylayer->items, 
+                                        snapshot_item((struct Item *)itemlist->data));
+    copylayer->items = g_list_reverse(copylayer->items);
+    copylayer->nitems = layer->nitems;
+    copypg->layers = g_list_append(copypg->layers, copylayer);
+    copypg->nlayers++;
+  }
+  return copypg;
+}
+
+struct SaveJob *save_journal_snapshot(const char *filename, gboolean is_auto)
+{
+  struct SaveJob *job;
+  struct Page *pg;
+  GList *pagelist;
+
+  chk_attach_names();
+  job = g_new0(struct SaveJob, 1);
+  job->filename = g_strdup(filename);
+  job->is_auto = is_auto;
+  job->image_refs = ui.save_image_refs;
+  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
+    pg = (struct Page *)pagelist->data;
+    if (pg->bg->type == BG_PDF && pg->bg->file_domain == DOMAIN_ATTACH && 
+        job->pdf_data == NULL && job->pdf_file == NULL &&
+        bgpdf.status != STATUS_NOT_INIT) {
+      if (bgfile_unchanged(bgpdf.file_saved)) // no need to copy the contents
+        job->pdf_file = bgfile_copy(bgpdf.file_saved);
+      else if (bgpdf.data != NULL) { // share it rather than copy it
+        job->pdf_data = bgpdf.data;
+        g_atomic_int_inc(&job->pdf_data->ref_count);
+      }
+    }
+    snapshot_bg_file(job, pg);
+    job->pages = g_list_prepend(job->pages, snapshot_page(pg));
+  }
+  job->pages = g_list_reverse(job->pages);
+  return job;
 }
 
-// create pixbuf from base64 encoded PNG, or return NULL on failure
+/* If save_image_refs is set, an image placed several times is written out
+   once, with an id, and its other occurrences are <image ... ref="id"></image>.
+   Older versions of xournal can't read these, so by default every
+   copy is written inline. Copies of an image share their (interned) data,
+   so finding them is a matter of comparing pointers. Returns a table of
+   the repeated images, all mapped to -1. */
 
-GdkPixbuf *read_pixbuf(const gchar *base64_str, gsize base64_strlen)
+GHashTable *find_repeated_images(GList *pages)
 {
-  gchar *base64_str2;
-  gchar *png_buf;
-  gsize png_buflen;
-  GdkPixbuf *pixbuf;
+  GHashTable *seen, *repeated;
+  GList *pagelist, *layerlist, *itemlist;
+  struct Item *item;
+
+  seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+  repeated = g_hash_table_new(g_direct_hash, g_direct_equal);
+  for (pagelist = pages; pagelist!=NULL; pagelist = pagelist->next)
+    for (layerlist = ((struct Page *)pagelist->data)->layers; layerlist!=NULL; layerlist = layerlist->next)
+      for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; itemlist = itemlist->next) {
+        item = (struct Item *)itemlist->data;
+        if (item->type != ITEM_IMAGE || item->image_png == NULL) continue;
+        if (g_hash_table_lookup(seen, item->image_png) != NULL)
+          g_hash_table_insert(repeated, item->image_png, GINT_TO_POINTER(-1));
+        else g_hash_table_insert(seen, item->image_png, item->image_png);
+      }
+  g_hash_table_destroy(seen);
+  return repeated;
+}
 
-  // We have to copy the string in order to null terminate it, sigh.
-  base64_str2 = g_memdup(base64_str, base64_strlen+1);
-  base64_str2[base64_strlen] = 0;
-  png_buf = g_base64_decode(base64_str2, &png_buflen);
+/* a bitmap background is a clone of an earlier one if both the pixbuf
+   and the filename are the same: the writer looks them up in a hash table
+   of the backgrounds written so far */
 
-  pixbuf = pixbuf_from_buffer(png_buf, png_buflen);
+guint bg_clone_hash(gconstpointer a)
+{
+  const struct Background *bg = a;
+  return g_direct_hash(bg->pixbuf) ^ (g_direct_hash(bg->filename) * 31);
+}
 
-  g_free(png_buf);
-  g_free(base64_str2);
-  return pixbuf;
+gboolean bg_clone_equal(gconstpointer a, gconstpointer b)
+{
+  const struct Background *bga = a, *bgb = b;
+  return bga->pixbuf == bgb->pixbuf && bga->filename == bgb->filename;
 }
 
-// saves the journal to a file: returns true on success, false on error
+/* writes the snapshot to job->filename, or appends the (uncompressed) XML
+   to job->xml if it's not NULL; doesn't touch any global state */
 
-gboolean save_journal(const char *filename, gboolean is_auto)
+void write_journal_snapshot(struct SaveJob *job)
 {
-  gzFile f;
-  struct Page *pg, *tmppg;
+  struct SaveBuffer sb;
+  struct Page *pg;
   struct Layer *layer;
   struct Item *item;
-  int i, is_clone;
+  int i, pageno, is_clone, image_id, nimage_ids;
   char *tmpfn, *tmpstr;
-  gboolean success;
-  FILE *tmpf;
-  GList *pagelist, *layerlist, *itemlist, *list;
-  GtkWidget *dialog;
+  gboolean success, pdf_written;
+  GList *pagelist, *layerlist, *itemlist;
+  GHashTable *image_ids, *bg_clones;
+#ifdef SAVE_DEBUG
+  GTimer *timer = g_timer_new();
+#endif
   
-  f = gzopen_wrapper(filename, "wb");
-  if (f==NULL) return FALSE;
-  chk_attach_names();
-  if (is_auto)
-    ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(filename));
+  job->success = FALSE;
+  sb.str = job->xml;
+  sb.f = NULL;
+  if (sb.str == NULL) {
+    sb.f = g_fopen(job->filename, "wb");
+    if (sb.f==NULL) return;
+    if (job->is_auto)
+      job->written_files = g_list_append(job->written_files, g_strdup(job->filename));
+    sb.chunk = g_string_sized_new(GZMEMBER_SIZE + SAVEBUF_SIZE);
+    sb.members = g_ptr_array_new();
+    i = gzip_thread_count();
+    sb.pool = (i > 1) ? g_thread_pool_new(gz_compress_member, NULL, i, FALSE, NULL) : NULL;
+  }
+  sb.buf = g_malloc(SAVEBUF_SIZE);
+  sb.len = 0;
+  sb.failed = FALSE;
+  sb.total = 0;
 
-  setlocale(LC_NUMERIC, "C");
-  
-  gzprintf(f, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+  savebuf_puts(&sb, "<?xml version=\"1.0\" standalone=\"no\"?>\n"
      "<xournal version=\"" VERSION "\">\n"
      "<title>Xournal document - see http://math.mit.edu/~auroux/software/xournal/</title>\n");
-  for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
+  if (job->image_refs) image_ids = find_repeated_images(job->pages);
+  else image_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+  nimage_ids = 0;
+  bg_clones = g_hash_table_new(bg_clone_hash, bg_clone_equal);
+  pdf_written = FALSE;
+  for (pagelist = job->pages, pageno = 0; pagelist!=NULL; pagelist = pagelist->next, pageno++) {
     pg = (struct Page *)pagelist->data;
-    gzprintf(f, "<page width=\"%.2f\" height=\"%.2f\">\n", pg->width, pg->height);
-    gzprintf(f, "<background type=\"%s\" ", bgtype_names[pg->bg->type]); 
+    savebuf_puts(&sb, "<page width=\"");
+    savebuf_double(&sb, pg->width);
+    savebuf_puts(&sb, "\" height=\"");
+    savebuf_double(&sb, pg->height);
+    savebuf_puts(&sb, "\">\n<background type=\"");
+    savebuf_puts(&sb, bgtype_names[pg->bg->type]);
+    savebuf_puts(&sb, "\" ");
     if (pg->bg->type == BG_SOLID) {
-      gzputs(f, "color=\"");
-      if (pg->bg->color_no >= 0) gzputs(f, bgcolor_names[pg->bg->color_no]);
-      else gzprintf(f, "#%08x", pg->bg->color_rgba);
-      gzprintf(f, "\" style=\"%s\" ", bgstyle_names[pg->bg->ruling]);
+      savebuf_puts(&sb, "color=\"");
+      if (pg->bg->color_no >= 0) savebuf_puts(&sb, bgcolor_names[pg->bg->color_no]);
+      else savebuf_rgba(&sb, pg->bg->color_rgba);
+      savebuf_puts(&sb, "\" style=\"");
+      savebuf_puts(&sb, bgstyle_names[pg->bg->ruling]);
+      savebuf_puts(&sb, "\" ");
     }
     else if (pg->bg->type == BG_PIXMAP) {
-      is_clone = -1;
-      for (list = journal.pages, i = 0; list!=pagelist; list = list->next, i++) {
-        tmppg = (struct Page *)list->data;
-        if (tmppg->bg->type == BG_PIXMAP && 
-            tmppg->bg->pixbuf == pg->bg->pixbuf &&
-            tmppg->bg->filename == pg->bg->filename)
-          { is_clone = i; break; }
+      is_clone = GPOINTER_TO_INT(g_hash_table_lookup(bg_clones, pg->bg)) - 1;
+      if (is_clone < 0) g_hash_table_insert(bg_clones, pg->bg, GINT_TO_POINTER(pageno+1));
+      if (is_clone >= 0) {
+        savebuf_puts(&sb, "domain=\"clone\" filename=\"");
+        savebuf_int(&sb, is_clone);
+        savebuf_puts(&sb, "\" ");
       }
-      if (is_clone >= 0)
-        gzprintf(f, "domain=\"clone\" filename=\"%d\" ", is_clone);
       else {
-        if (pg->bg->file_domain == DOMAIN_ATTACH) {
-          tmpfn = g_strdup_printf("%s.%s", filename, pg->bg->filename->s);
-          if (is_auto)
-            ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(tmpfn));
-          if (!gdk_pixbuf_save(pg->bg->pixbuf, tmpfn, "png", NULL, NULL) && !is_auto) {
-            dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-              GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
-              _("Could not write background '%s'. Continuing anyway."), tmpfn);
-            wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
-            gtk_widget_destroy(dialog);
+        if (pg->bg->file_domain == DOMAIN_ATTACH && (job->attached == NULL ||
+              !g_hash_table_lookup(job->attached, pg->bg->filename->s))) {
+          tmpfn = g_strdup_printf("%s.%s", job->filename, pg->bg->filename->s);
+          if (job->is_auto)
+            job->written_files = g_list_append(job->written_files, g_strdup(tmpfn));
+          if (write_attachment((job->bg_files != NULL) ? 
+                  g_hash_table_lookup(job->bg_files, pg->bg->pixbuf) : NULL, tmpfn) ||
+              gdk_pixbuf_save(pg->bg->pixbuf, tmpfn, "png", NULL, NULL)) {
+            if (job->attached != NULL)
+              g_hash_table_insert(job->attached, g_strdup(pg->bg->filename->s), GINT_TO_POINTER(1));
+            if (job->bg_written == NULL)
+              job->bg_written = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, bgfile_free);
+            g_hash_table_insert(job->bg_written, pg->bg->pixbuf, bgfile_new(tmpfn));
           }
+          else if (!job->is_auto)
+            job->bg_errors = g_list_append(job->bg_errors, g_strdup(tmpfn));
           g_free(tmpfn);
         }
         tmpstr = g_markup_escape_text(pg->bg->filename->s, -1);
-        gzprintf(f, "domain=\"%s\" filename=\"%s\" ", 
-          file_domain_names[pg->bg->file_domain], tmpstr);
+        savebuf_puts(&sb, "domain=\"");
+        savebuf_puts(&sb, file_domain_names[pg->bg->file_domain]);
+        savebuf_puts(&sb, "\" filename=\"");
+        savebuf_puts(&sb, tmpstr);
+        savebuf_puts(&sb, "\" ");
         g_free(tmpstr);
       }
     }
     else if (pg->bg->type == BG_PDF) {
-      is_clone = 0;
-      for (list = journal.pages; list!=pagelist; list = list->next) {
-        tmppg = (struct Page *)list->data;
-        if (tmppg->bg->type == BG_PDF) { is_clone = 1; break; }
-      }
+      is_clone = pdf_written; // all the PDF pages come from the same file
+      pdf_written = TRUE;
       if (!is_clone) {
         if (pg->bg->file_domain == DOMAIN_ATTACH) {
-          tmpfn = g_strdup_printf("%s.%s", filename, pg->bg->filename->s);
-          success = FALSE;
-          if (bgpdf.status != STATUS_NOT_INIT && bgpdf.file_contents != NULL)
-          {
-            tmpf = g_fopen(tmpfn, "wb");
-            if (is_auto)
-              ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(tmpfn));
-            if (tmpf != NULL && fwrite(bgpdf.file_contents, 1, bgpdf.file_length, tmpf) == bgpdf.file_length)
-              success = TRUE;
-            fclose(tmpf);
-          }
-          if (!success && !is_auto) {
-            dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
-              GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
-              _("Could not write background '%s'. Continuing anyway."), tmpfn);
-            wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
-            gtk_widget_destroy(dialog);
-          }
+          tmpfn = g_strdup_printf("%s.%s", job->filename, pg->bg->filename->s);
+          if (job->is_auto)
+            job->written_files = g_list_append(job->written_files, g_strdup(tmpfn));
+          success = write_attachment(job->pdf_file, tmpfn);
+          // replace the file rather than overwrite it: it may be the one mapped
+          if (!success && job->pdf_data != NULL)
+            success = g_file_set_contents(tmpfn, job->pdf_data->contents,
+                                          job->pdf_data->length, NULL);
+          if (success) job->pdf_written = bgfile_new(tmpfn);
+          if (!success && !job->is_auto)
+            job->bg_errors = g_list_append(job->bg_errors, g_strdup(tmpfn));
           g_free(tmpfn);
         }
         tmpstr = g_markup_escape_text(pg->bg->filename->s, -1);
-        gzprintf(f, "domain=\"%s\" filename=\"%s\" ", 
-          file_domain_names[pg->bg->file_domain], tmpstr);
+        savebuf_puts(&sb, "domain=\"");
+        savebuf_puts(&sb, file_domain_names[pg->bg->file_domain]);
+        savebuf_puts(&sb, "\" filename=\"");
+        savebuf_puts(&sb, tmpstr);
+        savebuf_puts(&sb, "\" ");
         g_free(tmpstr);
       }
-      gzprintf(f, "pageno=\"%d\" ", pg->bg->file_page_seq);
+      savebuf_puts(&sb, "pageno=\"");
+      savebuf_int(&sb, pg->bg->file_page_seq);
+      savebuf_puts(&sb, "\" ");
     }
-    gzprintf(f, "/>\n");
+    savebuf_puts(&sb, "/>\n");
+    // a page that was never parsed is copied through as is
+    if (pg->lazy_layers != NULL) savebuf_puts(&sb, pg->lazy_layers->s);
     for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
       layer = (struct Layer *)layerlist->data;
-      gzprintf(f, "<layer>\n");
+      savebuf_puts(&sb, "<layer>\n");
       for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
         item = (struct Item *)itemlist->data;
         if (item->type == ITEM_STROKE) {
-          gzprintf(f, "<stroke tool=\"%s\" color=\"", 
-                          tool_names[item->brush.tool_type]);
+          savebuf_puts(&sb, "<stroke tool=\"");
+          savebuf_puts(&sb, tool_names[item->brush.tool_type]);
+          savebuf_puts(&sb, "\" color=\"");
           if (item->brush.color_no >= 0)
-            gzputs(f, color_names[item->brush.color_no]);
+            savebuf_puts(&sb, color_names[item->brush.color_no]);
           else
-            gzprintf(f, "#%08x", item->brush.color_rgba);
-          gzprintf(f, "\" width=\"%.2f", item->brush.thickness);
+            savebuf_rgba(&sb, item->brush.color_rgba);
+          savebuf_puts(&sb, "\" width=\"");
+          savebuf_double(&sb, item->brush.thickness);
           if (item->brush.variable_width)
-            for (i=0;i<item->path->num_points-1;i++)
-              gzprintf(f, " %.2f", item->widths[i]);
-          gzprintf(f, "\">\n");
-          for (i=0;i<2*item->path->num_points;i++)
-            gzprintf(f, "%.2f ", item->path->coords[i]);
-          gzprintf(f, "\n</stroke>\n");
+            for (i=0;i<item->path->num_points-1;i++) {
+              savebuf_write(&sb, " ", 1);
+              savebuf_double(&sb, item->widths[i]);
+            }
+          savebuf_puts(&sb, "\">\n");
+          for (i=0;i<2*item->path->num_points;i++) {
+            savebuf_double(&sb, item->path->coords[i]);
+            savebuf_write(&sb, " ", 1);
+          }
+          savebuf_puts(&sb, "\n</stroke>\n");
         }
         if (item->type == ITEM_TEXT) {
           tmpstr = g_markup_escape_text(item->font_name, -1);
-          gzprintf(f, "<text font=\"%s\" size=\"%.2f\" x=\"%.2f\" y=\"%.2f\" color=\"",
-            tmpstr, item->font_size, item->bbox.left, item->bbox.top);
+          savebuf_puts(&sb, "<text font=\"");
+          savebuf_puts(&sb, tmpstr);
+          savebuf_puts(&sb, "\" size=\"");
+          savebuf_double(&sb, item->font_size);
+          savebuf_puts(&sb, "\" x=\"");
+          savebuf_double(&sb, item->bbox.left);
+          savebuf_puts(&sb, "\" y=\"");
+          savebuf_double(&sb, item->bbox.top);
+          savebuf_puts(&sb, "\" color=\"");
           g_free(tmpstr);
           if (item->brush.color_no >= 0)
-            gzputs(f, color_names[item->brush.color_no]);
+            savebuf_puts(&sb, color_names[item->brush.color_no]);
           else
-            gzprintf(f, "#%08x", item->brush.color_rgba);
+            savebuf_rgba(&sb, item->brush.color_rgba);
           tmpstr = g_markup_escape_text(item->text, -1);
-          gzputs(f, "\">");
-          gzputs(f, tmpstr); // gzprintf() can't handle > 4095 bytes
-          gzputs(f, "</text>\n");
+          savebuf_puts(&sb, "\">");
+          savebuf_puts(&sb, tmpstr);
+          savebuf_puts(&sb, "</text>\n");
           g_free(tmpstr);
         }
         if (item->type == ITEM_IMAGE) {
-          gzprintf(f, "<image left=\"%.2f\" top=\"%.2f\" right=\"%.2f\" bottom=\"%.2f\">", 
-            item->bbox.left, item->bbox.top, item->bbox.right, item->bbox.bottom);
-          if (!write_image(f, item)) success = FALSE;
-          gzprintf(f, "</image>\n");
+          savebuf_puts(&sb, "<image left=\"");
+          savebuf_double(&sb, item->bbox.left);
+          savebuf_puts(&sb, "\" top=\"");
+          savebuf_double(&sb, item->bbox.top);
+          savebuf_puts(&sb, "\" right=\"");
+          savebuf_double(&sb, item->bbox.right);
+          savebuf_puts(&sb, "\" bottom=\"");
+          savebuf_double(&sb, item->bbox.bottom);
+          image_id = GPOINTER_TO_INT(g_hash_table_lookup(image_ids, item->image_png));
+          if (image_id > 0) { // written already
+            savebuf_puts(&sb, "\" ref=\"");
+            savebuf_int(&sb, image_id);
+            savebuf_puts(&sb, "\">");
+          } else {
+            if (image_id < 0) { // first of several
+              g_hash_table_insert(image_ids, item->image_png, GINT_TO_POINTER(++nimage_ids));
+              savebuf_puts(&sb, "\" id=\"");
+              savebuf_int(&sb, nimage_ids);
+            }
+            savebuf_puts(&sb, "\">");
+            write_image(&sb, item);
+          }
+          savebuf_puts(&sb, "</image>\n");
         }
       }
-      gzprintf(f, "</layer>\n");
+      savebuf_puts(&sb, "</layer>\n");
     }
-    gzprintf(f, "</page>\n");
+    savebuf_puts(&sb, "</page>\n");
   }
-  gzprintf(f, "</xournal>\n");
-  gzclose(f);
-  setlocale(LC_NUMERIC, "");
+  savebuf_puts(&sb, "</xournal>\n");
+  g_hash_table_destroy(image_ids);
+  g_hash_table_destroy(bg_clones);
+  savebuf_flush(&sb);
+  g_free(sb.buf);
+  savebuf_close(&sb);
+
+#ifdef SAVE_DEBUG
+  printf("DEBUG: saved %" G_GSIZE_FORMAT " bytes in %.3f s (%.1f MB/s)\n", sb.total,
+     g_timer_elapsed(timer, NULL), sb.total/1e6/g_timer_elapsed(timer, NULL));
+  g_timer_destroy(timer);
+#endif
+  job->success = !sb.failed;
+}
 
-  return TRUE;
+void note_bg_file(gpointer pixbuf, gpointer bf, gpointer job)
+{
+  if (bf == NULL) return;
+  if (((struct SaveJob *)job)->is_auto && g_object_get_data(G_OBJECT(pixbuf), BGFILE_KEY) != NULL)
+    return;
+  g_object_set_data_full(G_OBJECT(pixbuf), BGFILE_KEY, bgfile_copy(bf), bgfile_free);
+}
+
+// report the outcome of a save and free the job (main thread only)
+
+void finish_save_job(struct SaveJob *job)
+{
+  GList *list, *itemlist, *layerlist;
+  struct Page *pg;
+  struct Layer *layer;
+  struct Item *item;
+  GtkWidget *dialog;
+
+  if (job->is_auto)
+    ui.autosave_filename_list = g_list_concat(ui.autosave_filename_list, job->written_files);
+  else g_list_free(job->written_files); // always empty
+  for (list = job->bg_errors; list!=NULL; list = list->next) {
+    dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+      GTK_MESSAGE_ERROR, GTK_BUTTONS_OK, 
+      _("Could not write background '%s'. Continuing anyway."), (char *)list->data);
+    wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    g_free(list->data);
+  }
+  g_list_free(job->bg_errors);
+  if (job->callback != NULL) job->callback(job);
+
+  // the files just written are where the attachments are now (autosaves
+  // are deleted later on, so they only count if there was nothing better)
+  if (job->bg_written != NULL) {
+    g_hash_table_foreach(job->bg_written, note_bg_file, job);
+    g_hash_table_destroy(job->bg_written);
+  }
+  if (job->bg_files != NULL) g_hash_table_destroy(job->bg_files);
+  if (job->pdf_written != NULL && bgpdf.status != STATUS_NOT_INIT &&
+      (!job->is_auto || bgpdf.file_saved == NULL)) {
+    bgfile_free(bgpdf.file_saved);
+    bgpdf.file_saved = job->pdf_written;
+  }
+  else bgfile_free(job->pdf_written);
+  bgfile_free(job->pdf_file);
+
+  for (list = job->pages; list!=NULL; list = list->next) {
+    pg = (struct Page *)list->data;
+    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+      layer = (struct Layer *)layerlist->data;
+      for (itemlist = layer->items; itemlist!=NULL; itemlist = itemlist->next) {
+        item = (struct Item *)itemlist->data;
+        if (item->path != NULL) gnome_canvas_points_free(item->path);
+        free_widths(item->widths);
+        g_free(item->text);
+        g_free(item->font_name);
+        unref_image_data(item->image_png);
+        g_free(item);
+      }
+      g_list_free(layer->items);
+      g_free(layer);
+    }
+    g_list_free(pg->layers);
+    if (pg->lazy_layers != NULL) refstring_unref(pg->lazy_layers);
+    if (pg->bg->filename != NULL) refstring_unref(pg->bg->filename);
+    if (pg->bg->pixbuf != NULL) g_object_unref(pg->bg->pixbuf);
+    g_free(pg->bg);
+    g_free(pg);
+  }
+  g_list_free(job->pages);
+  unref_pdf_data(job->pdf_data);
+  g_free(job->filename);
+  g_free(job);
+}
+
+// saves the journal to a file: returns true on success, false on error
+
+gboolean save_journal(const char *filename, gboolean is_auto)
+{
+  struct SaveJob *job;
+  gboolean success;
+
+  job = save_journal_snapshot(filename, is_auto);
+  write_journal_snapshot(job);
+  success = job->success;
+  finish_save_job(job);
+  return success;
+}
+
+/* background saves: only one at a time. The worker thread writes the
+   snapshot, then hands the job back to the main loop via an idle callback;
+   the serial number protects against stale idle callbacks for jobs that
+   wait_for_background_save() already finished. */
+
+static int bg_save_serial = 0;
+
+gboolean background_save_done(gpointer serial)
+{
+  if (ui.bg_save_job == NULL || GPOINTER_TO_INT(serial) != bg_save_serial)
+    return FALSE; // already handled
+  wait_for_background_save();
+  return FALSE;
+}
+
+gpointer background_save_thread(gpointer data)
+{
+  write_journal_snapshot((struct SaveJob *)data);
+  g_idle_add(background_save_done, GINT_TO_POINTER(((struct SaveJob *)data)->serial));
+  return NULL;
+}
+
+void wait_for_background_save(void)
+{
+  struct SaveJob *job;
+
+  if (ui.bg_save_job == NULL) return;
+  job = ui.bg_save_job;
+  g_thread_join(job->thread);
+  ui.bg_save_job = NULL;
+  finish_save_job(job);
+}
+
+/* starts saving the journal on a worker thread; callback (if not NULL)
+   is invoked from the main loop once the save is complete, with
+   user_data available as job->user_data. Falls back
+   to a synchronous save if background saves are disabled or a thread
+   can't be created. */
+
+void save_journal_background(const char *filename, gboolean is_auto, 
+            void (*callback)(struct SaveJob *job), gpointer user_data)
+{
+  struct SaveJob *job;
+
+  wait_for_background_save();
+  job = save_journal_snapshot(filename, is_auto);
+  job->callback = callback;
+  job->user_data = user_data;
+  job->serial = ++bg_save_serial;
+  if (ui.background_save)
+#if GLIB_CHECK_VERSION(2,32,0)
+    job->thread = g_thread_try_new("save", background_save_thread, job, NULL);
+#else
+    job->thread = g_thread_create(background_save_thread, job, TRUE, NULL);
+#endif
+  if (job->thread == NULL) { // no thread, do it now
+    write_journal_snapshot(job);
+    finish_save_job(job);
+    return;
+  }
+  ui.bg_save_job = job;
 }
 
 // autosave stuff
@@ -320,6 +1120,19 @@ void autosave_cleanup(GList **list)
 #define g_timeout_add_seconds(interval, function, data) g_timeout_add(1000*interval, function, data)
 #endif
 
+void autosave_done(struct SaveJob *job)
+{
+  GList *old_filenames = (GList *)job->user_data;
+
+  if (job->success) autosave_cleanup(&old_filenames);
+  else { // aborted
+    autosave_cleanup(&ui.autosave_filename_list); 
+    ui.autosave_filename_list = old_filenames;
+    ui.need_autosave = TRUE;
+    editlog_reset(NULL);
+  }
+}
+
 gboolean autosave_cb(gpointer is_catchup)
 {
   GList *old_filenames;
@@ -340,8 +1153,15 @@ gboolean autosave_cb(gpointer is_catchup)
     ui.autosave_need_catchup = TRUE;
     return TRUE; // can't do it right now, come back later
   }
-  
-  // generate an autosave filename
+  if (ui.bg_save_job != NULL) // a save is still running, try again later
+    return TRUE;
+  // between full saves, only append the changes to the edit log
+  if (ui.editlog_base != NULL && !editlog_too_big() && editlog_write()) {
+    ui.need_autosave = FALSE;
+    return TRUE;
+  }
+  
+  // generate an autosave filename
   base_filename = candidate_save_filename();
   for (num=0; num<=AUTOSAVE_MAX; num++) {
     test_filename = g_strdup_printf(AUTOSAVE_FILENAME_TEMPLATE, base_filename, num);
@@ -354,13 +1174,9 @@ gboolean autosave_cb(gpointer is_catchup)
   // keep track of old save filenames
   old_filenames = ui.autosave_filename_list;
   ui.autosave_filename_list = NULL;
-  if (save_journal(test_filename, TRUE)) { // non-interactive save -> success
-    ui.need_autosave = FALSE; // no longer need an auto-save
-    autosave_cleanup(&old_filenames);
-  } else { // aborted
-    autosave_cleanup(&ui.autosave_filename_list); 
-    ui.autosave_filename_list = old_filenames;
-  }
+  ui.need_autosave = FALSE; // edits made during the save will set it again
+  editlog_reset(test_filename); // log further changes on top of this save
+  save_journal_background(test_filename, TRUE, autosave_done, old_filenames);
   g_free(test_filename);
   
   return TRUE; // continue with the timed loop, if we're in it
@@ -382,6 +1198,7 @@ void delete_autosave(char *filename)
   int k;
 
   g_unlink(filename);
+  delete_editlog(filename);
   attach_filename = g_strdup_printf("%s.bg.pdf", filename);
   g_unlink(attach_filename);
   k = 1;
@@ -393,14 +1210,19 @@ void delete_autosave(char *filename)
   g_free(attach_filename);
 }
 
-char *check_for_autosave(char *filename)
+/* look for auto-saves of filename and let the user pick one; the result
+   is the file to load, and *restore is set if it comes with unsaved
+   changes (an auto-save, or filename itself plus its edit log) */
+
+char *check_for_autosave(char *filename, gboolean *restore)
 {
   int num, count;
-  char *test_filename, *filter_str, *cand_filename;
+  char *test_filename, *filter_str, *cand_filename, *editlog_filename;
   GtkWidget *dialog;
   GtkResponseType response;
   GtkFileFilter *filt_all, *filt_autosave;
 
+  *restore = FALSE;
   count = 0;
   for (num=0; num<=AUTOSAVE_MAX; num++) {
     test_filename = g_strdup_printf(AUTOSAVE_FILENAME_TEMPLATE, filename, num);
@@ -410,12 +1232,23 @@ char *check_for_autosave(char *filename)
     }
     g_free(test_filename);
   }
-  if (count == 0) return g_strdup(filename); // no auto-saves
+  // changes logged on top of filename itself
+  editlog_filename = g_strdup_printf(EDITLOG_FILENAME_TEMPLATE, filename);
+  if (g_file_test(editlog_filename, G_FILE_TEST_EXISTS)) {
+    if (!count) cand_filename = g_strdup(filename);
+    count++;
+  }
+  if (count == 0) { // no auto-saves
+    g_free(editlog_filename);
+    return g_strdup(filename);
+  }
 
   // auto-save file found, ask user what to do about it.
   dialog = gtk_message_dialog_new(GTK_WINDOW (winMain), GTK_DIALOG_MODAL,
      GTK_MESSAGE_WARNING, GTK_BUTTONS_NONE, 
-     _("%d auto-save files were found, including '%s'"), count, xo_basename(cand_filename, TRUE));
+     _("%d auto-save files were found, including '%s'"), count, 
+     xo_basename(strcmp(cand_filename, filename) ? cand_filename : editlog_filename, TRUE));
+  g_free(editlog_filename);
   gtk_dialog_add_button(GTK_DIALOG(dialog), _("Ignore"), GTK_RESPONSE_NO);
   gtk_dialog_add_button(GTK_DIALOG(dialog), _("Restore auto-save"), GTK_RESPONSE_YES);
   gtk_dialog_add_button(GTK_DIALOG(dialog), _("Delete auto-saves"), GTK_RESPONSE_REJECT);
@@ -431,6 +1264,7 @@ char *check_for_autosave(char *filename)
         delete_autosave(test_filename);
       g_free(test_filename);
     }
+    delete_editlog(filename);
     set_cursor_busy(FALSE);
   }
   
@@ -438,6 +1272,7 @@ char *check_for_autosave(char *filename)
     g_free(cand_filename);
     return g_strdup(filename); // ignore/delete
   }
+  *restore = TRUE;
   
   // restore: ask user to pick one, if there's more than one
   if (count > 1) {
@@ -463,6 +1298,7 @@ char *check_for_autosave(char *filename)
     gtk_dialog_set_default_response(GTK_DIALOG(dialog), GTK_RESPONSE_OK);
     if (wrapper_gtk_dialog_run(GTK_DIALOG(dialog)) != GTK_RESPONSE_OK) {
       gtk_widget_destroy(dialog);
+      *restore = FALSE;
       return g_strdup(filename);
     }
     cand_filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
@@ -487,6 +1323,7 @@ gboolean close_journal(void)
 
   shutdown_bgpdf();
   delete_journal(&journal);
+  reset_page_index();
   autosave_cleanup(&ui.autosave_filename_list);
   
   return TRUE;
@@ -507,23 +1344,81 @@ void cleanup_numeric(char *s)
   }
 }
 
+/* g_ascii_strtod() after cleanup_numeric(), but leaving s alone: it may
+   point into the document being parsed. Only a number that needs cleaning
+   up is copied, and only as far as the next space. */
+
+double cleanup_strtod(const gchar *s, gchar **endptr)
+{
+  const gchar *p;
+  gchar *copy, *end;
+  double val;
+
+  for (p = s; g_ascii_isspace(*p); p++);
+  while (*p != 0 && !g_ascii_isspace(*p) && *p != ',' && *p != '#') p++;
+  if (*p != ',' && *p != '#') return g_ascii_strtod(s, endptr);
+  while (*p != 0 && !g_ascii_isspace(*p)) p++;
+  copy = g_strndup(s, p-s);
+  cleanup_numeric(copy);
+  val = g_ascii_strtod(copy, &end);
+  if (end != copy) while (g_ascii_isspace(*end)) end++; // 1.#J became "inf "
+  *endptr = (gchar *)s + (end - copy);
+  g_free(copy);
+  return val;
+}
+
 // the XML parser functions for open_journal()
 
 struct Journal tmpJournal;
 struct Page *tmpPage;
 struct Layer *tmpLayer;
 struct Item *tmpItem;
+GList *tmpLastPage; // the last link of tmpJournal.pages
+GPtrArray *tmpPageIndex; // the pages of tmpJournal, by number
+int tmpImageId; // id of the current image, if it has copies (see find_repeated_images())
 char *tmpFilename;
 struct Background *tmpBg_pdf;
+GList *tmpLazyLayers; // unparsed layers of the coming pages, see split_lazy_pages()
+#ifdef LOAD_DEBUG
+GTimer *load_timer; // time spent in parse_coords()
+gulong load_points;
+#endif
 
 GError *xoj_invalid(void)
 {
   return g_error_new(G_MARKUP_ERROR, G_MARKUP_ERROR_INVALID_CONTENT, _("Invalid file contents"));
 }
 
-void xoj_parser_start_element(GMarkupParseContext *context,
-   const gchar *element_name, const gchar **attribute_names, 
-   const gchar **attribute_values, gpointer user_data, GError **error)
+enum { XOJ_OTHER, XOJ_XOURNAL, XOJ_TITLE, XOJ_PAGE, XOJ_BACKGROUND, 
+       XOJ_LAYER, XOJ_STROKE, XOJ_TEXT, XOJ_IMAGE };
+
+int xoj_element_id(const gchar *name, int len)
+{
+  switch (len) {
+    case 4: 
+      if (!strncmp(name, "page", 4)) return XOJ_PAGE;
+      if (!strncmp(name, "text", 4)) return XOJ_TEXT;
+      break;
+    case 5:
+      if (!strncmp(name, "layer", 5)) return XOJ_LAYER;
+      if (!strncmp(name, "image", 5)) return XOJ_IMAGE;
+      if (!strncmp(name, "title", 5)) return XOJ_TITLE;
+      break;
+    case 6:
+      if (!strncmp(name, "stroke", 6)) return XOJ_STROKE;
+      break;
+    case 7:
+      if (!strncmp(name, "xournal", 7)) return XOJ_XOURNAL;
+      break;
+    case 10:
+      if (!strncmp(name, "background", 10)) return XOJ_BACKGROUND;
+      break;
+  }
+  return XOJ_OTHER;
+}
+
+void xoj_start_element(int element, const gchar **attribute_names, 
+   const gchar **attribute_values, GError **error)
 {
   int has_attr, i;
   char *ptr, *tmpptr;
@@ -532,14 +1427,14 @@ void xoj_parser_start_element(GMarkupParseContext *context,
   gdouble val;
   GtkWidget *dialog;
   
-  if (!strcmp(element_name, "title") || !strcmp(element_name, "xournal")) {
+  if (element == XOJ_TITLE || element == XOJ_XOURNAL) {
     if (tmpPage != NULL) {
       *error = xoj_invalid();
       return;
     }
     // nothing special to do
   }
-  else if (!strcmp(element_name, "page")) { // start of a page
+  else if (element == XOJ_PAGE) { // start of a page
     if (tmpPage != NULL) {
       *error = xoj_invalid();
       return;
@@ -553,22 +1448,34 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     tmpPage->bg->canvas_item = NULL;
     tmpPage->bg->pixbuf = NULL;
     tmpPage->bg->filename = NULL;
-    tmpJournal.pages = g_list_append(tmpJournal.pages, tmpPage);
+    tmpPage->lazy_layers = NULL;
+    if (tmpLazyLayers != NULL) {
+      tmpPage->lazy_layers = new_refstring(NULL);
+      tmpPage->lazy_layers->s = (gchar *)tmpLazyLayers->data; // taken over
+      tmpLazyLayers = g_list_delete_link(tmpLazyLayers, tmpLazyLayers);
+    }
+    // keep the last link and an array of the pages, so that appending a
+    // page and resolving clones don't walk the list
+    if (tmpJournal.npages == 0) {
+      if (tmpPageIndex == NULL) tmpPageIndex = g_ptr_array_new();
+      g_ptr_array_set_size(tmpPageIndex, 0);
+      tmpJournal.pages = tmpLastPage = g_list_append(NULL, tmpPage);
+    }
+    else tmpLastPage = g_list_append(tmpLastPage, tmpPage)->next;
+    g_ptr_array_add(tmpPageIndex, tmpPage);
     tmpJournal.npages++;
     // scan for height and width attributes
     has_attr = 0;
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "width")) {
         if (has_attr & 1) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpPage->width = g_ascii_strtod(*attribute_values, &ptr);
+        tmpPage->width = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "height")) {
         if (has_attr & 2) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpPage->height = g_ascii_strtod(*attribute_values, &ptr);
+        tmpPage->height = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
@@ -578,7 +1485,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     }
     if (has_attr!=3) *error = xoj_invalid();
   }
-  else if (!strcmp(element_name, "background")) {
+  else if (element == XOJ_BACKGROUND) {
     if (tmpPage == NULL || tmpLayer !=NULL || tmpPage->bg->type >= 0) {
       *error = xoj_invalid();
       return;
@@ -646,7 +1553,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
           i = strtol(*attribute_values, &ptr, 10);
           if (ptr == *attribute_values || i < 0 || i > tmpJournal.npages-2)
             { *error = xoj_invalid(); return; }
-          tmpbg = ((struct Page *)g_list_nth_data(tmpJournal.pages, i))->bg;
+          tmpbg = ((struct Page *)g_ptr_array_index(tmpPageIndex, i))->bg;
           if (tmpbg->type != tmpPage->bg->type)
             { *error = xoj_invalid(); return; }
           tmpPage->bg->filename = refstring_ref(tmpbg->filename);
@@ -665,6 +1572,9 @@ void xoj_parser_start_element(GMarkupParseContext *context,
             }
             else tmpbg_filename = g_strdup(*attribute_values);
             tmpPage->bg->pixbuf = gdk_pixbuf_new_from_file(tmpbg_filename, NULL);
+            if (tmpPage->bg->pixbuf != NULL && tmpPage->bg->file_domain == DOMAIN_ATTACH)
+              g_object_set_data_full(G_OBJECT(tmpPage->bg->pixbuf), BGFILE_KEY, 
+                                     bgfile_new(tmpbg_filename), bgfile_free);
             if (tmpPage->bg->pixbuf == NULL) {
               dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
                 GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
@@ -696,7 +1606,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     if (tmpPage->bg->type == BG_PIXMAP && has_attr != 25) *error = xoj_invalid();
     if (tmpPage->bg->type == BG_PDF && has_attr != 57) *error = xoj_invalid();
   }
-  else if (!strcmp(element_name, "layer")) { // start of a layer
+  else if (element == XOJ_LAYER) { // start of a layer
     if (tmpPage == NULL || tmpLayer != NULL) {
       *error = xoj_invalid();
       return;
@@ -708,7 +1618,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     tmpPage->layers = g_list_append(tmpPage->layers, tmpLayer);
     tmpPage->nlayers++;
   }
-  else if (!strcmp(element_name, "stroke")) { // start of a stroke
+  else if (element == XOJ_STROKE) { // start of a stroke
     if (tmpLayer == NULL || tmpItem != NULL) {
       *error = xoj_invalid();
       return;
@@ -725,13 +1635,12 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "width")) {
         if (has_attr & 1) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->brush.thickness = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->brush.thickness = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         i = 0;
         while (*ptr!=0) {
           realloc_cur_widths(i+1);
-          ui.cur_widths[i] = g_ascii_strtod(ptr, &tmpptr);
+          ui.cur_widths[i] = cleanup_strtod(ptr, &tmpptr);
           if (tmpptr == ptr) break;
           ptr = tmpptr;
           i++;
@@ -784,7 +1693,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
         tmpItem->brush.color_rgba &= ui.hiliter_alpha_mask;
     }
   }
-  else if (!strcmp(element_name, "text")) { // start of a text item
+  else if (element == XOJ_TEXT) { // start of a text item
     if (tmpLayer == NULL || tmpItem != NULL) {
       *error = xoj_invalid();
       return;
@@ -804,22 +1713,19 @@ void xoj_parser_start_element(GMarkupParseContext *context,
       }
       else if (!strcmp(*attribute_names, "size")) {
         if (has_attr & 2) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->font_size = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->font_size = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "x")) {
         if (has_attr & 4) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->bbox.left = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 4;
       }
       else if (!strcmp(*attribute_names, "y")) {
         if (has_attr & 8) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->bbox.top = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 8;
       }
@@ -844,7 +1750,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     }
     if (has_attr!=31) *error = xoj_invalid();
   }
-  else if (!strcmp(element_name, "image")) { // start of a image item
+  else if (element == XOJ_IMAGE) { // start of a image item
     if (tmpLayer == NULL || tmpItem != NULL) {
       *error = xoj_invalid();
       return;
@@ -855,6 +1761,7 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     tmpItem->image=NULL;
     tmpItem->image_png = NULL;
     tmpItem->image_png_len = 0;
+    tmpImageId = 0;
     tmpLayer->items = g_list_append(tmpLayer->items, tmpItem);
     tmpLayer->nitems++;
     // scan for x, y
@@ -862,59 +1769,78 @@ void xoj_parser_start_element(GMarkupParseContext *context,
     while (*attribute_names!=NULL) {
       if (!strcmp(*attribute_names, "left")) {
         if (has_attr & 1) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.left = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->bbox.left = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 1;
       }
       else if (!strcmp(*attribute_names, "top")) {
         if (has_attr & 2) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.top = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->bbox.top = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 2;
       }
       else if (!strcmp(*attribute_names, "right")) {
         if (has_attr & 4) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.right = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->bbox.right = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 4;
       }
       else if (!strcmp(*attribute_names, "bottom")) {
         if (has_attr & 8) *error = xoj_invalid();
-        cleanup_numeric((gchar *)*attribute_values);
-        tmpItem->bbox.bottom = g_ascii_strtod(*attribute_values, &ptr);
+        tmpItem->bbox.bottom = cleanup_strtod(*attribute_values, &ptr);
         if (ptr == *attribute_values) *error = xoj_invalid();
         has_attr |= 8;
       }
+      else if (!strcmp(*attribute_names, "format")) {
+        // optional: the data identifies itself (see image_data_format())
+        if (has_attr & 16) *error = xoj_invalid();
+        has_attr |= 16;
+      }
+      else if (!strcmp(*attribute_names, "id")) { // the first of several copies
+        if (has_attr & 32) *error = xoj_invalid();
+        tmpImageId = strtol(*attribute_values, &ptr, 10);
+        if (ptr == *attribute_values || tmpImageId <= 0) *error = xoj_invalid();
+        has_attr |= 32;
+      }
+      else if (!strcmp(*attribute_names, "ref")) { // a copy of an earlier image
+        if (has_attr & 64) *error = xoj_invalid();
+        i = strtol(*attribute_values, &ptr, 10);
+        tmpptr = (tmpJournal.image_ids != NULL) ? 
+          g_hash_table_lookup(tmpJournal.image_ids, GINT_TO_POINTER(i)) : NULL;
+        if (ptr == *attribute_values || tmpptr == NULL) *error = xoj_invalid();
+        else if (tmpItem->image_png == NULL) {
+          tmpItem->image_png_len = image_data_length(tmpptr);
+          tmpItem->image_png = ref_image_data(tmpptr, tmpItem->image_png_len);
+        }
+        has_attr |= 64;
+      }
       else *error = xoj_invalid();
       attribute_names++;
       attribute_values++;
     }
-    if (has_attr!=15) *error = xoj_invalid();
+    if ((has_attr & 15) != 15 || (has_attr & 96) == 96) *error = xoj_invalid();
   }
 }
 
-void xoj_parser_end_element(GMarkupParseContext *context,
-   const gchar *element_name, gpointer user_data, GError **error)
+void xoj_end_element(int element, GError **error)
 {
-  if (!strcmp(element_name, "page")) {
+  if (element == XOJ_PAGE) {
     if (tmpPage == NULL || tmpLayer != NULL) {
       *error = xoj_invalid();
       return;
     }
-    if (tmpPage->nlayers == 0 || tmpPage->bg->type < 0) *error = xoj_invalid();
+    if ((tmpPage->nlayers == 0 && tmpPage->lazy_layers == NULL) || 
+        tmpPage->bg->type < 0) *error = xoj_invalid();
     tmpPage = NULL;
   }
-  if (!strcmp(element_name, "layer")) {
+  if (element == XOJ_LAYER) {
     if (tmpLayer == NULL || tmpItem != NULL) {
       *error = xoj_invalid();
       return;
     }
     tmpLayer = NULL;
   }
-  if (!strcmp(element_name, "stroke")) {
+  if (element == XOJ_STROKE) {
     if (tmpItem == NULL) {
       *error = xoj_invalid();
       return;
@@ -922,60 +1848,348 @@ void xoj_parser_end_element(GMarkupParseContext *context,
     update_item_bbox(tmpItem);
     tmpItem = NULL;
   }
-  if (!strcmp(element_name, "text")) {
+  if (element == XOJ_TEXT) {
     if (tmpItem == NULL) {
       *error = xoj_invalid();
       return;
     }
     tmpItem = NULL;
   }
-  if (!strcmp(element_name, "image")) {
+  if (element == XOJ_IMAGE) {
     if (tmpItem == NULL) {
       *error = xoj_invalid();
       return;
     }
+    if (tmpImageId > 0 && tmpItem->image_png != NULL) { // for the later copies
+      if (tmpJournal.image_ids == NULL)
+        tmpJournal.image_ids = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                                     NULL, unref_image_data);
+      g_hash_table_insert(tmpJournal.image_ids, GINT_TO_POINTER(tmpImageId),
+        ref_image_data(tmpItem->image_png, tmpItem->image_png_len));
+    }
     tmpItem = NULL;
   }
 }
 
-void xoj_parser_text(GMarkupParseContext *context,
-   const gchar *text, gsize text_len, gpointer user_data, GError **error)
+/* Reads the coordinates of a stroke into ui.cur_path.coords, and returns
+   how many numbers were read. Numbers like those we write ("%.2f", at most
+   15 digits) are converted as an integer divided by a power of 10, which
+   is exact since both fit in a double, so the result is the same as
+   g_ascii_strtod()'s. Anything else (exponents, "inf", decimal commas,
+   Windows' "1.#J") goes through cleanup_strtod(). The text must be
+   null-terminated; it isn't modified. */
+
+static const double pow10_table[16] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+  1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+
+int parse_coords(const gchar *text, gsize text_len)
+{
+  const gchar *p, *start;
+  gchar *ptr;
+  guint64 mant;
+  int n, ndigits, nfrac;
+  gboolean neg;
+  double val;
+
+  // each number takes at least 2 characters with its separator
+  realloc_cur_path(text_len/4 + 2);
+  p = text;
+  n = 0;
+  while (TRUE) {
+    while (g_ascii_isspace(*p)) p++;
+    start = p;
+    neg = (*p == '-');
+    if (neg) p++;
+    mant = 0;
+    ndigits = nfrac = 0;
+    while (*p >= '0' && *p <= '9') { mant = 10*mant + (*p - '0'); p++; ndigits++; }
+    if (*p == '.') {
+      p++;
+      while (*p >= '0' && *p <= '9') { mant = 10*mant + (*p - '0'); p++; ndigits++; nfrac++; }
+    }
+    if (ndigits > 0 && ndigits <= 15 && (*p == 0 || g_ascii_isspace(*p))) {
+      val = (double)mant / pow10_table[nfrac];
+      if (neg) val = -val;
+    } else { // the slow path
+      val = cleanup_strtod(start, &ptr);
+      if (ptr == start) break;
+      p = ptr;
+    }
+    if (n >= 2*ui.cur_path_storage_alloc) realloc_cur_path(n/2 + 1);
+    if (!finite_sized(val)) val = (n>=2) ? ui.cur_path.coords[n-2] : 0;
+    ui.cur_path.coords[n++] = val;
+  }
+  return n;
+}
+
+// text must be followed by a null character (which isn't counted in text_len)
+
+void xoj_text(const gchar *text, gsize text_len, GError **error)
 {
-  const gchar *element_name, *ptr;
   int n;
   
-  element_name = g_markup_parse_context_get_element(context);
-  if (element_name == NULL) return;
-  if (!strcmp(element_name, "stroke")) {
-    cleanup_numeric((gchar *)text);
-    ptr = text;
-    n = 0;
-    while (text_len > 0) {
-      realloc_cur_path(n/2 + 1);
-      ui.cur_path.coords[n] = g_ascii_strtod(text, (char **)(&ptr));
-      if (ptr == text) break;
-      text_len -= (ptr - text);
-      text = ptr;
-      if (!finite_sized(ui.cur_path.coords[n])) {
-        if (n>=2) ui.cur_path.coords[n] = ui.cur_path.coords[n-2];
-        else ui.cur_path.coords[n] = 0;
-      }
-      n++;
-    }
+  // only the items have text contents
+  if (tmpItem == NULL) return;
+  if (tmpItem->type == ITEM_STROKE) {
+#ifdef LOAD_DEBUG
+    if (load_timer == NULL) load_timer = g_timer_new();
+    else g_timer_continue(load_timer);
+#endif
+    n = parse_coords(text, text_len);
+#ifdef LOAD_DEBUG
+    g_timer_stop(load_timer);
+    load_points += n/2;
+#endif
     if (n<4 || n&1 || 
         (tmpItem->brush.variable_width && (n!=2*ui.cur_path.num_points))) 
       { *error = xoj_invalid(); return; } // wrong number of points
     tmpItem->path = gnome_canvas_points_new(n/2);
     g_memmove(tmpItem->path->coords, ui.cur_path.coords, n*sizeof(double));
   }
-  if (!strcmp(element_name, "text")) {
+  if (tmpItem->type == ITEM_TEXT) {
     tmpItem->text = g_malloc(text_len+1);
     g_memmove(tmpItem->text, text, text_len);
     tmpItem->text[text_len]=0;
   }
-  if (!strcmp(element_name, "image")) {
-    tmpItem->image = read_pixbuf(text, text_len);
+  if (tmpItem->type == ITEM_IMAGE) { // only decoded when displayed
+    unref_image_data(tmpItem->image_png);
+    tmpItem->image_png = (gchar *)g_base64_decode(text, &tmpItem->image_png_len);
+    tmpItem->image_png = intern_image_data(tmpItem->image_png, tmpItem->image_png_len);
+  }
+}
+
+// the GMarkup callbacks
+
+void xoj_parser_start_element(GMarkupParseContext *context,
+   const gchar *element_name, const gchar **attribute_names,
+   const gchar **attribute_values, gpointer user_data, GError **error)
+{
+  xoj_start_element(xoj_element_id(element_name, strlen(element_name)),
+                    attribute_names, attribute_values, error);
+}
+
+void xoj_parser_end_element(GMarkupParseContext *context,
+   const gchar *element_name, gpointer user_data, GError **error)
+{
+  xoj_end_element(xoj_element_id(element_name, strlen(element_name)), error);
+}
+
+void xoj_parser_text(GMarkupParseContext *context,
+   const gchar *text, gsize text_len, gpointer user_data, GError **error)
+{
+  xoj_text(text, text_len, error);
+}
+
+/* A tokenizer for the subset of XML that xournal writes. It works in place
+   on the document: names and values are null-terminated by temporarily
+   overwriting the character after them, so stroke coordinates are never
+   copied. Only values with entities or carriage returns are unescaped into
+   a copy, as GMarkup would do. Returns 1 on success, 0 if the callbacks
+   found the contents invalid, and -1 on anything it doesn't handle
+   (comments, DOCTYPE, CDATA, unknown entities, malformed markup). With
+   check_only, the callbacks aren't called: this tells whether a real
+   pass could fall back halfway, after loading backgrounds and such. */
+
+#define XOJ_MAX_ATTRS 16
+#define XOJ_MAX_DEPTH 16
+
+gboolean xoj_is_name_char(gchar c)
+{
+  return g_ascii_isalnum(c) || c == '_' || c == '-' || c == ':' || c == '.';
+}
+
+// returns an unescaped copy, or NULL if there's an entity we don't know
+
+gchar *xoj_unescape(const gchar *s, gsize len)
+{
+  GString *str;
+  const gchar *end, *semi;
+  gunichar c;
+
+  str = g_string_sized_new(len);
+  end = s + len;
+  while (s < end) {
+    if (*s == '\r') {
+      g_string_append_c(str, '\n');
+      if (s+1 < end && s[1] == '\n') s++;
+      s++;
+      continue;
+    }
+    if (*s != '&') { g_string_append_c(str, *s); s++; continue; }
+    semi = memchr(s, ';', end-s);
+    if (semi == NULL) break;
+    if (semi-s == 3 && !strncmp(s, "&lt;", 4)) g_string_append_c(str, '<');
+    else if (semi-s == 3 && !strncmp(s, "&gt;", 4)) g_string_append_c(str, '>');
+    else if (semi-s == 4 && !strncmp(s, "&amp;", 5)) g_string_append_c(str, '&');
+    else if (semi-s == 5 && !strncmp(s, "&quot;", 6)) g_string_append_c(str, '"');
+    else if (semi-s == 5 && !strncmp(s, "&apos;", 6)) g_string_append_c(str, '\'');
+    else if (semi-s >= 3 && s[1] == '#') {
+      if (s[2] == 'x') c = strtoul(s+3, NULL, 16);
+      else c = strtoul(s+2, NULL, 10);
+      if (c == 0 || !g_unichar_validate(c)) break;
+      g_string_append_unichar(str, c);
+    }
+    else break;
+    s = semi+1;
+  }
+  if (s < end) { g_string_free(str, TRUE); return NULL; }
+  return g_string_free(str, FALSE);
+}
+
+int xoj_parse_fast(gchar *buf, gsize len, gboolean check_only, GError **error)
+{
+  gchar *p, *q, *r, *end, *name, *val;
+  gchar *saved_pos[2*XOJ_MAX_ATTRS], saved_char[2*XOJ_MAX_ATTRS];
+  const gchar *attr_names[XOJ_MAX_ATTRS+1], *attr_values[XOJ_MAX_ATTRS+1];
+  gchar *copies[XOJ_MAX_ATTRS];
+  gchar *stack_name[XOJ_MAX_DEPTH];
+  int stack_len[XOJ_MAX_DEPTH], stack_id[XOJ_MAX_DEPTH];
+  int depth, nattr, nsaved, ncopies, namelen, id, i;
+  gboolean selfclose, closed;
+  gchar quote, c;
+
+  p = buf;
+  end = buf + len;
+  depth = 0;
+  while (p < end) {
+    if (*p != '<') { // text contents
+      q = memchr(p, '<', end-p);
+      if (q == NULL) q = end;
+      if (depth == 0) {
+        for (; p < q; p++) if (!g_ascii_isspace(*p)) return -1;
+        continue;
+      }
+      if (q == end) return -1;
+      if (tmpItem != NULL || check_only) {
+        for (val = p; val < q; val++) if (*val == '&' || *val == '\r') break;
+        if (val < q) {
+          val = xoj_unescape(p, q-p);
+          if (val == NULL) return -1;
+          if (!check_only) xoj_text(val, strlen(val), error);
+          g_free(val);
+        } else if (!check_only) {
+          *q = 0;
+          xoj_text(p, q-p, error);
+          *q = '<';
+        }
+        if (*error != NULL) return 0;
+      }
+      p = q;
+      continue;
+    }
+    p++;
+    if (p >= end) return -1;
+    if (*p == '?') { // processing instruction, e.g. <?xml ... ?>
+      for (q = p+1; q+1 < end && (q[0] != '?' || q[1] != '>'); q++);
+      if (q+1 >= end) return -1;
+      p = q+2;
+      continue;
+    }
+    if (*p == '!') return -1; // comment, DOCTYPE or CDATA
+    if (*p == '/') { // end tag
+      name = ++p;
+      while (p < end && xoj_is_name_char(*p)) p++;
+      namelen = p - name;
+      while (p < end && g_ascii_isspace(*p)) p++;
+      if (p >= end || *p != '>' || depth == 0) return -1;
+      depth--;
+      if (namelen != stack_len[depth] || strncmp(name, stack_name[depth], namelen))
+        return -1;
+      p++;
+      if (!check_only) xoj_end_element(stack_id[depth], error);
+      if (*error != NULL) return 0;
+      continue;
+    }
+
+    // start tag: collect the attributes, then check we reached the '>'
+    name = p;
+    while (p < end && xoj_is_name_char(*p)) p++;
+    namelen = p - name;
+    if (namelen == 0 || p >= end) return -1;
+    id = xoj_element_id(name, namelen);
+    nattr = nsaved = ncopies = 0;
+    selfclose = closed = FALSE;
+    while (TRUE) {
+      q = p;
+      while (p < end && g_ascii_isspace(*p)) p++;
+      if (p >= end || *p == '>') { closed = TRUE; break; }
+      if (*p == '/') { selfclose = closed = TRUE; p++; break; }
+      if (p == q || nattr == XOJ_MAX_ATTRS) break; // no space before the name
+      attr_names[nattr] = p;
+      while (p < end && xoj_is_name_char(*p)) p++;
+      if (p == attr_names[nattr] || p >= end) break;
+      q = p;
+      while (p < end && g_ascii_isspace(*p)) p++;
+      if (p >= end || *p != '=') break;
+      p++;
+      while (p < end && g_ascii_isspace(*p)) p++;
+      if (p >= end || (*p != '"' && *p != '\'')) break;
+      quote = *(p++);
+      val = memchr(p, quote, end-p);
+      if (val == NULL) break;
+      for (r = p; r < val; r++)
+        if (*r == '&' || *r == '\r' || *r == '<') break;
+      if (r < val) {
+        if (*r == '<' || (copies[ncopies] = xoj_unescape(p, val-p)) == NULL) break;
+        attr_values[nattr] = copies[ncopies++];
+      } else {
+        saved_pos[nsaved] = val;
+        saved_char[nsaved++] = quote;
+        *val = 0;
+        attr_values[nattr] = p;
+      }
+      saved_pos[nsaved] = q; // terminate the attribute name
+      saved_char[nsaved++] = *q;
+      *q = 0;
+      nattr++;
+      p = val+1;
+    }
+    // any other way out of the loop is an attribute we couldn't read
+    c = (closed && p < end) ? *p : 0;
+    if (c == '>' && !check_only) {
+      attr_names[nattr] = attr_values[nattr] = NULL;
+      xoj_start_element(id, attr_names, attr_values, error);
+    }
+    for (i=nsaved-1; i>=0; i--) *saved_pos[i] = saved_char[i];
+    for (i=0; i<ncopies; i++) g_free(copies[i]);
+    if (c != '>') return -1;
+    if (*error != NULL) return 0;
+    p++;
+    if (selfclose && !check_only) {
+      xoj_end_element(id, error);
+      if (*error != NULL) return 0;
+    } else if (!selfclose) {
+      if (depth == XOJ_MAX_DEPTH) return -1;
+      stack_name[depth] = name;
+      stack_len[depth] = namelen;
+      stack_id[depth] = id;
+      depth++;
+    }
   }
+  return (depth == 0) ? 1 : -1;
+}
+
+/* Parses a whole document in buf (which must be writable, but is left as
+   it was) into tmpJournal. The fast tokenizer does the work unless a first
+   pass finds something unusual, in which case GMarkup does it instead. The
+   extra pass only tokenizes, which is cheap next to parsing the strokes. */
+
+gboolean xoj_parse_buffer(gchar *buf, gsize len, GError **error)
+{
+  const GMarkupParser parser = { xoj_parser_start_element, 
+                                 xoj_parser_end_element, 
+                                 xoj_parser_text, NULL, NULL};
+  GMarkupParseContext *context;
+  gboolean valid;
+  
+  if (xoj_parse_fast(buf, len, TRUE, error) > 0)
+    return (xoj_parse_fast(buf, len, FALSE, error) > 0);
+
+  context = g_markup_parse_context_new(&parser, 0, NULL, NULL);
+  valid = g_markup_parse_context_parse(context, buf, len, error);
+  if (valid) valid = g_markup_parse_context_end_parse(context, error);
+  g_markup_parse_context_free(context);
+  return valid;
 }
 
 gboolean user_wants_second_chance(char **filename)
@@ -1019,6 +2233,134 @@ gboolean user_wants_second_chance(char **filename)
   return TRUE;    
 }
 
+/* Finds the pages of an uncompressed xoj file and cuts out their layers,
+   which are queued in tmpLazyLayers for the parser to attach to the pages.
+   Returns the remaining document: the pages with only their backgrounds.
+   Text and attribute values are escaped, so "<page" and "<layer" can only
+   be actual tags. */
+
+GString *split_lazy_pages(const gchar *contents)
+{
+  GString *skeleton;
+  const gchar *p, *pg_start, *pg_end, *layer_start;
+
+  skeleton = g_string_sized_new(4096);
+  p = contents;
+  while ((pg_start = strstr(p, "<page")) != NULL) {
+    if (!g_ascii_isspace(pg_start[5]) && pg_start[5]!='>') {
+      g_string_append_len(skeleton, p, pg_start+5-p);
+      p = pg_start+5;
+      continue;
+    }
+    pg_end = strstr(pg_start, "</page>");
+    if (pg_end == NULL) break; // leave it to the parser to complain
+    layer_start = strstr(pg_start, "<layer");
+    if (layer_start == NULL || layer_start > pg_end) layer_start = pg_end;
+    g_string_append_len(skeleton, p, layer_start-p);
+    g_string_append(skeleton, "</page>");
+    tmpLazyLayers = g_list_prepend(tmpLazyLayers, 
+       (layer_start < pg_end) ? g_strndup(layer_start, pg_end-layer_start) : NULL);
+    p = pg_end + 7;
+  }
+  tmpLazyLayers = g_list_reverse(tmpLazyLayers);
+  g_string_append(skeleton, p);
+  return skeleton;
+}
+
+void free_lazy_layers(void)
+{
+  GList *list;
+
+  for (list = tmpLazyLayers; list!=NULL; list = list->next) g_free(list->data);
+  g_list_free(tmpLazyLayers);
+  tmpLazyLayers = NULL;
+}
+
+/* whether a page that wasn't parsed yet has images with copies: attribute
+   values and text are escaped, so this can't be fooled by the contents */
+
+gboolean lazy_page_has_image_ids(struct Page *pg)
+{
+  if (pg->lazy_layers == NULL || strstr(pg->lazy_layers->s, "<image") == NULL) return FALSE;
+  return strstr(pg->lazy_layers->s, " id=\"") != NULL || strstr(pg->lazy_layers->s, " ref=\"") != NULL;
+}
+
+/* parses the layers of a page that was loaded lazily, and creates their
+   canvas items if the page is already on the canvas */
+
+gboolean load_page(struct Page *pg)
+{
+  GError *error;
+  GtkWidget *dialog;
+  gboolean valid;
+  gchar *doc;
+  struct Page *tmppg;
+  struct Layer *l;
+  GList *layerlist, *itemlist, *list;
+
+  if (pg == NULL || pg->lazy_layers == NULL) return TRUE;
+  
+  // copies of an image refer to its first occurrence, on this page or before
+  if (strstr(pg->lazy_layers->s, " ref=\"") != NULL)
+    for (list = journal.pages; list!=NULL && list->data != pg; list = list->next)
+      if (lazy_page_has_image_ids((struct Page *)list->data)) load_page((struct Page *)list->data);
+  if (pg->lazy_layers == NULL) return TRUE; // can't happen, but be safe
+
+  doc = g_strconcat("<page width=\"1\" height=\"1\">"
+    "<background type=\"solid\" color=\"white\" style=\"plain\"/>",
+    pg->lazy_layers->s, "</page>", NULL);
+  refstring_unref(pg->lazy_layers);
+  pg->lazy_layers = NULL;
+
+  tmpJournal.npages = 0;
+  tmpJournal.pages = NULL;
+  tmpJournal.image_ids = journal.image_ids;
+  tmpPage = NULL;
+  tmpLayer = NULL;
+  tmpItem = NULL;
+  error = NULL;
+  valid = xoj_parse_buffer(doc, strlen(doc), &error);
+  journal.image_ids = tmpJournal.image_ids;
+  tmpJournal.image_ids = NULL;
+  if (tmpJournal.npages != 1) valid = FALSE;
+  if (error != NULL) g_error_free(error);
+  g_free(doc);
+
+  if (valid) {
+    tmppg = (struct Page *)tmpJournal.pages->data;
+    pg->layers = tmppg->layers;
+    pg->nlayers = tmppg->nlayers;
+    tmppg->layers = NULL;
+  }
+  delete_journal(&tmpJournal);
+  if (!valid) {
+    dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+      GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
+      _("The contents of page %d could not be read."), 
+      journal_page_number(pg)+1);
+    wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+    l = g_new(struct Layer, 1);
+    l->items = NULL;
+    l->nitems = 0;
+    l->group = NULL;
+    pg->layers = g_list_append(NULL, l);
+    pg->nlayers = 1;
+  }
+  
+  if (pg->group == NULL) return valid;
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
+       pg->group, gnome_canvas_group_get_type(), NULL);
+    if (ui.batch_layer_render) batch_layer_strokes(l);
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next)
+      if (!item_is_batched((struct Item *)itemlist->data))
+        make_canvas_item_one(l->group, (struct Item *)itemlist->data);
+  }
+  return valid;
+}
+
 gboolean open_journal(char *filename)
 {
   const GMarkupParser parser = { xoj_parser_start_element, 
@@ -1032,7 +2374,8 @@ gboolean open_journal(char *filename)
   char buffer[1000];
   int len;
   gchar *tmpfn, *tmpfn2, *p, *q, *filename_actual;
-  gboolean maybe_pdf;
+  gboolean maybe_pdf, restore;
+  GString *contents, *skeleton;
   
   tmpfn = g_strdup_printf("%s.xoj", filename);
   if (ui.autoload_pdf_xoj && g_file_test(tmpfn, G_FILE_TEST_EXISTS) &&
@@ -1044,7 +2387,7 @@ gboolean open_journal(char *filename)
   }
   g_free(tmpfn);
 
-  filename_actual = check_for_autosave(filename);
+  filename_actual = check_for_autosave(filename, &restore);
 
   if (ui.autocreate_new_xoj && 
       !g_file_test(filename_actual, G_FILE_TEST_EXISTS) &&
@@ -1067,8 +2410,13 @@ gboolean open_journal(char *filename)
     }
   }
 
-  f = gzopen_wrapper(filename_actual, "rb");
-  if (f==NULL) { g_free(filename_actual); return FALSE; }
+  // files we wrote ourselves can be inflated in parallel
+  contents = read_gz_members(filename_actual);
+  f = NULL;
+  if (contents == NULL) {
+    f = gzopen_wrapper(filename_actual, "rb");
+    if (f==NULL) { g_free(filename_actual); return FALSE; }
+  }
   if (filename[0]=='/') {
     if (ui.default_path != NULL) g_free(ui.default_path);
     ui.default_path = g_path_get_dirname(filename);
@@ -1079,27 +2427,42 @@ gboolean open_journal(char *filename)
   tmpJournal.npages = 0;
   tmpJournal.pages = NULL;
   tmpJournal.last_attach_no = 0;
+  tmpJournal.image_ids = NULL;
   tmpPage = NULL;
   tmpLayer = NULL;
   tmpItem = NULL;
   tmpFilename = filename_actual;
   error = NULL;
   tmpBg_pdf = NULL;
-  maybe_pdf = TRUE;
+  tmpLazyLayers = NULL;
+  maybe_pdf = (contents == NULL);
+  // lazy loading: read everything, then only parse the page backgrounds
+  if (contents == NULL && ui.lazy_page_loading) contents = g_string_sized_new(65536);
 
-  while (valid && !gzeof(f)) {
+  while (f != NULL && valid && !gzeof(f)) {
     len = gzread(f, buffer, 1000);
     if (len<0) valid = FALSE;
     if (maybe_pdf && len>=4 && !strncmp(buffer, "%PDF", 4))
       { valid = FALSE; break; } // most likely pdf
     else maybe_pdf = FALSE;
     if (len<=0) break;
-    valid = g_markup_parse_context_parse(context, buffer, len, &error);
+    if (contents != NULL) g_string_append_len(contents, buffer, len);
+    else valid = g_markup_parse_context_parse(context, buffer, len, &error);
   }
-  gzclose(f);
-  if (valid) valid = g_markup_parse_context_end_parse(context, &error);
+  if (f != NULL) gzclose(f);
+  if (contents != NULL) {
+    if (valid && ui.lazy_page_loading) {
+      skeleton = split_lazy_pages(contents->str);
+      valid = xoj_parse_buffer(skeleton->str, skeleton->len, &error);
+      g_string_free(skeleton, TRUE);
+    }
+    else if (valid) valid = xoj_parse_buffer(contents->str, contents->len, &error);
+    g_string_free(contents, TRUE);
+  }
+  else if (valid) valid = g_markup_parse_context_end_parse(context, &error);
   if (tmpJournal.npages == 0) valid = FALSE;
   g_markup_parse_context_free(context);
+  free_lazy_layers(); // left over if the parse failed
   
   if (!valid) {
     g_free(filename_actual);
@@ -1119,6 +2482,7 @@ gboolean open_journal(char *filename)
   ui.saved = TRUE; // force close_journal() to do its job
   close_journal();
   g_memmove(&journal, &tmpJournal, sizeof(struct Journal));
+  reset_page_index();
   
   // if we need to initialize a fresh pdf loader
   if (tmpBg_pdf!=NULL) { 
@@ -1164,8 +2528,30 @@ gboolean open_journal(char *filename)
     g_free(tmpfn);
   }
   
+  // replay the changes logged since the last full save
+  if (restore) {
+    tmpfn = g_strdup_printf(EDITLOG_FILENAME_TEMPLATE, filename_actual);
+    if (g_file_test(tmpfn, G_FILE_TEST_EXISTS) && !editlog_fits_base(tmpfn, filename_actual)) {
+      dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+        GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
+        _("'%s' was written for another version of '%s'; its changes were not recovered."),
+        tmpfn, filename_actual);
+      wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+      gtk_widget_destroy(dialog);
+    }
+    else if (g_file_test(tmpfn, G_FILE_TEST_EXISTS) && !editlog_replay(tmpfn, filename_actual)) {
+      dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
+        GTK_MESSAGE_WARNING, GTK_BUTTONS_OK, 
+        _("Some changes could not be recovered from '%s'."), tmpfn);
+      wrapper_gtk_dialog_run(GTK_DIALOG(dialog));
+      gtk_widget_destroy(dialog);
+    }
+    g_free(tmpfn);
+  }
+  
   ui.pageno = 0;
   ui.cur_page = (struct Page *)journal.pages->data;
+  load_page(ui.cur_page);
   ui.layerno = ui.cur_page->nlayers-1;
   ui.cur_layer = (struct Layer *)(g_list_last(ui.cur_page->layers)->data);
   ui.zoom = ui.startup_zoom;
@@ -1175,15 +2561,22 @@ gboolean open_journal(char *filename)
   update_page_stuff();
   rescale_bg_pixmaps(); // this requests the PDF pages if need be
   gtk_adjustment_set_value(gtk_layout_get_vadjustment(GTK_LAYOUT(canvas)), 0);
+  load_visible_pages();
+#ifdef LOAD_DEBUG
+  if (load_timer != NULL)
+    printf("DEBUG: parsed %lu points in %.3f s (%.2f Mpoints/s)\n", load_points,
+       g_timer_elapsed(load_timer, NULL), load_points/1e6/g_timer_elapsed(load_timer, NULL));
+#endif
   
-  if (strcmp(filename, filename_actual)) { // we just restored an autosave
+  if (restore) { // we just restored an autosave
     ui.saved = FALSE;
     dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
         GTK_MESSAGE_OTHER, GTK_BUTTONS_YES_NO, 
         _("Save this version and delete auto-save?"));
     if (wrapper_gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_YES) {
       if (save_journal(filename, FALSE)) { // success: delete autosave
-        delete_autosave(filename_actual);
+        if (strcmp(filename, filename_actual)) delete_autosave(filename_actual);
+        else delete_editlog(filename); // not the file we just saved!
         ui.saved = TRUE;
       } else { // failed to save; keep 
         gtk_widget_destroy(dialog);
@@ -1198,113 +2591,476 @@ gboolean open_journal(char *filename)
 
   g_free(filename_actual);
   ui.need_autosave = !ui.saved;
+  editlog_reset(ui.saved ? filename : NULL);
   return TRUE;
 }
 
-/************ file backgrounds *************/
+/************ edit log *************/
+
+/* Between full saves, autosaves only append the pages that changed to an
+   edit log next to the last full save (see EDITLOG_FILENAME_TEMPLATE).
+   Each record gives the new page order, as indices into the page list of
+   the previous record (-1 for a new page), then the indices of the pages
+   that follow in full, as an xoj document of their own. The header also
+   gives the size and modification time of the base file, so that a log is
+   never replayed on top of another version of it:
+     EDIT npages nreplace xmllength basesize basemtime
+     order[0] ... order[npages-1]
+     replace[0] ... replace[nreplace-1]
+     <?xml ... </xournal>
+   Records are appended as separate gzip members, which gzread()
+   reads back as one stream. */
+
+void editlog_mark_dirty(struct Page *pg)
+{
+  if (pg != NULL) g_hash_table_insert(ui.editlog_dirty, pg, pg);
+}
 
-struct Background *attempt_load_pix_bg(char *filename, gboolean attach)
+// record which pages an undoable operation (just done, undone or redone) affected
+
+void editlog_note_undo(struct UndoItem *u)
 {
-  struct Background *bg;
-  GdkPixbuf *pix;
-  
-  pix = gdk_pixbuf_new_from_file(filename, NULL);
-  if (pix == NULL) return NULL;
+  u->logged = TRUE;
+  if (ui.editlog_base == NULL) return; // the next autosave is a full one anyway
   
-  bg = g_new(struct Background, 1);
-  bg->type = BG_PIXMAP;
-  bg->canvas_item = NULL;
-  bg->pixbuf = pix;
-  bg->pixbuf_scale = DEFAULT_ZOOM;
-  if (attach) {
-    bg->filename = new_refstring(NULL);
-    bg->file_domain = DOMAIN_ATTACH;
-  } else {
-    bg->filename = new_refstring(filename);
-    bg->file_domain = DOMAIN_ABSOLUTE;
+  if (u->type == ITEM_NEW_DEFAULT_BG) return; // not part of the file
+  if (u->type == ITEM_NEW_BG_ONE || u->type == ITEM_NEW_BG_RESIZE ||
+      u->type == ITEM_PAPER_RESIZE || u->type == ITEM_NEW_PAGE ||
+      u->type == ITEM_DELETE_PAGE || u->type == ITEM_NEW_LAYER ||
+      u->type == ITEM_DELETE_LAYER)
+    editlog_mark_dirty(u->page);
+  else {
+    editlog_mark_dirty(find_layer_page(u->layer));
+    if (u->type == ITEM_MOVESEL && u->layer2 != u->layer)
+      editlog_mark_dirty(find_layer_page(u->layer2));
   }
-  return bg;
 }
 
-#define BUFSIZE 65536 // a reasonable buffer size for reads from gs pipe
+/* start a new (empty) edit log on top of the given full save, which must
+   match the current contents of the journal; or stop logging if NULL. */
 
-GList *attempt_load_gv_bg(char *filename)
+void editlog_reset(const char *base)
 {
-  struct Background *bg;
-  GList *bg_list;
-  GdkPixbuf *pix;
-  GdkPixbufLoader *loader;
-  FILE *gs_pipe, *f;
-  unsigned char *buf;
-  char *pipename, *quotedfilename;
-  int buflen, remnlen, file_pageno;
+  GList *list;
+  int i;
   
-  f = g_fopen(filename, "rb");
-  if (f == NULL) return NULL;
-  buf = g_malloc(BUFSIZE); // a reasonable buffer size
-  if (fread(buf, 1, 4, f) !=4 ||
-        (strncmp((char *)buf, "%!PS", 4) && strncmp((char *)buf, "%PDF", 4))) {
-    fclose(f);
-    g_free(buf);
-    return NULL;
+  if (ui.editlog_dirty == NULL) {
+    ui.editlog_dirty = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ui.editlog_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    ui.editlog_attached = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
   }
+  g_hash_table_remove_all(ui.editlog_dirty);
+  g_hash_table_remove_all(ui.editlog_index);
+  g_hash_table_remove_all(ui.editlog_attached);
+  g_free(ui.editlog_base);
+  g_free(ui.editlog_filename);
+  ui.editlog_base = ui.editlog_filename = NULL;
+  ui.editlog_started = FALSE;
+  bgfile_free(ui.editlog_base_id);
+  ui.editlog_base_id = NULL;
+  if (base == NULL) return;
   
-  fclose(f);
-  quotedfilename = g_shell_quote(filename);
-  pipename = g_strdup_printf(GS_CMDLINE, (double)GS_BITMAP_DPI, quotedfilename);
-  g_free(quotedfilename);
-#ifdef WIN32
-  gs_pipe = popen(pipename, "rb");
-#else
-  gs_pipe = popen(pipename, "r");
-#endif
-  g_free(pipename);
-  
-  bg_list = NULL;
-  remnlen = 0;
-  file_pageno = 0;
-  loader = NULL;
-  if (gs_pipe!=NULL)
-  while (!feof(gs_pipe)) {
-    if (!remnlen) { // new page: get a BMP header ?
-      buflen = fread(buf, 1, 54, gs_pipe);
-      if (buflen < 6) buflen += fread(buf, 1, 54-buflen, gs_pipe);
-      if (buflen < 6 || buf[0]!='B' || buf[1]!='M') break; // fatal: abort
-      remnlen = (int)(buf[5]<<24) + (buf[4]<<16) + (buf[3]<<8) + (buf[2]);
-      loader = gdk_pixbuf_loader_new();
-    }
-    else buflen = fread(buf, 1, (remnlen < BUFSIZE)?remnlen:BUFSIZE, gs_pipe);
-    remnlen -= buflen;
-    if (buflen == 0) break;
-    if (!gdk_pixbuf_loader_write(loader, buf, buflen, NULL)) break;
-    if (remnlen == 0) { // make a new bg
-      pix = gdk_pixbuf_loader_get_pixbuf(loader);
-      if (pix == NULL) break;
-      g_object_ref(pix);
-      gdk_pixbuf_loader_close(loader, NULL);
-      g_object_unref(loader);
-      loader = NULL;
-      bg = g_new(struct Background, 1);
-      bg->canvas_item = NULL;
-      bg->pixbuf = pix;
-      bg->pixbuf_scale = (GS_BITMAP_DPI/72.0);
-      bg->type = BG_PIXMAP;
-      bg->filename = new_refstring(NULL);
-      bg->file_domain = DOMAIN_ATTACH;
-      file_pageno++;
-      bg_list = g_list_append(bg_list, bg);
-    }
-  }
-  if (loader != NULL) gdk_pixbuf_loader_close(loader, NULL);
-  if (gs_pipe!=NULL) pclose(gs_pipe);
-  g_free(buf);
-  return bg_list;
+  delete_editlog(base); // a log left over from an older version of base
+  ui.editlog_base = g_strdup(base);
+  ui.editlog_filename = g_strdup_printf(EDITLOG_FILENAME_TEMPLATE, base);
+  for (list = journal.pages, i = 1; list!=NULL; list = list->next, i++)
+    g_hash_table_insert(ui.editlog_index, list->data, GINT_TO_POINTER(i));
 }
 
-struct Background *attempt_screenshot_bg(void)
+// whether it's time to do a full save rather than grow the edit log
+
+gboolean editlog_too_big(void)
 {
-#ifdef GDK_WINDOWING_X11
-  struct Background *bg;
+  struct stat base_stat, log_stat;
+  
+  if (g_stat(ui.editlog_base, &base_stat)) return TRUE; // base is gone!
+  if (!ui.editlog_started) return FALSE;
+  if (g_stat(ui.editlog_filename, &log_stat)) return TRUE;
+  return (log_stat.st_size > base_stat.st_size/EDITLOG_MAX_FRACTION);
+}
+
+// append the changes since the last record: returns true on success
+
+gboolean editlog_write(void)
+{
+  struct SaveJob *job;
+  struct Page *pg;
+  GList *list;
+  GString *order, *replace;
+  gchar *header;
+  gzFile f;
+  int i, prev, nreplace;
+  gboolean changed, success;
+  
+  if (undo != NULL && !undo->logged) editlog_note_undo(undo);
+  chk_attach_names();
+  
+  job = g_new0(struct SaveJob, 1);
+  job->filename = g_strdup(ui.editlog_filename);
+  job->is_auto = TRUE;
+  job->xml = g_string_new(NULL);
+  job->attached = ui.editlog_attached;
+  order = g_string_new(NULL);
+  replace = g_string_new(NULL);
+  changed = (journal.npages != g_hash_table_size(ui.editlog_index));
+  nreplace = 0;
+  for (list = journal.pages, i = 0; list!=NULL; list = list->next, i++) {
+    pg = (struct Page *)list->data;
+    prev = GPOINTER_TO_INT(g_hash_table_lookup(ui.editlog_index, pg)) - 1;
+    if (prev != i) changed = TRUE;
+    g_string_append_printf(order, "%d ", prev);
+    if (prev < 0 || g_hash_table_lookup(ui.editlog_dirty, pg) != NULL) {
+      job->pages = g_list_prepend(job->pages, snapshot_page(pg));
+      snapshot_bg_file(job, pg);
+      g_string_append_printf(replace, "%d ", i);
+      nreplace++;
+    }
+  }
+  job->pages = g_list_reverse(job->pages);
+  
+  success = TRUE;
+  if (changed || nreplace > 0) {
+    write_journal_snapshot(job);
+    success = job->success;
+    if (success && !ui.editlog_started) { // the base is complete on disk by now
+      bgfile_free(ui.editlog_base_id);
+      ui.editlog_base_id = bgfile_new(ui.editlog_base);
+      if (ui.editlog_base_id == NULL) success = FALSE;
+    }
+    if (success) {
+      f = gzopen_wrapper(ui.editlog_filename, ui.editlog_started ? "ab" : "wb");
+      if (f == NULL) success = FALSE;
+      else {
+        if (!ui.editlog_started)
+          ui.autosave_filename_list = g_list_append(ui.autosave_filename_list, g_strdup(ui.editlog_filename));
+        ui.editlog_started = TRUE;
+        header = g_strdup_printf("EDIT %d %d %d %" G_GINT64_FORMAT " %" G_GINT64_FORMAT "\n",
+                    journal.npages, nreplace, (int)job->xml->len,
+                    (gint64)ui.editlog_base_id->size, ui.editlog_base_id->mtime);
+        // gzputs() rather than gzprintf(), which can't handle long strings
+        if (gzputs(f, header) < 0 || gzputs(f, order->str) < 0 || gzputs(f, "\n") < 0 ||
+            gzputs(f, replace->str) < 0 || gzputs(f, "\n") < 0 ||
+            gzwrite(f, job->xml->str, job->xml->len) != job->xml->len)
+          success = FALSE;
+        if (gzclose(f) != Z_OK) success = FALSE;
+        g_free(header);
+      }
+    }
+  }
+  g_string_free(job->xml, TRUE);
+  job->xml = NULL;
+  finish_save_job(job);
+  g_string_free(order, TRUE);
+  g_string_free(replace, TRUE);
+  if (!success) return FALSE;
+
+  g_hash_table_remove_all(ui.editlog_dirty);
+  if (changed) {
+    g_hash_table_remove_all(ui.editlog_index);
+    for (list = journal.pages, i = 1; list!=NULL; list = list->next, i++)
+      g_hash_table_insert(ui.editlog_index, list->data, GINT_TO_POINTER(i));
+  }
+  return TRUE;
+}
+
+// skip spaces, then expect the end of a line
+
+gboolean editlog_skip_eol(char **p)
+{
+  while (**p == ' ') (*p)++;
+  if (**p != '\n') return FALSE;
+  (*p)++;
+  return TRUE;
+}
+
+// whether an edit log header was written on top of base as it is now
+
+gboolean editlog_header_fits(const char *p, struct BgFile *base)
+{
+  int npages, nreplace, xmllen;
+  gint64 size, mtime;
+
+  if (sscanf(p, "EDIT %d %d %d %" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+             &npages, &nreplace, &xmllen, &size, &mtime) != 5) return FALSE;
+  return (base != NULL && size == (gint64)base->size && mtime == base->mtime);
+}
+
+// whether an edit log applies to its base file, judging by its first record
+
+gboolean editlog_fits_base(char *logname, char *base)
+{
+  gzFile f;
+  char buffer[200];
+  struct BgFile *bf;
+  gboolean fits;
+
+  f = gzopen_wrapper(logname, "rb");
+  if (f==NULL) return FALSE;
+  fits = (gzgets(f, buffer, sizeof(buffer)) != NULL);
+  gzclose(f);
+  if (!fits) return FALSE;
+  bf = bgfile_new(base);
+  fits = editlog_header_fits(buffer, bf);
+  bgfile_free(bf);
+  return fits;
+}
+
+/* replay an edit log on top of the journal that was just loaded from its
+   base file; returns false if some records couldn't be applied (a record
+   truncated by a crash is simply dropped). */
+
+gboolean editlog_replay(char *logname, char *base)
+{
+  GError *error;
+  gzFile f;
+  GString *log;
+  char buffer[1000];
+  char *p, *q, *end;
+  int len, npages, nreplace, xmllen, oldn, i, k;
+  int *order, *replace;
+  struct Page **oldpages, **newpages, *pg;
+  struct BgFile *bf;
+  gboolean *used;
+  gboolean valid;
+  GList *list;
+  
+  f = gzopen_wrapper(logname, "rb");
+  if (f==NULL) return FALSE;
+  bf = bgfile_new(base);
+  tmpJournal.npages = 0;
+  tmpJournal.pages = NULL; // open_journal() handed the old list over to journal
+  tmpJournal.image_ids = NULL;
+  log = g_string_new(NULL);
+  while ((len = gzread(f, buffer, 1000)) > 0)
+    g_string_append_len(log, buffer, len);
+  gzclose(f);
+  
+  valid = TRUE;
+  p = log->str;
+  end = log->str + log->len;
+  while (valid && p < end) {
+    if (sscanf(p, "EDIT %d %d %d", &npages, &nreplace, &xmllen) != 3 ||
+        npages <= 0 || nreplace < 0 || nreplace > npages || xmllen < 0 ||
+        !editlog_header_fits(p, bf))
+      { valid = FALSE; break; }
+    p = strchr(p, '\n');
+    if (p == NULL) { valid = FALSE; break; }
+    p++;
+    order = g_new(int, npages);
+    replace = g_new(int, nreplace+1);
+    for (i=0; i<npages && valid; i++) {
+      order[i] = strtol(p, &q, 10);
+      if (q == p) valid = FALSE;
+      p = q;
+    }
+    if (valid) valid = editlog_skip_eol(&p);
+    for (i=0; i<nreplace && valid; i++) {
+      replace[i] = strtol(p, &q, 10);
+      if (q == p || replace[i] < 0 || replace[i] >= npages || 
+          (i > 0 && replace[i] <= replace[i-1])) valid = FALSE;
+      p = q;
+    }
+    if (valid) valid = editlog_skip_eol(&p);
+    if (valid && (end - p) < xmllen) { // truncated record: stop here
+      g_free(order); g_free(replace);
+      break;
+    }
+    
+    // parse the pages of this record
+    if (valid) {
+      tmpJournal.npages = 0;
+      tmpJournal.pages = NULL;
+      tmpJournal.last_attach_no = 0;
+      tmpJournal.image_ids = NULL; // a record's image ids are its own
+      tmpPage = NULL;
+      tmpLayer = NULL;
+      tmpItem = NULL;
+      tmpFilename = logname;
+      tmpBg_pdf = NULL;
+      error = NULL;
+      valid = xoj_parse_buffer(p, xmllen, &error);
+      if (error != NULL) g_error_free(error);
+      if (tmpJournal.npages != nreplace) valid = FALSE;
+      p += xmllen;
+    }
+    
+    // check that the new page order makes sense
+    oldn = journal.npages;
+    used = g_new0(gboolean, oldn);
+    for (i=0, k=0; i<npages && valid; i++) {
+      if (k < nreplace && replace[k] == i) k++;
+      else if (order[i] < 0) valid = FALSE; // new page without contents
+      if (order[i] >= oldn || (order[i] >= 0 && used[order[i]])) valid = FALSE;
+      else if (order[i] >= 0) used[order[i]] = TRUE;
+    }
+    
+    if (valid) {
+      oldpages = g_new(struct Page *, oldn);
+      for (list = journal.pages, i = 0; list!=NULL; list = list->next, i++)
+        oldpages[i] = (struct Page *)list->data;
+      newpages = g_new0(struct Page *, npages);
+      for (i=0; i<npages; i++)
+        if (order[i] >= 0) newpages[i] = oldpages[order[i]];
+      for (list = tmpJournal.pages, k = 0; list!=NULL; list = list->next, k++) {
+        i = replace[k];
+        if (order[i] >= 0) used[order[i]] = FALSE; // superseded
+        pg = (struct Page *)list->data;
+        if (pg->bg->type == BG_PDF && bgpdf.filename != NULL) { // same PDF as the base
+          refstring_unref(pg->bg->filename);
+          pg->bg->filename = refstring_ref(bgpdf.filename);
+          pg->bg->file_domain = bgpdf.file_domain;
+        }
+        newpages[i] = pg;
+      }
+      for (i=0; i<oldn; i++)
+        if (!used[i]) delete_page(oldpages[i]);
+      g_list_free(journal.pages);
+      journal.pages = NULL;
+      for (i=npages-1; i>=0; i--)
+        journal.pages = g_list_prepend(journal.pages, newpages[i]);
+      journal.npages = npages;
+      reset_page_index();
+      if (tmpJournal.last_attach_no > journal.last_attach_no)
+        journal.last_attach_no = tmpJournal.last_attach_no;
+      g_list_free(tmpJournal.pages);
+      tmpJournal.pages = NULL;
+      g_free(oldpages);
+      g_free(newpages);
+    }
+    delete_journal(&tmpJournal);
+    g_free(used);
+    g_free(order);
+    g_free(replace);
+  }
+  g_string_free(log, TRUE);
+  bgfile_free(bf);
+  return valid;
+}
+
+// delete an edit log along with the backgrounds attached to it
+
+void delete_editlog(const char *base)
+{
+  char *logname, *attach_filename;
+  int k;
+  
+  logname = g_strdup_printf(EDITLOG_FILENAME_TEMPLATE, base);
+  g_unlink(logname);
+  k = 1;
+  attach_filename = NULL;
+  do {
+    g_free(attach_filename);
+    attach_filename = g_strdup_printf("%s.bg_%d.png", logname, k++);
+  } 
+  while (!g_unlink(attach_filename));
+  g_free(attach_filename);
+  g_free(logname);
+}
+
+/************ file backgrounds *************/
+
+struct Background *attempt_load_pix_bg(char *filename, gboolean attach)
+{
+  struct Background *bg;
+  GdkPixbuf *pix;
+  
+  pix = gdk_pixbuf_new_from_file(filename, NULL);
+  if (pix == NULL) return NULL;
+  
+  bg = g_new(struct Background, 1);
+  bg->type = BG_PIXMAP;
+  bg->canvas_item = NULL;
+  bg->pixbuf = pix;
+  bg->pixbuf_scale = DEFAULT_ZOOM;
+  if (attach) {
+    bg->filename = new_refstring(NULL);
+    bg->file_domain = DOMAIN_ATTACH;
+  } else {
+    bg->filename = new_refstring(filename);
+    bg->file_domain = DOMAIN_ABSOLUTE;
+  }
+  return bg;
+}
+
+#define BUFSIZE 65536 // a reasonable buffer size for reads from gs pipe
+
+GList *attempt_load_gv_bg(char *filename)
+{
+  struct Background *bg;
+  GList *bg_list;
+  GdkPixbuf *pix;
+  GdkPixbufLoader *loader;
+  FILE *gs_pipe, *f;
+  unsigned char *buf;
+  char *pipename, *quotedfilename;
+  int buflen, remnlen, file_pageno;
+  
+  f = g_fopen(filename, "rb");
+  if (f == NULL) return NULL;
+  buf = g_malloc(BUFSIZE); // a reasonable buffer size
+  if (fread(buf, 1, 4, f) !=4 ||
+        (strncmp((char *)buf, "%!PS", 4) && strncmp((char *)buf, "%PDF", 4))) {
+    fclose(f);
+    g_free(buf);
+    return NULL;
+  }
+  
+  fclose(f);
+  quotedfilename = g_shell_quote(filename);
+  pipename = g_strdup_printf(GS_CMDLINE, (double)GS_BITMAP_DPI, quotedfilename);
+  g_free(quotedfilename);
+#ifdef WIN32
+  gs_pipe = popen(pipename, "rb");
+#else
+  gs_pipe = popen(pipename, "r");
+#endif
+  g_free(pipename);
+  
+  bg_list = NULL;
+  remnlen = 0;
+  file_pageno = 0;
+  loader = NULL;
+  if (gs_pipe!=NULL)
+  while (!feof(gs_pipe)) {
+    if (!remnlen) { // new page: get a BMP header ?
+      buflen = fread(buf, 1, 54, gs_pipe);
+      if (buflen < 6) buflen += fread(buf, 1, 54-buflen, gs_pipe);
+      if (buflen < 6 || buf[0]!='B' || buf[1]!='M') break; // fatal: abort
+      remnlen = (int)(buf[5]<<24) + (buf[4]<<16) + (buf[3]<<8) + (buf[2]);
+      loader = gdk_pixbuf_loader_new();
+    }
+    else buflen = fread(buf, 1, (remnlen < BUFSIZE)?remnlen:BUFSIZE, gs_pipe);
+    remnlen -= buflen;
+    if (buflen == 0) break;
+    if (!gdk_pixbuf_loader_write(loader, buf, buflen, NULL)) break;
+    if (remnlen == 0) { // make a new bg
+      pix = gdk_pixbuf_loader_get_pixbuf(loader);
+      if (pix == NULL) break;
+      g_object_ref(pix);
+      gdk_pixbuf_loader_close(loader, NULL);
+      g_object_unref(loader);
+      loader = NULL;
+      bg = g_new(struct Background, 1);
+      bg->canvas_item = NULL;
+      bg->pixbuf = pix;
+      bg->pixbuf_scale = (GS_BITMAP_DPI/72.0);
+      bg->type = BG_PIXMAP;
+      bg->filename = new_refstring(NULL);
+      bg->file_domain = DOMAIN_ATTACH;
+      file_pageno++;
+      bg_list = g_list_append(bg_list, bg);
+    }
+  }
+  if (loader != NULL) gdk_pixbuf_loader_close(loader, NULL);
+  if (gs_pipe!=NULL) pclose(gs_pipe);
+  g_free(buf);
+  return bg_list;
+}
+
+struct Background *attempt_screenshot_bg(void)
+{
+#ifdef GDK_WINDOWING_X11
+  struct Background *bg;
   GdkPixbuf *pix;
   XEvent x_event;
   GdkWindow *window;
@@ -1351,88 +3107,308 @@ struct Background *attempt_screenshot_bg(void)
 
 /************** pdf annotation ***************/
 
+/* Requests are rendered on a pool of threads. Each thread borrows its own
+   poppler document on the shared file contents, since a document can't be
+   used from two threads at once; the results are installed from the main
+   loop. A request that is cancelled or superseded is skipped or discarded,
+   and bgpdf.serial tells results from a previous PDF apart.
+   The pending requests are kept by page number in bgpdf.requests, and the
+   pool runs them by priority: the distance of the page from the view, as
+   set by rescale_bg_pixmaps() each time the view moves. */
+
 /* cancel a request */
 
 void cancel_bgpdf_request(struct BgPdfRequest *req)
 {
-  GList *list_link;
-  
-  list_link = g_list_find(bgpdf.requests, req);
-  if (list_link == NULL) return;
-  // remove the request
-  bgpdf.requests = g_list_delete_link(bgpdf.requests, list_link);
+  g_atomic_int_set(&req->cancelled, TRUE);
+}
+
+void free_bgpdf_tile(struct BgPdfTile *tile)
+{
+  if (tile->pixbuf != NULL) g_object_unref(tile->pixbuf);
+  g_free(tile);
+}
+
+void free_bgpdf_request(struct BgPdfRequest *req)
+{
+  if (req->pixbuf != NULL) g_object_unref(req->pixbuf);
+  if (req->tile != NULL) free_bgpdf_tile(req->tile);
   g_free(req);
 }
 
-/* process a bg PDF request from the queue, and recurse */
+/* A page with nothing to show yet first gets a quick preview at
+   BGPDF_PREVIEW_DPI, which is shown stretched until the full rendering
+   arrives; a preview runs ahead of the other requests of the same
+   priority, so the pages in view go first whatever their kind.
+   The rendered pages are kept within ui.pdf_cache_size megabytes, the least
+   recently used going first: they are taken back to their preview (scaling
+   one down if needed), then dropped altogether if that isn't enough. The
+   pages used since the view last changed stay. A page that loses its
+   rendering gets requested again when it comes back into view. */
+
+gsize pixbuf_bytes(GdkPixbuf *pix)
+{
+  return (gsize)gdk_pixbuf_get_rowstride(pix) * gdk_pixbuf_get_height(pix);
+}
 
-gboolean bgpdf_scheduler_callback(gpointer data)
+// get the page's pixbuf re-requested next time it's in view
+void reset_bgpdf_scale(int pageno)
+{
+  GSList *list;
+
+  for (list = pages_with_pdf_page(pageno); list!= NULL; list = list->next)
+    ((struct Page *)list->data)->bg->pixbuf_scale = 0;
+}
+
+struct BgPdfPage *get_bgpdf_page(int pageno)
 {
-  struct BgPdfRequest *req;
   struct BgPdfPage *bgpg;
-  GdkPixbuf *pixbuf;
-  GtkWidget *dialog;
-  PopplerPage *pdfpage;
-  gdouble height, width;
-  int scaled_height, scaled_width;
-  GdkPixmap *pixmap;
-  cairo_t *cr;
 
-  // if all requests have been cancelled, remove ourselves from main loop
-  if (bgpdf.requests == NULL) { bgpdf.pid = 0; return FALSE; }
-  if (bgpdf.status == STATUS_NOT_INIT)
-    { printf("DEBUG: BGPDF not initialized??\n"); bgpdf.pid = 0; return FALSE; }
+  while (pageno > bgpdf.npages) {
+    bgpg = g_new0(struct BgPdfPage, 1);
+    bgpg->pageno = ++bgpdf.npages;
+    g_ptr_array_add(bgpdf.pages, bgpg);
+  }
+  return g_ptr_array_index(bgpdf.pages, pageno-1);
+}
 
-  req = (struct BgPdfRequest *)bgpdf.requests->data;
+// replace one of the renderings of a page, taking over the reference
 
-  // use poppler to generate the page
-  pixbuf = NULL;
-  pdfpage = poppler_document_get_page(bgpdf.document, req->pageno-1);
-  if (pdfpage) {
-//    printf("DEBUG: Processing request for page %d at %f dpi\n", req->pageno, req->dpi);
-    set_cursor_busy(TRUE);
-    poppler_page_get_size(pdfpage, &width, &height);
-    scaled_width = (int) (req->dpi * width/72);
-    scaled_height = (int) (req->dpi * height/72);
-
-    if (ui.poppler_force_cairo) { // poppler -> cairo -> pixmap -> pixbuf
-      pixmap = gdk_pixmap_new(GTK_WIDGET(canvas)->window, scaled_width, scaled_height, -1);
-      cr = gdk_cairo_create(pixmap);
-      cairo_set_source_rgb(cr, 1., 1., 1.);
-      cairo_paint(cr);
-      cairo_scale(cr, scaled_width/width, scaled_height/height);
-      poppler_page_render(pdfpage, cr);
-      cairo_destroy(cr);
-      pixbuf = gdk_pixbuf_get_from_drawable(NULL, GDK_DRAWABLE(pixmap),
-        NULL, 0, 0, 0, 0, scaled_width, scaled_height);
-      g_object_unref(pixmap);
-    }
-    else { // directly poppler -> pixbuf: faster, but bitmap font bug
-      pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
-                 FALSE, 8, scaled_width, scaled_height);
-      wrapper_poppler_page_render_to_pixbuf(
-                pdfpage, 0, 0, scaled_width, scaled_height,
-                req->dpi/72, 0, pixbuf);
+void replace_bgpdf_pixbuf(GdkPixbuf **dest, GdkPixbuf *pixbuf)
+{
+  if (*dest != NULL) {
+    bgpdf.cache_bytes -= pixbuf_bytes(*dest);
+    g_object_unref(*dest);
+  }
+  *dest = pixbuf;
+  if (pixbuf != NULL) bgpdf.cache_bytes += pixbuf_bytes(pixbuf);
+}
+
+// after the renderings of a page changed: update the LRU and show the best
+
+void bgpdf_page_changed(struct BgPdfPage *bgpg)
+{
+  if (bgpg->pixbuf != NULL) {
+    bgpg->pixel_width = gdk_pixbuf_get_width(bgpg->pixbuf);
+    bgpg->pixel_height = gdk_pixbuf_get_height(bgpg->pixbuf);
+  }
+  if (bgpg->pixbuf != NULL || bgpg->preview != NULL) {
+    if (bgpg->lru_link == NULL) {
+      g_queue_push_head(bgpdf.lru, bgpg);
+      bgpg->lru_link = bgpdf.lru->head;
     }
+  }
+  else if (bgpg->lru_link != NULL) {
+    g_queue_delete_link(bgpdf.lru, bgpg->lru_link);
+    bgpg->lru_link = NULL;
+  }
+  bgpdf_update_bg(bgpg->pageno, bgpg); // update all pages that have this bg
+}
+
+// mark a page as used by the current view
+
+void touch_bgpdf_page(struct BgPdfPage *bgpg)
+{
+  bgpg->stamp = bgpdf.clock;
+  g_queue_unlink(bgpdf.lru, bgpg->lru_link);
+  g_queue_push_head_link(bgpdf.lru, bgpg->lru_link);
+}
+
+/* keep what we have of a page near the view; it's a hit if the page comes
+   (back) near the view and its cached rendering saves a new one */
+
+void use_bgpdf_page(int pageno, gboolean good_enough)
+{
+  struct BgPdfPage *bgpg;
+
+  if (bgpdf.status == STATUS_NOT_INIT || pageno < 1 || pageno > bgpdf.npages) return;
+  bgpg = g_ptr_array_index(bgpdf.pages, pageno-1);
+  if (bgpg->pixbuf == NULL && bgpg->preview == NULL) return;
+  if (good_enough && bgpg->pixbuf != NULL &&
+      bgpg->stamp != bgpdf.clock && bgpg->stamp != bgpdf.clock-1)
+    bgpdf.cache_hits++;
+  touch_bgpdf_page(bgpg);
+}
+
+/* At zooms beyond MAX_SAFE_RENDER_DPI, the whole page is only rendered at
+   that resolution. The part in view is also rendered at the actual zoom,
+   in tiles of BGPDF_TILE_SIZE pixels which are shown over it. The tiles
+   are cached by page, zoom and position, and are the first to go when
+   the cache is full. Pages whose size differs from their PDF page can't
+   be tiled, and keep being rendered whole up to MAX_UNTILED_RENDER_DPI. */
+
+guint bgpdf_tile_hash(gconstpointer a)
+{
+  const struct BgPdfTile *tile = a;
+  return tile->pageno ^ (tile->x * 7919) ^ (tile->y * 104729) ^ (guint)(tile->zoom*1000);
+}
+
+gboolean bgpdf_tile_equal(gconstpointer a, gconstpointer b)
+{
+  const struct BgPdfTile *ta = a, *tb = b;
+  return ta->pageno == tb->pageno && ta->zoom == tb->zoom &&
+         ta->x == tb->x && ta->y == tb->y;
+}
+
+// tiles only line up if the page has the size of the PDF page
+
+gboolean bgpdf_page_fits(struct Page *pg, struct BgPdfPage *bgpg)
+{
+  PopplerPage *pdfpage;
+
+  if (bgpg->width == 0) {
+    pdfpage = poppler_document_get_page(bgpdf.document, bgpg->pageno-1);
+    if (pdfpage == NULL) return FALSE;
+    poppler_page_get_size(pdfpage, &bgpg->width, &bgpg->height);
     g_object_unref(pdfpage);
-    set_cursor_busy(FALSE);
   }
+  return (fabs(pg->width - bgpg->width) < 0.5 && fabs(pg->height - bgpg->height) < 0.5);
+}
+
+// pages that aren't the size of their PDF page are never shown in tiles
+
+gboolean bgpdf_can_tile(struct Page *pg)
+{
+  if (bgpdf.status == STATUS_NOT_INIT || pg->bg->type != BG_PDF) return FALSE;
+  return bgpdf_page_fits(pg, get_bgpdf_page(pg->bg->file_page_seq));
+}
+
+// show the cached tiles of a page at the current zoom
+
+void show_tile_if_on_page(gpointer key, gpointer value, gpointer user_data)
+{
+  struct BgPdfTile *tile = value;
+  struct Page *pg = user_data;
+
+  if (tile->pageno == pg->bg->file_page_seq && tile->zoom == ui.zoom)
+    add_canvas_bg_tile(pg, tile);
+}
+
+void show_bgpdf_tiles(struct Page *pg)
+{
+  struct BgPdfPage *bgpg;
+
+  if (bgpdf.status == STATUS_NOT_INIT || pg->bg->file_page_seq < 1 ||
+      pg->bg->file_page_seq > bgpdf.npages) return;
+  bgpg = g_ptr_array_index(bgpdf.pages, pg->bg->file_page_seq-1);
+  if (bgpg->width == 0 || !bgpdf_page_fits(pg, bgpg)) return;
+  g_hash_table_foreach(bgpdf.tiles, show_tile_if_on_page, pg);
+}
+
+void drop_bgpdf_tile(struct BgPdfTile *tile)
+{
+  GSList *list;
+
+  for (list = pages_with_pdf_page(tile->pageno); list!= NULL; list = list->next)
+    remove_canvas_bg_tiles((struct Page *)list->data, tile->pixbuf);
+  g_hash_table_remove(bgpdf.tiles, tile);
+  g_queue_delete_link(bgpdf.tile_lru, tile->lru_link);
+  bgpdf.cache_bytes -= pixbuf_bytes(tile->pixbuf);
+  free_bgpdf_tile(tile);
+}
+
+// install a rendered tile
+
+void add_bgpdf_tile(struct BgPdfTile *tile)
+{
+  GSList *list;
+  struct Page *pg;
+
+  g_hash_table_insert(bgpdf.tiles, tile, tile);
+  g_queue_push_head(bgpdf.tile_lru, tile);
+  tile->lru_link = bgpdf.tile_lru->head;
+  tile->stamp = bgpdf.clock;
+  bgpdf.cache_bytes += pixbuf_bytes(tile->pixbuf);
+  if (tile->zoom != ui.zoom) return;
+  for (list = pages_with_pdf_page(tile->pageno); list!= NULL; list = list->next) {
+    pg = (struct Page *)list->data;
+    if (pg->bg->canvas_item != NULL && journal_page_number(pg) >= 0 &&
+        bgpdf_page_fits(pg, get_bgpdf_page(tile->pageno)))
+      add_canvas_bg_tile(pg, tile);
+  }
+}
+
+void trim_bgpdf_cache(void)
+{
+  GList *link, *prev;
+  struct BgPdfPage *bgpg;
+  struct BgPdfTile *tile;
+  GdkPixbuf *pix;
+  gsize budget;
+  int pass, width, height;
+
+  budget = (gsize)ui.pdf_cache_size*1048576;
+  for (link = bgpdf.tile_lru->tail; link != NULL && bgpdf.cache_bytes > budget; link = prev) {
+    prev = link->prev;
+    tile = (struct BgPdfTile *)link->data;
+    if (tile->stamp == bgpdf.clock) continue; // in view
+    drop_bgpdf_tile(tile);
+    bgpdf.cache_evictions++;
+  }
+  for (pass = 0; pass < 2; pass++)
+    for (link = bgpdf.lru->tail; link != NULL && bgpdf.cache_bytes > budget; link = prev) {
+      prev = link->prev;
+      bgpg = (struct BgPdfPage *)link->data;
+      if (bgpg->stamp == bgpdf.clock) continue; // in view
+      if (pass == 0) { // go back to the preview
+        if (bgpg->pixbuf == NULL) continue;
+        if (bgpg->preview == NULL && bgpg->dpi > BGPDF_PREVIEW_DPI) {
+          width = MAX(1, (int)(bgpg->pixel_width * BGPDF_PREVIEW_DPI/bgpg->dpi));
+          height = MAX(1, (int)(bgpg->pixel_height * BGPDF_PREVIEW_DPI/bgpg->dpi));
+          pix = gdk_pixbuf_scale_simple(bgpg->pixbuf, width, height, GDK_INTERP_BILINEAR);
+          replace_bgpdf_pixbuf(&bgpg->preview, pix);
+        }
+        replace_bgpdf_pixbuf(&bgpg->pixbuf, NULL);
+      }
+      else replace_bgpdf_pixbuf(&bgpg->preview, NULL); // drop altogether
+      bgpdf_page_changed(bgpg);
+      bgpdf.cache_evictions++;
+      reset_bgpdf_scale(bgpg->pageno);
+    }
+}
+
+/* install a rendered page, in the main loop */
+
+gboolean bgpdf_request_done(gpointer data)
+{
+  struct BgPdfRequest *req;
+  struct BgPdfPage *bgpg;
+  GtkWidget *dialog;
 
-  // process the generated pixbuf...
-  if (pixbuf != NULL) { // success
-    while (req->pageno > bgpdf.npages) {
-      bgpg = g_new(struct BgPdfPage, 1);
-      bgpg->pixbuf = NULL;
-      bgpdf.pages = g_list_append(bgpdf.pages, bgpg);
-      bgpdf.npages++;
-    }
-    bgpg = g_list_nth_data(bgpdf.pages, req->pageno-1);
-    if (bgpg->pixbuf!=NULL) g_object_unref(bgpg->pixbuf);
-    bgpg->pixbuf = pixbuf;
-    bgpg->dpi = req->dpi;
-    bgpg->pixel_height = scaled_height;
-    bgpg->pixel_width = scaled_width;
-    bgpdf_update_bg(req->pageno, bgpg); // update all pages that have this bg
+  req = (struct BgPdfRequest *)data;
+  if (req->serial != bgpdf.serial || bgpdf.status == STATUS_NOT_INIT)
+    { free_bgpdf_request(req); return FALSE; } // shutdown_bgpdf() left it to us
+  if (req->tile != NULL) {
+    if (g_hash_table_lookup(bgpdf.tile_requests, req->tile) == req)
+      g_hash_table_remove(bgpdf.tile_requests, req->tile);
+  }
+  else if (req->preview) {
+    if (g_hash_table_lookup(bgpdf.preview_requests, GINT_TO_POINTER(req->pageno)) == req)
+      g_hash_table_remove(bgpdf.preview_requests, GINT_TO_POINTER(req->pageno));
+  }
+  else if (g_hash_table_lookup(bgpdf.requests, GINT_TO_POINTER(req->pageno)) == req)
+    g_hash_table_remove(bgpdf.requests, GINT_TO_POINTER(req->pageno));
+  if (g_atomic_int_get(&req->cancelled) || (req->preview && req->pixbuf == NULL))
+    { free_bgpdf_request(req); return FALSE; } // a failed preview is left to the full request
+
+  if (req->tile != NULL && req->pixbuf != NULL) {
+    req->tile->pixbuf = req->pixbuf;
+    req->pixbuf = NULL;
+    add_bgpdf_tile(req->tile);
+    req->tile = NULL;
+    trim_bgpdf_cache();
+  }
+  else if (req->pixbuf != NULL) { // success
+    bgpg = get_bgpdf_page(req->pageno);
+    if (req->preview) replace_bgpdf_pixbuf(&bgpg->preview, req->pixbuf);
+    else {
+      replace_bgpdf_pixbuf(&bgpg->pixbuf, req->pixbuf);
+      bgpg->dpi = req->dpi;
+    }
+    req->pixbuf = NULL;
+    bgpdf_page_changed(bgpg);
+    if (req->priority <= ui.progressive_bg_prefetch) touch_bgpdf_page(bgpg);
+    trim_bgpdf_cache();
   } else { // failure
     if (!bgpdf.has_failed) {
       dialog = gtk_message_dialog_new(GTK_WINDOW(winMain), GTK_DIALOG_MODAL,
@@ -1442,72 +3418,537 @@ gboolean bgpdf_scheduler_callback(gpointer data)
     }
     bgpdf.has_failed = TRUE;
   }
+  free_bgpdf_request(req);
+  return FALSE;
+}
+
+/* The whole pages rendered at full resolution are also saved as PNG files
+   in ui.cachedir, named after a key for the PDF, the page number and the
+   dpi (to a tenth), and are read from there before asking poppler. The key
+   is an MD5 hash of the file's path, size and date, and of its first and
+   last BGPDF_KEY_SAMPLE bytes: hashing the whole file would mean reading
+   all of it in before showing anything.
+   Several instances may share the directory: files are written under a
+   temporary name and renamed into place, so they appear all at once.
+   Using a file refreshes its date, and the oldest files get removed to stay
+   within ui.pdf_disk_cache_size megabytes, each time an eighth of that has
+   been written and when the PDF is closed. */
+
+gchar *bgpdf_cache_key(const char *pdfname)
+{
+#if GLIB_CHECK_VERSION(2,16,0)
+  GChecksum *checksum;
+  struct stat stat_buf;
+  gchar *header, *key;
+  gsize sample;
+
+  if (g_stat(pdfname, &stat_buf) != 0) return NULL;
+  checksum = g_checksum_new(G_CHECKSUM_MD5);
+  header = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%" G_GINT64_FORMAT "\n", pdfname,
+                           (gint64)stat_buf.st_size, (gint64)stat_buf.st_mtime);
+  g_checksum_update(checksum, (const guchar *)header, -1);
+  g_free(header);
+  sample = MIN(bgpdf.file_length, BGPDF_KEY_SAMPLE);
+  g_checksum_update(checksum, (const guchar *)bgpdf.file_contents, sample);
+  g_checksum_update(checksum, (const guchar *)bgpdf.file_contents + bgpdf.file_length - sample,
+                    sample);
+  key = g_strdup(g_checksum_get_string(checksum));
+  g_checksum_free(checksum);
+  return key;
+#else
+  return NULL;
+#endif
+}
+
+gchar *bgpdf_cache_file(struct BgPdfRequest *req)
+{
+  gchar *name, *path;
+
+  name = g_strdup_printf("%s-%d-%d.png", bgpdf.cache_key, req->pageno, 
+                         (int)(req->dpi*10 + 0.5));
+  path = g_build_filename(ui.cachedir, name, NULL);
+  g_free(name);
+  return path;
+}
+
+GdkPixbuf *read_bgpdf_cache(const gchar *cachefile)
+{
+  GdkPixbuf *pixbuf;
+
+  if (!g_file_test(cachefile, G_FILE_TEST_IS_REGULAR)) return NULL;
+  pixbuf = gdk_pixbuf_new_from_file(cachefile, NULL);
+  if (pixbuf == NULL) return NULL;
+#if GLIB_CHECK_VERSION(2,18,0)
+  g_utime(cachefile, NULL); // recently used
+#endif
+  g_atomic_int_inc(&bgpdf.disk_hits);
+  return pixbuf;
+}
+
+struct CacheEntry {
+  gchar *path;
+  gint64 mtime;
+  gint64 size;
+};
+
+gint compare_cache_entries(gconstpointer a, gconstpointer b)
+{
+  const struct CacheEntry *ea = *(struct CacheEntry * const *)a;
+  const struct CacheEntry *eb = *(struct CacheEntry * const *)b;
+
+  if (ea->mtime != eb->mtime) return (ea->mtime < eb->mtime) ? -1 : 1;
+  return 0;
+}
+
+void trim_bgpdf_disk_cache(void)
+{
+  GDir *dir;
+  const gchar *name;
+  struct CacheEntry *entry;
+  struct stat stat_buf;
+  GPtrArray *entries;
+  gint64 total;
+  guint i;
+
+  dir = g_dir_open(ui.cachedir, 0, NULL);
+  if (dir == NULL) return;
+  entries = g_ptr_array_new();
+  total = 0;
+  while ((name = g_dir_read_name(dir)) != NULL) {
+    entry = g_new(struct CacheEntry, 1);
+    entry->path = g_build_filename(ui.cachedir, name, NULL);
+    if (g_stat(entry->path, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode))
+      { g_free(entry->path); g_free(entry); continue; }
+    entry->mtime = stat_buf.st_mtime;
+    entry->size = stat_buf.st_size;
+    total += entry->size;
+    g_ptr_array_add(entries, entry);
+  }
+  g_dir_close(dir);
+
+  // the oldest first; another instance may be removing them too
+  g_ptr_array_sort(entries, compare_cache_entries);
+  for (i = 0; i < entries->len; i++) {
+    entry = (struct CacheEntry *)g_ptr_array_index(entries, i);
+    if (total > (gint64)ui.pdf_disk_cache_size*1048576) {
+      g_unlink(entry->path);
+      total -= entry->size;
+    }
+    g_free(entry->path);
+    g_free(entry);
+  }
+  g_ptr_array_free(entries, TRUE);
+}
+
+void write_bgpdf_cache(const gchar *cachefile, GdkPixbuf *pixbuf)
+{
+  gchar *tmpfn;
+
+  struct stat stat_buf;
+
+  tmpfn = g_strdup_printf("%s.%08x.tmp", cachefile, g_random_int());
+  if (!gdk_pixbuf_save(pixbuf, tmpfn, "png", NULL, "compression", "1", NULL) ||
+      g_stat(tmpfn, &stat_buf) != 0 || g_rename(tmpfn, cachefile) != 0) {
+    g_unlink(tmpfn);
+    g_free(tmpfn);
+    return;
+  }
+  g_free(tmpfn);
 
-  bgpdf.requests = g_list_delete_link(bgpdf.requests, bgpdf.requests);
-  if (bgpdf.requests != NULL) return TRUE; // remain in the idle loop
-  bgpdf.pid = 0;
-  return FALSE; // we're done
+  // keep within the budget as we go, one thread at a time
+  g_atomic_int_add(&bgpdf.disk_written, (gint)(stat_buf.st_size/1024));
+  if (g_atomic_int_get(&bgpdf.disk_written) > ui.pdf_disk_cache_size*128 &&
+      g_atomic_int_compare_and_exchange(&bgpdf.disk_trimming, 0, 1)) {
+    g_atomic_int_set(&bgpdf.disk_written, 0);
+    trim_bgpdf_disk_cache();
+    g_atomic_int_set(&bgpdf.disk_trimming, 0);
+  }
+}
+
+/* render a request, in a thread of the pool. Always through cairo into an
+   image surface: the X pixmap path can't be used outside the main thread,
+   and the image surface has no bitmap font bug. The threads each have their
+   own document, which needs poppler 0.20 or later (see configure.in). */
+
+void render_bgpdf_request(gpointer data, gpointer user_data)
+{
+  struct BgPdfRequest *req;
+  PopplerDocument *document;
+  PopplerPage *pdfpage;
+  gdouble height, width;
+  int src_x, src_y;
+  gchar *cachefile;
+
+  req = (struct BgPdfRequest *)data;
+  cachefile = NULL;
+  if (!g_atomic_int_get(&req->cancelled) && bgpdf.cache_key != NULL &&
+      req->tile == NULL && !req->preview) {
+    cachefile = bgpdf_cache_file(req);
+    req->pixbuf = read_bgpdf_cache(cachefile);
+  }
+  if (!g_atomic_int_get(&req->cancelled) && req->pixbuf == NULL) {
+    document = (PopplerDocument *)g_async_queue_try_pop(bgpdf.documents);
+    if (document == NULL)
+      document = poppler_document_new_from_data(bgpdf.file_contents, 
+                          bgpdf.file_length, NULL, NULL);
+    pdfpage = NULL;
+    if (document != NULL)
+      pdfpage = poppler_document_get_page(document, req->pageno-1);
+    if (pdfpage) {
+      poppler_page_get_size(pdfpage, &width, &height);
+      req->pixel_width = (int) (req->dpi * width/72);
+      req->pixel_height = (int) (req->dpi * height/72);
+      src_x = src_y = 0;
+      if (req->tile != NULL) { // just our part of the page
+        src_x = req->tile->x * BGPDF_TILE_SIZE;
+        src_y = req->tile->y * BGPDF_TILE_SIZE;
+        req->pixel_width = MIN(BGPDF_TILE_SIZE, req->pixel_width - src_x);
+        req->pixel_height = MIN(BGPDF_TILE_SIZE, req->pixel_height - src_y);
+      }
+      if (req->pixel_width > 0 && req->pixel_height > 0)
+        req->pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+                   FALSE, 8, req->pixel_width, req->pixel_height);
+      if (req->pixbuf != NULL)
+        wrapper_poppler_page_render_to_pixbuf(
+                  pdfpage, src_x, src_y, req->pixel_width, req->pixel_height,
+                  req->dpi/72, 0, req->pixbuf);
+      g_object_unref(pdfpage);
+    }
+    if (document != NULL) g_async_queue_push(bgpdf.documents, document);
+    if (cachefile != NULL && req->pixbuf != NULL) write_bgpdf_cache(cachefile, req->pixbuf);
+  }
+  g_free(cachefile);
+  g_idle_add(bgpdf_request_done, req);
+}
+
+/* the order in which the pool runs the requests */
+
+gint compare_bgpdf_requests(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const struct BgPdfRequest *ra = a, *rb = b;
+
+  if (ra->priority != rb->priority) return (ra->priority < rb->priority) ? -1 : 1;
+  if (ra->preview != rb->preview) return ra->preview ? -1 : 1;
+  if (ra->order != rb->order) return (ra->order < rb->order) ? -1 : 1;
+  return 0;
 }
 
 /* make a request */
 
-gboolean add_bgpdf_request(int pageno, double zoom)
+struct BgPdfRequest *new_bgpdf_request(int pageno, double zoom, int priority)
 {
-  struct BgPdfRequest *req, *cmp_req;
-  GList *list;
+  static guint order = 0;
+  struct BgPdfRequest *req;
 
-  if (bgpdf.status == STATUS_NOT_INIT)
-    return FALSE; // don't accept requests
-  req = g_new(struct BgPdfRequest, 1);
+  req = g_new0(struct BgPdfRequest, 1);
   req->pageno = pageno;
   req->dpi = 72*zoom;
+  req->serial = bgpdf.serial;
+  req->priority = priority;
+  req->order = order++;
 //  printf("DEBUG: Enqueuing request for page %d at %f dpi\n", pageno, req->dpi);
+  return req;
+}
 
-  // cancel any request this may supersede
-  for (list = bgpdf.requests; list != NULL; ) {
-    cmp_req = (struct BgPdfRequest *)list->data;
-    list = list->next;
-    if (cmp_req->pageno == pageno) cancel_bgpdf_request(cmp_req);
+gboolean add_bgpdf_request(int pageno, double zoom, int priority)
+{
+  struct BgPdfRequest *req, *cmp_req;
+  struct BgPdfPage *bgpg;
+
+  if (bgpdf.status == STATUS_NOT_INIT)
+    return FALSE; // don't accept requests
+
+  // if there's nothing to show yet, start with a preview
+  bgpg = get_bgpdf_page(pageno);
+  if (bgpg->pixbuf == NULL && bgpg->preview == NULL && 72*zoom > BGPDF_PREVIEW_DPI &&
+      g_hash_table_lookup(bgpdf.preview_requests, GINT_TO_POINTER(pageno)) == NULL) {
+    req = new_bgpdf_request(pageno, BGPDF_PREVIEW_DPI/72.0, priority);
+    req->preview = TRUE;
+    g_hash_table_insert(bgpdf.preview_requests, GINT_TO_POINTER(pageno), req);
+    g_thread_pool_push(bgpdf.pool, req, NULL);
   }
 
+  req = new_bgpdf_request(pageno, zoom, priority);
+  bgpdf.cache_misses++;
+
+  // cancel any request this may supersede
+  cmp_req = g_hash_table_lookup(bgpdf.requests, GINT_TO_POINTER(pageno));
+  if (cmp_req != NULL) cancel_bgpdf_request(cmp_req);
+
   // make the request
-  bgpdf.requests = g_list_append(bgpdf.requests, req);
-  if (!bgpdf.pid) bgpdf.pid = g_idle_add(bgpdf_scheduler_callback, NULL);
+  g_hash_table_insert(bgpdf.requests, GINT_TO_POINTER(pageno), req);
+  g_thread_pool_push(bgpdf.pool, req, NULL);
   return TRUE;
 }
 
+/* request the tiles of a page that are in rect (in page coordinates), at
+   the current zoom, and mark those already rendered as in view */
+
+void request_bgpdf_tiles(struct Page *pg, struct BBox *rect)
+{
+  struct BgPdfPage *bgpg;
+  struct BgPdfTile key, *tile;
+  struct BgPdfRequest *req;
+  int x0, x1, y0, y1;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  bgpg = get_bgpdf_page(pg->bg->file_page_seq);
+  if (!bgpdf_page_fits(pg, bgpg)) return;
+  key.pageno = bgpg->pageno;
+  key.zoom = ui.zoom;
+  x0 = (int)(rect->left*ui.zoom/BGPDF_TILE_SIZE);
+  y0 = (int)(rect->top*ui.zoom/BGPDF_TILE_SIZE);
+  x1 = MIN((int)(rect->right*ui.zoom/BGPDF_TILE_SIZE),
+           ((int)(bgpg->width*ui.zoom)-1)/BGPDF_TILE_SIZE);
+  y1 = MIN((int)(rect->bottom*ui.zoom/BGPDF_TILE_SIZE),
+           ((int)(bgpg->height*ui.zoom)-1)/BGPDF_TILE_SIZE);
+  for (key.y = y0; key.y <= y1; key.y++)
+    for (key.x = x0; key.x <= x1; key.x++) {
+      tile = g_hash_table_lookup(bgpdf.tiles, &key);
+      if (tile != NULL) {
+        if (tile->stamp != bgpdf.clock && tile->stamp != bgpdf.clock-1) bgpdf.cache_hits++;
+        tile->stamp = bgpdf.clock;
+        g_queue_unlink(bgpdf.tile_lru, tile->lru_link);
+        g_queue_push_head_link(bgpdf.tile_lru, tile->lru_link);
+        continue;
+      }
+      req = g_hash_table_lookup(bgpdf.tile_requests, &key);
+      if (req != NULL) { req->priority = 0; continue; }
+      req = new_bgpdf_request(key.pageno, key.zoom, 0);
+      bgpdf.cache_misses++;
+      req->tile = g_memdup(&key, sizeof(struct BgPdfTile));
+      g_hash_table_insert(bgpdf.tile_requests, req->tile, req);
+      g_thread_pool_push(bgpdf.pool, req, NULL);
+    }
+}
+
+/* re-prioritize the pending requests: begin_bgpdf_priorities() marks them
+   all as far away, set_bgpdf_priority() is called for each page near the
+   view, and end_bgpdf_priorities() cancels the requests that are still
+   further than max_priority and re-sorts the others */
+
+void mark_bgpdf_request_far(gpointer key, gpointer value, gpointer user_data)
+{
+  ((struct BgPdfRequest *)value)->priority = G_MAXINT;
+}
+
+void begin_bgpdf_priorities(void)
+{
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  bgpdf.clock++;
+  g_hash_table_foreach(bgpdf.requests, mark_bgpdf_request_far, NULL);
+  g_hash_table_foreach(bgpdf.tile_requests, mark_bgpdf_request_far, NULL);
+  g_hash_table_foreach(bgpdf.preview_requests, mark_bgpdf_request_far, NULL);
+}
+
+void set_bgpdf_priority(int pageno, int priority)
+{
+  struct BgPdfRequest *req;
+
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  req = g_hash_table_lookup(bgpdf.requests, GINT_TO_POINTER(pageno));
+  if (req != NULL && priority < req->priority) req->priority = priority;
+  req = g_hash_table_lookup(bgpdf.preview_requests, GINT_TO_POINTER(pageno));
+  if (req != NULL && priority < req->priority) req->priority = priority;
+}
+
+gboolean cancel_far_bgpdf_request(gpointer key, gpointer value, gpointer user_data)
+{
+  struct BgPdfRequest *req;
+
+  req = (struct BgPdfRequest *)value;
+  if (req->priority <= GPOINTER_TO_INT(user_data)) return FALSE;
+  cancel_bgpdf_request(req);
+  reset_bgpdf_scale(req->pageno); // so it gets requested again later
+  return TRUE;
+}
+
+// the tiles are only wanted while in view
+
+gboolean cancel_far_bgpdf_tile(gpointer key, gpointer value, gpointer user_data)
+{
+  struct BgPdfRequest *req;
+
+  req = (struct BgPdfRequest *)value;
+  if (req->priority == 0) return FALSE;
+  cancel_bgpdf_request(req);
+  return TRUE;
+}
+
+void end_bgpdf_priorities(int max_priority)
+{
+  if (bgpdf.status == STATUS_NOT_INIT) return;
+  g_hash_table_foreach_remove(bgpdf.requests, cancel_far_bgpdf_request, 
+                              GINT_TO_POINTER(max_priority));
+  g_hash_table_foreach_remove(bgpdf.preview_requests, cancel_far_bgpdf_request, 
+                              GINT_TO_POINTER(max_priority));
+  g_hash_table_foreach_remove(bgpdf.tile_requests, cancel_far_bgpdf_tile, NULL);
+  // setting the sort function again re-sorts the queue
+  g_thread_pool_set_sort_function(bgpdf.pool, compare_bgpdf_requests, NULL);
+  trim_bgpdf_cache();
+}
+
+/* The background PDF is in memory only once, in bgpdf.data, which
+   poppler, the saving code and the PDF exporter all use; a save in progress
+   holds its own reference, so the data outlives shutdown_bgpdf() if needed.
+   The file is memory-mapped when possible, else read in. The PDF parsers
+   expect a null byte at the end: POSIX guarantees that the end of the last
+   mapped page is zero-filled, so a file that ends exactly on a page boundary
+   is read in.
+   Touching a mapped page that is no longer in the file kills us with SIGBUS.
+   Xournal itself only replaces files, never truncates them, but files on
+   network shares and removable disks can go away under us, so those are
+   read in. A local file rewritten in place by another program while open
+   (say, a PDF being recompiled) remains a risk. */
+
+// whether pdfname is on a filesystem we can map it from (types as in statfs(2))
+
+static gboolean bgpdf_can_map(const char *pdfname)
+{
+#ifdef __linux__
+  static const guint32 unsafe_fs[] = {
+    0x6969, 0x517b, 0xff534d42, 0xfe534d42, // nfs, smb, cifs, smb2
+    0x65735546, 0x01021997, 0x73757245, 0x5346414f, 0x00c36400, // fuse, 9p, coda, afs, ceph
+    0x4d44, 0x2011bab0, 0x9660, 0x15013346 }; // fat, exfat, iso9660, udf
+  struct statfs buf;
+  int i;
+
+  if (statfs(pdfname, &buf) != 0) return FALSE;
+  for (i=0; i<(int)(sizeof(unsafe_fs)/sizeof(guint32)); i++)
+    if ((guint32)buf.f_type == unsafe_fs[i]) return FALSE;
+#endif
+  return TRUE;
+}
+
+gboolean load_bgpdf_contents(const char *pdfname)
+{
+  struct PdfData *data;
+  long pagesize = 0;
+
+  data = g_new0(struct PdfData, 1);
+  data->ref_count = 1;
+#ifndef WIN32
+  pagesize = sysconf(_SC_PAGESIZE);
+  if (pagesize > 0 && bgpdf_can_map(pdfname))
+    data->mapped = g_mapped_file_new(pdfname, FALSE, NULL);
+#endif
+  if (data->mapped != NULL) {
+    data->contents = g_mapped_file_get_contents(data->mapped);
+    data->length = g_mapped_file_get_length(data->mapped);
+    if (data->length % pagesize == 0) { // no zero byte after the end
+#if GLIB_CHECK_VERSION(2,22,0)
+      g_mapped_file_unref(data->mapped);
+#else
+      g_mapped_file_free(data->mapped);
+#endif
+      data->mapped = NULL;
+    }
+  }
+  if (data->mapped == NULL &&
+      !g_file_get_contents(pdfname, &(data->contents), &(data->length), NULL)) {
+    g_free(data);
+    return FALSE;
+  }
+  bgpdf.data = data;
+  bgpdf.file_contents = data->contents;
+  bgpdf.file_length = data->length;
+  return TRUE;
+}
+
+void unref_pdf_data(struct PdfData *data)
+{
+  if (data == NULL || !g_atomic_int_dec_and_test(&data->ref_count)) return;
+  if (data->mapped != NULL) {
+#if GLIB_CHECK_VERSION(2,22,0)
+    g_mapped_file_unref(data->mapped);
+#else
+    g_mapped_file_free(data->mapped);
+#endif
+  }
+  else g_free(data->contents);
+  g_free(data);
+}
+
+void free_bgpdf_contents(void)
+{
+  unref_pdf_data(bgpdf.data);
+  bgpdf.data = NULL;
+  bgpdf.file_contents = NULL;
+  bgpdf.file_length = 0;
+}
+
 /* shutdown the PDF reader */
 
+gboolean cancel_any_bgpdf_request(gpointer key, gpointer value, gpointer user_data)
+{
+  cancel_bgpdf_request((struct BgPdfRequest *)value);
+  return TRUE;
+}
+
 void shutdown_bgpdf(void)
 {
   GList *list;
+  int i;
   struct BgPdfPage *pdfpg;
-  struct BgPdfRequest *req;
+  gpointer document;
 
   if (bgpdf.status == STATUS_NOT_INIT) return;
   
   // cancel all requests and free data structures
   refstring_unref(bgpdf.filename);
-  for (list = bgpdf.pages; list != NULL; list = list->next) {
-    pdfpg = (struct BgPdfPage *)list->data;
+  for (i = 0; i < (int)bgpdf.pages->len; i++) {
+    pdfpg = (struct BgPdfPage *)g_ptr_array_index(bgpdf.pages, i);
     if (pdfpg->pixbuf!=NULL) g_object_unref(pdfpg->pixbuf);
+    if (pdfpg->preview!=NULL) g_object_unref(pdfpg->preview);
     g_free(pdfpg);
   }
-  g_list_free(bgpdf.pages);
-  for (list = bgpdf.requests; list != NULL; list = list->next) {
-    req = (struct BgPdfRequest *)list->data;
-    g_free(req);
+  g_ptr_array_free(bgpdf.pages, TRUE);
+  g_queue_free(bgpdf.lru);
+  for (list = bgpdf.tile_lru->head; list != NULL; list = list->next)
+    free_bgpdf_tile((struct BgPdfTile *)list->data);
+  g_queue_free(bgpdf.tile_lru);
+  g_hash_table_destroy(bgpdf.tiles);
+  g_debug("PDF background cache: %u hits, %u misses (%d from disk), %u evictions",
+          bgpdf.cache_hits, bgpdf.cache_misses, bgpdf.disk_hits, bgpdf.cache_evictions);
+  // cancel the requests and let the pool run through them; each one
+  // is freed by its pending bgpdf_request_done() callback
+  bgpdf.serial++;
+  if (bgpdf.requests != NULL) {
+    g_hash_table_foreach_remove(bgpdf.requests, cancel_any_bgpdf_request, NULL);
+    g_hash_table_destroy(bgpdf.requests);
+    bgpdf.requests = NULL;
   }
-  g_list_free(bgpdf.requests);
-
-  if (bgpdf.file_contents!=NULL) {
-    g_free(bgpdf.file_contents); 
-    bgpdf.file_contents = NULL;
+  if (bgpdf.tile_requests != NULL) {
+    g_hash_table_foreach_remove(bgpdf.tile_requests, cancel_any_bgpdf_request, NULL);
+    g_hash_table_destroy(bgpdf.tile_requests);
+    bgpdf.tile_requests = NULL;
+  }
+  if (bgpdf.preview_requests != NULL) {
+    g_hash_table_foreach_remove(bgpdf.preview_requests, cancel_any_bgpdf_request, NULL);
+    g_hash_table_destroy(bgpdf.preview_requests);
+    bgpdf.preview_requests = NULL;
+  }
+  if (bgpdf.pool != NULL) g_thread_pool_free(bgpdf.pool, FALSE, TRUE);
+  bgpdf.pool = NULL;
+  if (bgpdf.documents != NULL) {
+    while ((document = g_async_queue_try_pop(bgpdf.documents)) != NULL)
+      g_object_unref(document);
+    g_async_queue_unref(bgpdf.documents);
+    bgpdf.documents = NULL;
   }
-  if (bgpdf.document!=NULL) {
+  if (bgpdf.cache_key != NULL) {
+    trim_bgpdf_disk_cache();
+    g_free(bgpdf.cache_key);
+    bgpdf.cache_key = NULL;
+  }
+
+  if (bgpdf.document!=NULL) { // before the data it was reading from
     g_object_unref(bgpdf.document);
     bgpdf.document = NULL;
   }
+  free_bgpdf_contents();
+  bgfile_free(bgpdf.file_saved);
+  bgpdf.file_saved = NULL;
 
   bgpdf.status = STATUS_NOT_INIT;
 }
@@ -1522,37 +3963,46 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
   struct Page *pg;
   PopplerPage *pdfpage;
   gdouble width, height;
-  gchar *uri;
   
   if (bgpdf.status != STATUS_NOT_INIT) return FALSE;
   
-  // make a copy of the file in memory and check it's a PDF
-  if (!g_file_get_contents(pdfname, &(bgpdf.file_contents), &(bgpdf.file_length), NULL))
-    return FALSE;
+  // get the file in memory and check it's a PDF
+  if (!load_bgpdf_contents(pdfname)) return FALSE;
   if (bgpdf.file_length < 4 || strncmp(bgpdf.file_contents, "%PDF", 4))
-    { g_free(bgpdf.file_contents); bgpdf.file_contents = NULL; return FALSE; }
+    { free_bgpdf_contents(); return FALSE; }
+  bgpdf.file_saved = bgfile_new(pdfname);
 
   // init bgpdf data structures and open poppler document
   bgpdf.status = STATUS_READY;
   bgpdf.filename = new_refstring((file_domain == DOMAIN_ATTACH) ? "bg.pdf" : pdfname);
   bgpdf.file_domain = file_domain;
   bgpdf.npages = 0;
-  bgpdf.pages = NULL;
-  bgpdf.requests = NULL;
-  bgpdf.pid = 0;
+  bgpdf.pages = g_ptr_array_new();
+  bgpdf.lru = g_queue_new();
+  bgpdf.tiles = g_hash_table_new(bgpdf_tile_hash, bgpdf_tile_equal);
+  bgpdf.tile_lru = g_queue_new();
+  bgpdf.cache_bytes = 0;
+  bgpdf.cache_hits = bgpdf.cache_misses = bgpdf.cache_evictions = 0;
+  bgpdf.disk_hits = 0;
+  bgpdf.disk_written = bgpdf.disk_trimming = 0;
+  bgpdf.cache_key = NULL;
+  if (ui.pdf_disk_cache_size > 0 && ui.cachedir != NULL)
+    bgpdf.cache_key = bgpdf_cache_key(pdfname);
+  bgpdf.requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+  bgpdf.tile_requests = g_hash_table_new(bgpdf_tile_hash, bgpdf_tile_equal);
+  bgpdf.preview_requests = g_hash_table_new(g_direct_hash, g_direct_equal);
+  bgpdf.pool = NULL;
+  bgpdf.documents = NULL;
   bgpdf.has_failed = FALSE;
 
-/* poppler_document_new_from_data() starts at 0.6.1, but we want to
-   be compatible with poppler 0.5.4 = latest in CentOS as of sept 2009 */
-  uri = g_filename_to_uri(pdfname, NULL, NULL);
-  if (!uri) uri = g_strdup_printf("file://%s", pdfname);
-  bgpdf.document = poppler_document_new_from_file(uri, NULL, NULL);
-  g_free(uri);
-/*    with poppler 0.6.1 or later, can replace the above 4 lines by:
+  // poppler reads from our copy rather than loading the file again
   bgpdf.document = poppler_document_new_from_data(bgpdf.file_contents, 
                           bgpdf.file_length, NULL, NULL);
-*/
   if (bgpdf.document == NULL) { shutdown_bgpdf(); return FALSE; }
+  bgpdf.documents = g_async_queue_new();
+  bgpdf.pool = g_thread_pool_new(render_bgpdf_request, NULL,
+                 render_thread_count(), FALSE, NULL);
+  g_thread_pool_set_sort_function(bgpdf.pool, compare_bgpdf_requests, NULL);
   
   if (pdfname[0]=='/' && ui.filename == NULL) {
     if (ui.default_path!=NULL) g_free(ui.default_path);
@@ -1571,7 +4021,7 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
       bg->canvas_item = NULL;
       pg = NULL;
     } else {
-      pg = (struct Page *)g_list_nth_data(journal.pages, i-1);
+      pg = journal_page(i-1);
       bg = pg->bg;
     }
     bg->type = BG_PDF;
@@ -1584,12 +4034,12 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
     g_object_unref(pdfpage);
     if (pg == NULL) {
       pg = new_page_with_bg(bg, width, height);
-      journal.pages = g_list_append(journal.pages, pg);
-      journal.npages++;
+      journal_insert_page(pg, journal.npages);
     } else {
       pg->width = width; 
       pg->height = height;
       make_page_clipbox(pg);
+      journal_pages_changed(i-1);
       update_canvas_bg(pg);
     }
   }
@@ -1602,16 +4052,21 @@ gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain)
 // look for all journal pages with given pdf bg, and update their bg pixmaps
 void bgpdf_update_bg(int pageno, struct BgPdfPage *bgpg)
 {
-  GList *list;
+  GSList *list;
   struct Page *pg;
+  GdkPixbuf *pixbuf;
   
-  for (list = journal.pages; list!= NULL; list = list->next) {
+  // the full rendering if we have it, else the preview
+  pixbuf = (bgpg->pixbuf != NULL) ? bgpg->pixbuf : bgpg->preview;
+  for (list = pages_with_pdf_page(pageno); list!= NULL; list = list->next) {
     pg = (struct Page *)list->data;
-    if (pg->bg->type == BG_PDF && pg->bg->file_page_seq == pageno) {
+    if (journal_page_number(pg) >= 0) { // not deleted
       if (pg->bg->pixbuf!=NULL) g_object_unref(pg->bg->pixbuf);
-      pg->bg->pixbuf = g_object_ref(bgpg->pixbuf);
-      pg->bg->pixel_width = bgpg->pixel_width;
-      pg->bg->pixel_height = bgpg->pixel_height;
+      pg->bg->pixbuf = (pixbuf!=NULL) ? g_object_ref(pixbuf) : NULL;
+      if (pixbuf != NULL) {
+        pg->bg->pixel_width = gdk_pixbuf_get_width(pixbuf);
+        pg->bg->pixel_height = gdk_pixbuf_get_height(pixbuf);
+      }
       update_canvas_bg(pg);
     }
   }
@@ -1744,6 +4199,8 @@ void init_config_default(void)
   ui.zoom_step_increment = 1;
   ui.zoom_step_factor = 1.5;
   ui.progressive_bg = TRUE;
+  ui.progressive_bg_prefetch = 2;
+  ui.scroll_direction = 1;
   ui.print_ruling = TRUE;
   ui.exportpdf_prefer_legacy = FALSE;
   ui.exportpdf_layers = FALSE;
@@ -1758,7 +4215,6 @@ void init_config_default(void)
   ui.button_switch_mapping = FALSE;
   ui.autoload_pdf_xoj = FALSE;
   ui.autocreate_new_xoj = FALSE;
-  ui.poppler_force_cairo = FALSE;
   ui.touch_as_handtool = FALSE;
   ui.pen_disables_touch = FALSE;
   ui.device_for_touch = g_strdup(DEFAULT_DEVICE_FOR_TOUCH);
@@ -1767,6 +4223,20 @@ void init_config_default(void)
   ui.autosave_delay = 5;
   ui.autosave_loop_running = FALSE;
   ui.autosave_need_catchup = FALSE;
+  ui.background_save = TRUE;
+  ui.lazy_page_loading = TRUE;
+  ui.save_image_refs = FALSE;
+  ui.gzip_threads = 0;
+  ui.pdf_render_threads = 0;
+  ui.image_cache_size = 64;
+  ui.pdf_cache_size = 128;
+  ui.pdf_disk_cache_size = 256;
+  ui.batch_layer_render = FALSE;
+  ui.canvas_page_margin = 3;
+  ui.bg_save_job = NULL;
+  ui.editlog_base = ui.editlog_filename = NULL;
+  ui.editlog_dirty = ui.editlog_index = ui.editlog_attached = NULL;
+  ui.editlog_base_id = NULL;
   ui.fix_stroke_origin = FALSE;
   
   // the default UI vertical order
@@ -1933,6 +4403,36 @@ void save_config_to_file(void)
   update_keyval("general", "autosave_delay",
     _(" delay for periodic autosaves (in seconds)"),
     g_strdup_printf("%d", ui.autosave_delay));
+  update_keyval("general", "background_save",
+    _(" save files in the background, so that editing can continue (true/false)"),
+    g_strdup(ui.background_save?"true":"false"));
+  update_keyval("general", "lazy_page_loading",
+    _(" only read the contents of each page when it is first displayed (true/false)"),
+    g_strdup(ui.lazy_page_loading?"true":"false"));
+  update_keyval("general", "save_image_refs",
+    _(" write repeated images only once; such files can't be read by older versions of xournal (true/false)"),
+    g_strdup(ui.save_image_refs?"true":"false"));
+  update_keyval("general", "gzip_threads",
+    _(" number of threads for compressing and uncompressing files (0 = one per processor)"),
+    g_strdup_printf("%d", ui.gzip_threads));
+  update_keyval("general", "pdf_render_threads",
+    _(" number of threads for rendering PDF backgrounds (0 = one per processor)"),
+    g_strdup_printf("%d", ui.pdf_render_threads));
+  update_keyval("general", "image_cache_size",
+    _(" memory for the decoded images of offscreen pages, in megabytes"),
+    g_strdup_printf("%d", ui.image_cache_size));
+  update_keyval("general", "pdf_cache_size",
+    _(" memory for the rendered pages of PDF backgrounds, in megabytes"),
+    g_strdup_printf("%d", ui.pdf_cache_size));
+  update_keyval("general", "pdf_disk_cache_size",
+    _(" disk space for the rendered pages of PDF backgrounds, in megabytes (0 = no disk cache)"),
+    g_strdup_printf("%d", ui.pdf_disk_cache_size));
+  update_keyval("general", "batch_layer_render",
+    _(" draw the strokes of each loaded layer as one canvas item (true/false)"),
+    g_strdup(ui.batch_layer_render?"true":"false"));
+  update_keyval("general", "canvas_page_margin",
+    _(" number of pages before and after the view whose canvas items are kept (0-100)"),
+    g_strdup_printf("%d", ui.canvas_page_margin));
   update_keyval("general", "default_path",
     _(" default path for open/save (leave blank for current directory)"),
     g_strdup((ui.default_path!=NULL)?ui.default_path:""));
@@ -1966,9 +4466,8 @@ void save_config_to_file(void)
   update_keyval("general", "autosave_prefs",
     _(" auto-save preferences on exit (true/false)"),
     g_strdup(ui.auto_save_prefs?"true":"false"));
-  update_keyval("general", "poppler_force_cairo",
-    _(" force PDF rendering through cairo (slower but nicer) (true/false)"),
-    g_strdup(ui.poppler_force_cairo?"true":"false"));
+  // PDF bg's are always rendered through cairo now
+  g_key_file_remove_key(ui.config_data, "general", "poppler_force_cairo", NULL);
   update_keyval("general", "exportpdf_prefer_legacy",
     _(" prefer xournal's own PDF code for exporting PDFs (true/false)"),
     g_strdup(ui.exportpdf_prefer_legacy?"true":"false"));
@@ -2003,8 +4502,11 @@ void save_config_to_file(void)
     _(" when creating a new page, duplicate a PDF or image background instead of using default paper (true/false)"),
     g_strdup(ui.new_page_bg_from_pdf?"true":"false"));
   update_keyval("paper", "progressive_bg",
-    _(" just-in-time update of page backgrounds (true/false)"),
+    _(" just-in-time update of page backgrounds: render those nearest to the view first, and drop those scrolled far away (true/false)"),
     g_strdup(ui.progressive_bg?"true":"false"));
+  update_keyval("paper", "progressive_bg_prefetch",
+    _(" number of page backgrounds to render ahead of the view when scrolling, in just-in-time mode"),
+    g_strdup_printf("%d", ui.progressive_bg_prefetch));
   update_keyval("paper", "gs_bitmap_dpi",
     _(" bitmap resolution of PS/PDF backgrounds rendered using ghostscript (dpi)"),
     g_strdup_printf("%d", GS_BITMAP_DPI));
@@ -2346,6 +4848,16 @@ void load_config_from_file(void)
   parse_keyval_boolean("general", "autocreate_new_xoj", &ui.autocreate_new_xoj);
   parse_keyval_boolean("general", "autosave_enabled", &ui.autosave_enabled);
   parse_keyval_int("general", "autosave_delay", &ui.autosave_delay, 1, 3600);
+  parse_keyval_boolean("general", "background_save", &ui.background_save);
+  parse_keyval_boolean("general", "lazy_page_loading", &ui.lazy_page_loading);
+  parse_keyval_boolean("general", "save_image_refs", &ui.save_image_refs);
+  parse_keyval_int("general", "gzip_threads", &ui.gzip_threads, 0, 64);
+  parse_keyval_int("general", "pdf_render_threads", &ui.pdf_render_threads, 0, 64);
+  parse_keyval_int("general", "image_cache_size", &ui.image_cache_size, 0, 100000);
+  parse_keyval_int("general", "pdf_cache_size", &ui.pdf_cache_size, 0, 100000);
+  parse_keyval_int("general", "pdf_disk_cache_size", &ui.pdf_disk_cache_size, 0, 100000);
+  parse_keyval_boolean("general", "batch_layer_render", &ui.batch_layer_render);
+  parse_keyval_int("general", "canvas_page_margin", &ui.canvas_page_margin, 0, 100);
   parse_keyval_string("general", "default_path", &ui.default_path);
   parse_keyval_boolean("general", "pressure_sensitivity", &ui.pressure_sensitivity);
   parse_keyval_float("general", "width_minimum_multiplier", &ui.width_minimum_multiplier, 0., 10.);
@@ -2359,7 +4871,6 @@ void load_config_from_file(void)
     if (str!=NULL) { g_free(ui.shorten_menu_items); ui.shorten_menu_items = str; }
   parse_keyval_float("general", "highlighter_opacity", &ui.hiliter_opacity, 0., 1.);
   parse_keyval_boolean("general", "autosave_prefs", &ui.auto_save_prefs);
-  parse_keyval_boolean("general", "poppler_force_cairo", &ui.poppler_force_cairo);
   parse_keyval_boolean("general", "exportpdf_prefer_legacy", &ui.exportpdf_prefer_legacy);
   parse_keyval_boolean("general", "exportpdf_layers", &ui.exportpdf_layers);
   
@@ -2372,6 +4883,7 @@ void load_config_from_file(void)
   parse_keyval_boolean("paper", "apply_all", &ui.bg_apply_all_pages);
   parse_keyval_enum("paper", "default_unit", &ui.default_unit, unit_names, 4);
   parse_keyval_boolean("paper", "progressive_bg", &ui.progressive_bg);
+  parse_keyval_int("paper", "progressive_bg_prefetch", &ui.progressive_bg_prefetch, 0, 100);
   parse_keyval_boolean("paper", "print_ruling", &ui.print_ruling);
   parse_keyval_boolean("paper", "new_page_duplicates_bg", &ui.new_page_bg_from_pdf);
   parse_keyval_int("paper", "gs_bitmap_dpi", &GS_BITMAP_DPI, 1, 1200);
@@ -25,19 +25,35 @@ extern int GS_BITMAP_DPI, PDFTOPPM_PRINTING_DPI;
 #define AUTOSAVE_MAX 9
 #define AUTOSAVE_FILENAME_TEMPLATE "%s.autosave%d.xoj"
 #define AUTOSAVE_FILENAME_FILTER "%s.autosave*.xoj"
+#define EDITLOG_FILENAME_TEMPLATE "%s.editlog"
+#define EDITLOG_MAX_FRACTION 2 // full autosave once the log is half the size of the base
 
 void new_journal(void);
 gboolean save_journal(const char *filename, gboolean is_auto);
+void save_journal_background(const char *filename, gboolean is_auto, 
+            void (*callback)(struct SaveJob *job), gpointer user_data);
+void wait_for_background_save(void);
 gboolean close_journal(void);
 gboolean open_journal(char *filename);
+gboolean lazy_page_has_image_ids(struct Page *pg);
+gboolean load_page(struct Page *pg);
 
 struct Background *attempt_load_pix_bg(char *filename, gboolean attach);
 GList *attempt_load_gv_bg(char *filename);
 struct Background *attempt_screenshot_bg(void);
 
 void cancel_bgpdf_request(struct BgPdfRequest *req);
-gboolean add_bgpdf_request(int pageno, double zoom);
-gboolean bgpdf_scheduler_callback(gpointer data);
+gboolean add_bgpdf_request(int pageno, double zoom, int priority);
+void begin_bgpdf_priorities(void);
+void set_bgpdf_priority(int pageno, int priority);
+void end_bgpdf_priorities(int max_priority);
+void use_bgpdf_page(int pageno, gboolean good_enough);
+gboolean bgpdf_can_tile(struct Page *pg);
+void request_bgpdf_tiles(struct Page *pg, struct BBox *rect);
+void show_bgpdf_tiles(struct Page *pg);
+gboolean load_bgpdf_contents(const char *pdfname);
+void free_bgpdf_contents(void);
+void unref_pdf_data(struct PdfData *data);
 void shutdown_bgpdf(void);
 gboolean init_bgpdf(char *pdfname, gboolean create_pages, int file_domain);
 
@@ -57,4 +73,12 @@ void save_config_to_file(void);
 void autosave_cleanup(GList **list);
 void init_autosave(void);
 gboolean autosave_cb(gpointer is_catchup);
-char *check_for_autosave(char *filename);
+char *check_for_autosave(char *filename, gboolean *restore);
+
+void editlog_note_undo(struct UndoItem *u);
+void editlog_reset(const char *base);
+gboolean editlog_too_big(void);
+gboolean editlog_write(void);
+gboolean editlog_fits_base(char *logname, char *base);
+gboolean editlog_replay(char *logname, char *base);
+void delete_editlog(const char *base);
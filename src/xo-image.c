@@ -36,12 +36,50 @@ GdkPixbuf *pixbuf_from_buffer(const gchar *buf, gsize buflen)
   gdk_pixbuf_loader_write(loader, buf, buflen, NULL);
   gdk_pixbuf_loader_close(loader, NULL);
   pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
-  g_object_ref(pixbuf);
+  if (pixbuf != NULL) g_object_ref(pixbuf);
   g_object_unref(loader);
   return pixbuf;
 }
 
-void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
+/* Identifies the formats we store as they are, rather than converting the
+   image to PNG: any reader of xoj files can decode them, since the loader
+   recognizes the format from the data. Returns NULL for anything else. */
+
+const gchar *image_data_format(const gchar *buf, gsize buflen)
+{
+  const guchar *p = (const guchar *)buf;
+  
+  if (buf == NULL) return NULL;
+  if (buflen >= 8 && !memcmp(p, "\x89PNG\r\n\x1a\n", 8)) return "png";
+  if (buflen >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff) return "jpeg";
+  return NULL;
+}
+
+// number of color components of a JPEG image (from its SOF marker), or 0
+
+int jpeg_components(const gchar *buf, gsize buflen)
+{
+  const guchar *p = (const guchar *)buf;
+  gsize pos, seglen;
+  
+  pos = 2;
+  while (pos + 4 <= buflen) {
+    if (p[pos] != 0xff) return 0;
+    if (p[pos+1] == 0xff) { pos++; continue; } // fill byte
+    seglen = (p[pos+2]<<8) | p[pos+3];
+    if (p[pos+1] >= 0xc0 && p[pos+1] <= 0xcf && p[pos+1] != 0xc4 && 
+        p[pos+1] != 0xc8 && p[pos+1] != 0xcc) // start of frame
+      return (pos + 9 < buflen) ? p[pos+9] : 0;
+    if (p[pos+1] == 0xd9 || p[pos+1] == 0xda) return 0; // EOI or SOS first
+    pos += 2 + seglen;
+  }
+  return 0;
+}
+
+/* data, if not NULL, is the encoded image (PNG or JPEG) and is taken over
+   by the item */
+
+void create_image_from_pixbuf(GdkPixbuf *pixbuf, gchar *data, gsize datalen, double *pt)
 {
   double scale;
   struct Item *item;
@@ -52,8 +90,8 @@ void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt)
   item->bbox.left = pt[0];
   item->bbox.top = pt[1];
   item->image = pixbuf;
-  item->image_png = NULL;
-  item->image_png_len = 0;
+  item->image_png_len = (data != NULL) ? datalen : 0;
+  item->image_png = intern_image_data(data, datalen);
 
   // Scale at native size, unless that won't fit, in which case we shrink it down.
   scale = 1 / ui.zoom;
@@ -104,6 +142,8 @@ void insert_image(GdkEvent *event)
   GtkFileFilter *filt_gdkimage;
   char *filename;
   GdkPixbuf *pixbuf;
+  gchar *data;
+  gsize datalen;
   double scale=1;
   double pt[2];
   
@@ -137,8 +177,16 @@ void insert_image(GdkEvent *event)
   if (ui.default_image != NULL) g_free(ui.default_image);
   ui.default_image = g_strdup(filename);
   
+  // keep the file's own encoding if we can, e.g. JPEG photos
   set_cursor_busy(TRUE);
-  pixbuf=gdk_pixbuf_new_from_file(filename, NULL);
+  pixbuf = NULL;
+  if (g_file_get_contents(filename, &data, &datalen, NULL)) {
+    if (image_data_format(data, datalen) != NULL)
+      pixbuf = pixbuf_from_buffer(data, datalen);
+    if (pixbuf == NULL) { g_free(data); data = NULL; }
+  }
+  else data = NULL;
+  if (pixbuf == NULL) pixbuf=gdk_pixbuf_new_from_file(filename, NULL);
   set_cursor_busy(FALSE);
   
   if(pixbuf==NULL) { /* open failed */
@@ -157,7 +205,7 @@ void insert_image(GdkEvent *event)
   get_pointer_coords(event, pt);
   set_current_page(pt);  
 
-  create_image_from_pixbuf(pixbuf, pt);
+  create_image_from_pixbuf(pixbuf, data, datalen, pt);
 }
 
 void rescale_images(void)
@@ -165,3 +213,211 @@ void rescale_images(void)
   // nothing needed in this implementation
 }
 
+/* Identical images are stored once: the encoded data of image items
+   (image_png) is interned by contents and refcounted, so every copy of a
+   repeated image points to the same buffer, and the pixbuf decoded from
+   it is shared as well. Buffers must be released with unref_image_data(). */
+
+struct SharedImage {
+  gchar *data;
+  gsize len;
+  guint hash;
+  int nref;
+  GdkPixbuf *pixbuf; // weak pointer: the pixbuf is owned by the items
+};
+
+GHashTable *shared_images;  // struct SharedImage -> itself, by contents
+GHashTable *shared_by_data; // data -> struct SharedImage
+
+guint image_data_hash(const gchar *data, gsize len)
+{
+  guint hash = 2166136261u; // FNV-1a
+  
+  while (len-- > 0) hash = (hash ^ (guchar)*(data++)) * 16777619u;
+  return hash;
+}
+
+guint shared_image_hash(gconstpointer a)
+{
+  return ((const struct SharedImage *)a)->hash;
+}
+
+gboolean shared_image_equal(gconstpointer a, gconstpointer b)
+{
+  const struct SharedImage *sa = a, *sb = b;
+  return sa->hash == sb->hash && sa->len == sb->len && !memcmp(sa->data, sb->data, sa->len);
+}
+
+// takes ownership of data; returns the buffer to use, possibly another copy
+
+gchar *intern_image_data(gchar *data, gsize len)
+{
+  struct SharedImage key, *shared;
+
+  if (data == NULL) return NULL;
+  if (shared_images == NULL) {
+    shared_images = g_hash_table_new(shared_image_hash, shared_image_equal);
+    shared_by_data = g_hash_table_new(g_direct_hash, g_direct_equal);
+  }
+  key.data = data;
+  key.len = len;
+  key.hash = image_data_hash(data, len);
+  shared = g_hash_table_lookup(shared_images, &key);
+  if (shared != NULL) {
+    if (shared->data != data) g_free(data);
+    shared->nref++;
+    return shared->data;
+  }
+  shared = g_memdup(&key, sizeof(struct SharedImage));
+  shared->nref = 1;
+  shared->pixbuf = NULL;
+  g_hash_table_insert(shared_images, shared, shared);
+  g_hash_table_insert(shared_by_data, data, shared);
+  return data;
+}
+
+gchar *ref_image_data(gchar *data, gsize len)
+{
+  struct SharedImage *shared;
+
+  if (data == NULL) return NULL;
+  shared = (shared_by_data != NULL) ? g_hash_table_lookup(shared_by_data, data) : NULL;
+  if (shared == NULL) return g_memdup(data, len); // not interned: a private copy
+  shared->nref++;
+  return data;
+}
+
+gsize image_data_length(gchar *data)
+{
+  struct SharedImage *shared;
+
+  shared = (shared_by_data != NULL) ? g_hash_table_lookup(shared_by_data, data) : NULL;
+  return (shared != NULL) ? shared->len : 0;
+}
+
+void unref_image_data(gpointer data)
+{
+  struct SharedImage *shared;
+
+  if (data == NULL) return;
+  shared = (shared_by_data != NULL) ? g_hash_table_lookup(shared_by_data, data) : NULL;
+  if (shared == NULL) { g_free(data); return; } // never interned
+  if (--shared->nref > 0) return;
+  g_hash_table_remove(shared_images, shared);
+  g_hash_table_remove(shared_by_data, data);
+  if (shared->pixbuf != NULL)
+    g_object_remove_weak_pointer(G_OBJECT(shared->pixbuf), (gpointer *)&shared->pixbuf);
+  g_free(shared->data);
+  g_free(shared);
+}
+
+/* Images loaded from a file keep their encoded data (image_png) as the
+   reference copy; the pixels (image) are only decoded when needed, and
+   may be dropped again when the page is offscreen. */
+
+void decode_image_item(struct Item *item)
+{
+  struct SharedImage *shared;
+
+  if (item->image != NULL || item->image_png == NULL) return;
+  shared = (shared_by_data != NULL) ? g_hash_table_lookup(shared_by_data, item->image_png) : NULL;
+  if (shared != NULL && shared->pixbuf != NULL)
+    item->image = g_object_ref(shared->pixbuf);
+  else {
+    item->image = pixbuf_from_buffer(item->image_png, item->image_png_len);
+    if (shared != NULL && item->image != NULL) {
+      shared->pixbuf = item->image;
+      g_object_add_weak_pointer(G_OBJECT(item->image), (gpointer *)&shared->pixbuf);
+    }
+  }
+  if (item->image != NULL && item->canvas_item != NULL)
+    gnome_canvas_item_set(item->canvas_item, "pixbuf", item->image, NULL);
+}
+
+void release_image_item(struct Item *item)
+{
+  if (item->image == NULL || item->image_png == NULL) return;
+  if (item->canvas_item != NULL)
+    gnome_canvas_item_set(item->canvas_item, "pixbuf", NULL, NULL);
+  g_object_unref(item->image);
+  item->image = NULL;
+}
+
+gsize image_item_bytes(struct Item *item)
+{
+  if (item->image == NULL) return 0;
+  return gdk_pixbuf_get_rowstride(item->image) * gdk_pixbuf_get_height(item->image);
+}
+
+// decode the images of a page; returns TRUE if there were any to decode
+
+gboolean decode_page_images(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Item *item;
+  gboolean decoded = FALSE;
+
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+    for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->type == ITEM_IMAGE && item->image == NULL && item->image_png != NULL) {
+        decode_image_item(item);
+        decoded = TRUE;
+      }
+    }
+  return decoded;
+}
+
+// release the images of a page (if release) and count the pixels it holds
+
+gsize page_image_bytes(struct Page *pg, gboolean release)
+{
+  GList *layerlist, *itemlist;
+  struct Item *item;
+  gsize bytes = 0;
+
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+    for (itemlist = ((struct Layer *)layerlist->data)->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->type != ITEM_IMAGE) continue;
+      if (release) release_image_item(item);
+      bytes += image_item_bytes(item);
+    }
+  return bytes;
+}
+
+/* Keeps the decoded images of offscreen pages within ui.image_cache_size
+   megabytes, by dropping those of the pages furthest from the current page
+   first. The visible pages and the current page are left alone. */
+
+void trim_image_memory(void)
+{
+  GList *list, *first, *last;
+  struct Page *pg;
+  gsize total, *pgbytes;
+  int i, j, k, n;
+
+  n = journal.npages;
+  pgbytes = g_new0(gsize, n);
+  total = 0;
+  for (list = journal.pages, i = 0; list!=NULL && i<n; list = list->next, i++) {
+    pg = (struct Page *)list->data;
+    if (pg == ui.cur_page || is_visible(pg)) continue;
+    pgbytes[i] = page_image_bytes(pg, FALSE);
+    total += pgbytes[i];
+  }
+  
+  // walk in from both ends of the list, dropping the furthest page first
+  i = 0; j = n-1;
+  first = journal.pages; last = g_list_nth(journal.pages, j);
+  while (total > (gsize)ui.image_cache_size*1048576 && i <= j) {
+    if (ui.pageno - i >= j - ui.pageno) // page i is the furthest away
+      { k = i++; pg = (struct Page *)first->data; first = first->next; }
+    else
+      { k = j--; pg = (struct Page *)last->data; last = last->prev; }
+    if (pgbytes[k] == 0) continue;
+    total -= pgbytes[k];
+    total += page_image_bytes(pg, TRUE);
+  }
+  g_free(pgbytes);
+}
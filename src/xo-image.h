@@ -14,6 +14,16 @@
  */
 
 GdkPixbuf *pixbuf_from_buffer(const gchar *buf, gsize buflen);
-void create_image_from_pixbuf(GdkPixbuf *pixbuf, double *pt);
+const gchar *image_data_format(const gchar *buf, gsize buflen);
+int jpeg_components(const gchar *buf, gsize buflen);
+void create_image_from_pixbuf(GdkPixbuf *pixbuf, gchar *data, gsize datalen, double *pt);
 void insert_image(GdkEvent *event);
 void rescale_images(void);
+gchar *intern_image_data(gchar *data, gsize len);
+gchar *ref_image_data(gchar *data, gsize len);
+gsize image_data_length(gchar *data);
+void unref_image_data(gpointer data);
+void decode_image_item(struct Item *item);
+void release_image_item(struct Item *item);
+gboolean decode_page_images(struct Page *pg);
+void trim_image_memory(void);
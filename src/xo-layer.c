@@ -0,0 +1,355 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-layer.h"
+
+/* When a layer is loaded, the strokes at its bottom (up to the first text
+   or image) can be drawn by a single LayerItem instead of one canvas item
+   each. The batched strokes keep canvas_item == NULL. Before a tool touches
+   one of them, unbatch_item() gives it and the strokes above it their own
+   canvas items again, so that the stacking order is unchanged. */
+
+static GnomeCanvasItemClass *parent_class = NULL;
+static GHashTable *batched_items = NULL; // Item -> the LayerItem drawing it
+
+gboolean item_is_batched(struct Item *item)
+{
+  return (batched_items != NULL && g_hash_table_lookup(batched_items, item) != NULL);
+}
+
+static void set_source_color(cairo_t *cr, guint color_rgba)
+{
+  cairo_set_source_rgba(cr, ((color_rgba>>24)&0xff)/255.0,
+    ((color_rgba>>16)&0xff)/255.0, ((color_rgba>>8)&0xff)/255.0,
+    (color_rgba&0xff)/255.0);
+}
+
+static gboolean entry_in_rect(LayerEntry *entry, int x0, int y0, int x1, int y1)
+{
+  return (entry->x2 > x0 && entry->x1 < x1 && entry->y2 > y0 && entry->y1 < y1);
+}
+
+static void layer_item_update(GnomeCanvasItem *item, double *affine,
+                              ArtSVP *clip_path, int flags)
+{
+  LayerItem *layer = LAYER_ITEM(item);
+  LayerEntry *entry;
+  struct BBox *bbox;
+  int i, x1, y1, x2, y2;
+
+  if (parent_class->update)
+    (*parent_class->update)(item, affine, clip_path, flags);
+
+  for (i=0; i<6; i++) layer->affine[i] = affine[i];
+  x1 = y1 = G_MAXINT;
+  x2 = y2 = G_MININT;
+  for (i=0, entry=layer->entries; i<layer->num_entries; i++, entry++) {
+    bbox = &(entry->item->bbox);
+    entry->x1 = (int)floor(affine[0]*(bbox->left - entry->pad) + affine[4]) - 1;
+    entry->y1 = (int)floor(affine[3]*(bbox->top - entry->pad) + affine[5]) - 1;
+    entry->x2 = (int)ceil(affine[0]*(bbox->right + entry->pad) + affine[4]) + 1;
+    entry->y2 = (int)ceil(affine[3]*(bbox->bottom + entry->pad) + affine[5]) + 1;
+    x1 = MIN(x1, entry->x1); y1 = MIN(y1, entry->y1);
+    x2 = MAX(x2, entry->x2); y2 = MAX(y2, entry->y2);
+  }
+  if (layer->num_entries == 0) x1 = y1 = x2 = y2 = 0;
+  gnome_canvas_update_bbox(item, x1, y1, x2, y2);
+}
+
+static void draw_stroke(cairo_t *cr, struct Item *it)
+{
+  double *pt;
+  int j;
+
+  if (it->brush.variable_width) {
+    for (j=0, pt=it->path->coords; j<it->path->num_points-1; j++, pt+=2) {
+      cairo_move_to(cr, pt[0], pt[1]);
+      cairo_line_to(cr, pt[2], pt[3]);
+      cairo_set_line_width(cr, it->widths[j]);
+      cairo_stroke(cr);
+    }
+    return;
+  }
+  cairo_set_line_width(cr, it->brush.thickness);
+  pt = it->path->coords;
+  cairo_move_to(cr, pt[0], pt[1]);
+  for (j=1, pt+=2; j<it->path->num_points; j++, pt+=2)
+    cairo_line_to(cr, pt[0], pt[1]);
+}
+
+static void layer_item_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  LayerItem *layer = LAYER_ITEM(item);
+  LayerEntry *entry;
+  struct Item *it;
+  cairo_surface_t *surface;
+  cairo_t *cr;
+  cairo_matrix_t matrix;
+  guchar *data, *p;
+  guint32 *q;
+  guint batch_color = 0;
+  double batch_width = 0.;
+  gboolean in_batch, batchable;
+  int i, first, x, y, w, h, stride;
+
+  // cull against the exposed region
+  for (first=0; first<layer->num_entries; first++)
+    if (entry_in_rect(layer->entries+first, buf->rect.x0, buf->rect.y0,
+                      buf->rect.x1, buf->rect.y1)) break;
+  if (first == layer->num_entries) return;
+
+  gnome_canvas_buf_ensure_buf(buf);
+  buf->is_bg = 0;
+  w = buf->rect.x1 - buf->rect.x0;
+  h = buf->rect.y1 - buf->rect.y0;
+  surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+  data = cairo_image_surface_get_data(surface);
+  stride = cairo_image_surface_get_stride(surface);
+  for (y=0; y<h; y++) {
+    p = buf->buf + y*buf->buf_rowstride;
+    q = (guint32 *)(data + y*stride);
+    for (x=0; x<w; x++, p+=3)
+      q[x] = 0xff000000 | (p[0]<<16) | (p[1]<<8) | p[2];
+  }
+  cairo_surface_mark_dirty(surface);
+
+  cr = cairo_create(surface);
+  cairo_translate(cr, -buf->rect.x0, -buf->rect.y0);
+  cairo_matrix_init(&matrix, layer->affine[0], layer->affine[1], layer->affine[2],
+                    layer->affine[3], layer->affine[4], layer->affine[5]);
+  cairo_transform(cr, &matrix);
+  cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+  cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+
+  /* consecutive opaque strokes of the same color and width are stroked
+     as one path; translucent ones go one by one so overlaps still add up */
+  in_batch = FALSE;
+  for (i=first, entry=layer->entries+first; i<layer->num_entries; i++, entry++) {
+    if (!entry_in_rect(entry, buf->rect.x0, buf->rect.y0, buf->rect.x1, buf->rect.y1))
+      continue;
+    it = entry->item;
+    batchable = (!it->brush.variable_width && (it->brush.color_rgba & 0xff) == 0xff);
+    if (in_batch && (!batchable || it->brush.color_rgba != batch_color
+                     || it->brush.thickness != batch_width)) {
+      cairo_stroke(cr);
+      in_batch = FALSE;
+    }
+    if (!in_batch) set_source_color(cr, it->brush.color_rgba);
+    draw_stroke(cr, it);
+    if (batchable) {
+      in_batch = TRUE;
+      batch_color = it->brush.color_rgba;
+      batch_width = it->brush.thickness;
+    }
+    else if (!it->brush.variable_width) cairo_stroke(cr);
+  }
+  if (in_batch) cairo_stroke(cr);
+  cairo_destroy(cr);
+
+  cairo_surface_flush(surface);
+  for (y=0; y<h; y++) {
+    p = buf->buf + y*buf->buf_rowstride;
+    q = (guint32 *)(data + y*stride);
+    for (x=0; x<w; x++, p+=3) {
+      p[0] = (q[x]>>16) & 0xff;
+      p[1] = (q[x]>>8) & 0xff;
+      p[2] = q[x] & 0xff;
+    }
+  }
+  cairo_surface_destroy(surface);
+}
+
+static double layer_item_point(GnomeCanvasItem *item, double x, double y,
+                               int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  LayerItem *layer = LAYER_ITEM(item);
+  LayerEntry *entry;
+  double dx, dy, dist, best;
+  int i;
+
+  *actual_item = item;
+  best = G_MAXDOUBLE;
+  for (i=0, entry=layer->entries; i<layer->num_entries; i++, entry++) {
+    dx = MAX(0, MAX(entry->x1 - cx, cx - entry->x2));
+    dy = MAX(0, MAX(entry->y1 - cy, cy - entry->y2));
+    dist = hypot(dx, dy);
+    if (dist < best) best = dist;
+  }
+  return best;
+}
+
+static void layer_item_bounds(GnomeCanvasItem *item, double *x1, double *y1,
+                              double *x2, double *y2)
+{
+  LayerItem *layer = LAYER_ITEM(item);
+  LayerEntry *entry;
+  int i;
+
+  *x1 = *y1 = G_MAXDOUBLE;
+  *x2 = *y2 = -G_MAXDOUBLE;
+  for (i=0, entry=layer->entries; i<layer->num_entries; i++, entry++) {
+    *x1 = MIN(*x1, entry->item->bbox.left - entry->pad);
+    *y1 = MIN(*y1, entry->item->bbox.top - entry->pad);
+    *x2 = MAX(*x2, entry->item->bbox.right + entry->pad);
+    *y2 = MAX(*y2, entry->item->bbox.bottom + entry->pad);
+  }
+  if (layer->num_entries == 0) *x1 = *y1 = *x2 = *y2 = 0.;
+}
+
+// the items can outlive the canvas, e.g. when a page is deleted
+static void layer_item_destroy(GtkObject *object)
+{
+  LayerItem *layer = LAYER_ITEM(object);
+  int i;
+
+  for (i=0; i<layer->num_entries; i++)
+    g_hash_table_remove(batched_items, layer->entries[i].item);
+  g_free(layer->entries);
+  layer->entries = NULL;
+  layer->num_entries = 0;
+  if (GTK_OBJECT_CLASS(parent_class)->destroy)
+    (*GTK_OBJECT_CLASS(parent_class)->destroy)(object);
+}
+
+static void layer_item_class_init(LayerItemClass *klass)
+{
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  parent_class = g_type_class_peek_parent(klass);
+  GTK_OBJECT_CLASS(klass)->destroy = layer_item_destroy;
+  item_class->update = layer_item_update;
+  item_class->render = layer_item_render;
+  item_class->point = layer_item_point;
+  item_class->bounds = layer_item_bounds;
+}
+
+GType layer_item_get_type(void)
+{
+  static GType layer_item_type = 0;
+
+  if (!layer_item_type) {
+    static const GTypeInfo layer_item_info = {
+      sizeof(LayerItemClass),
+      NULL, NULL,
+      (GClassInitFunc) layer_item_class_init,
+      NULL, NULL,
+      sizeof(LayerItem),
+      0, NULL, NULL
+    };
+    layer_item_type = g_type_register_static(GNOME_TYPE_CANVAS_ITEM,
+                            "XournalLayerItem", &layer_item_info, 0);
+  }
+  return layer_item_type;
+}
+
+// call on a new layer group, before making the canvas items of its items
+void batch_layer_strokes(struct Layer *l)
+{
+  GnomeCanvasItem *item;
+  LayerItem *layer;
+  LayerEntry *entry;
+  struct Item *it;
+  GList *list;
+  int i, j, n;
+
+  for (n=0, list=l->items; list!=NULL; n++, list=list->next) {
+    it = (struct Item *)list->data;
+    if (it->type != ITEM_STROKE || it->canvas_item != NULL) break;
+  }
+  if (n == 0) return;
+
+  if (batched_items == NULL)
+    batched_items = g_hash_table_new(g_direct_hash, g_direct_equal);
+  item = gnome_canvas_item_new(l->group, layer_item_get_type(), NULL);
+  lower_canvas_item_to(l->group, item, NULL);
+  layer = LAYER_ITEM(item);
+  layer->entries = g_new(LayerEntry, n);
+  layer->num_entries = n;
+  for (i=0, list=l->items, entry=layer->entries; i<n; i++, list=list->next, entry++) {
+    it = (struct Item *)list->data;
+    entry->item = it;
+    entry->pad = it->brush.thickness/2;
+    if (it->brush.variable_width)
+      for (entry->pad = 0., j = 0; j < it->path->num_points-1; j++)
+        entry->pad = MAX(entry->pad, it->widths[j]/2);
+    entry->x1 = entry->y1 = entry->x2 = entry->y2 = 0;
+    g_hash_table_insert(batched_items, it, layer);
+  }
+  gnome_canvas_item_request_update(item);
+}
+
+/* give the item, and the batched strokes above it, their own canvas items;
+   the layer item then only needs to repaint their damage rectangles */
+void unbatch_item(struct Item *item)
+{
+  LayerItem *layer;
+  LayerEntry *entry;
+  GnomeCanvasGroup *group;
+  GnomeCanvasItem *prev;
+  gboolean on_top;
+  int i, k;
+
+  if (batched_items == NULL) return;
+  layer = (LayerItem *)g_hash_table_lookup(batched_items, item);
+  if (layer == NULL) return;
+  for (k=0; k<layer->num_entries; k++)
+    if (layer->entries[k].item == item) break;
+
+  group = GNOME_CANVAS_GROUP(layer->item.parent);
+  on_top = (group->item_list_end->data == layer);
+  prev = GNOME_CANVAS_ITEM(layer);
+  for (i=k, entry=layer->entries+k; i<layer->num_entries; i++, entry++) {
+    g_hash_table_remove(batched_items, entry->item);
+    make_canvas_item_one(group, entry->item);
+    if (!on_top) lower_canvas_item_to(group, entry->item->canvas_item, prev);
+    prev = entry->item->canvas_item;
+    gnome_canvas_request_redraw(layer->item.canvas, entry->x1, entry->y1,
+                                entry->x2, entry->y2);
+  }
+  layer->num_entries = k;
+  gnome_canvas_item_request_update(GNOME_CANVAS_ITEM(layer)); // shrink the bbox
+}
+
+// before undoing or redoing an operation on existing items
+void unbatch_undo_items(struct UndoItem *u)
+{
+  GList *list, *itemlist;
+  struct UndoErasureData *erasure;
+
+  if (batched_items == NULL || g_hash_table_size(batched_items) == 0) return;
+  if (u->type == ITEM_STROKE) unbatch_item(u->item);
+  if (u->type == ITEM_ERASURE || u->type == ITEM_RECOGNIZER)
+    for (list = u->erasurelist; list!=NULL; list = list->next) {
+      erasure = (struct UndoErasureData *)list->data;
+      unbatch_item(erasure->item);
+      for (itemlist = erasure->replacement_items; itemlist!=NULL; itemlist = itemlist->next)
+        unbatch_item((struct Item *)itemlist->data);
+    }
+  if (u->type == ITEM_MOVESEL || u->type == ITEM_PASTE || u->type == ITEM_REPAINTSEL
+      || u->type == ITEM_RESIZESEL)
+    for (list = u->itemlist; list!=NULL; list = list->next)
+      unbatch_item((struct Item *)list->data);
+}
@@ -0,0 +1,41 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// a canvas item drawing the strokes at the bottom of a layer with cairo
+
+typedef struct LayerEntry {
+  struct Item *item;
+  double pad; // half the largest stroke width
+  int x1, y1, x2, y2; // damage rectangle in canvas pixels
+} LayerEntry;
+
+typedef struct LayerItem {
+  GnomeCanvasItem item;
+  LayerEntry *entries; // the batched strokes, from bottom to top
+  int num_entries;
+  double affine[6];
+} LayerItem;
+
+typedef struct LayerItemClass {
+  GnomeCanvasItemClass parent_class;
+} LayerItemClass;
+
+#define LAYER_ITEM(o) (G_TYPE_CHECK_INSTANCE_CAST((o), layer_item_get_type(), LayerItem))
+
+GType layer_item_get_type(void);
+void batch_layer_strokes(struct Layer *l);
+gboolean item_is_batched(struct Item *item);
+void unbatch_item(struct Item *item);
+void unbatch_undo_items(struct UndoItem *u);
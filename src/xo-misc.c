@@ -34,6 +34,9 @@
 #include "xo-shapes.h"
 #include "xo-image.h"
 #include "xo-selection.h"
+#include "xo-ruling.h"
+#include "xo-stroke.h"
+#include "xo-layer.h"
 
 // some global constants
 
@@ -98,13 +101,14 @@ struct Page *new_page(struct Page *template)
   l->nitems = 0;
   pg->layers = g_list_append(NULL, l);
   pg->nlayers = 1;
+  pg->lazy_layers = NULL;
   if (template->bg->type != BG_SOLID && !ui.new_page_bg_from_pdf)
     pg->bg = (struct Background *)g_memdup(ui.default_page.bg, sizeof(struct Background));
   else 
     pg->bg = (struct Background *)g_memdup(template->bg, sizeof(struct Background));
   pg->bg->canvas_item = NULL;
   if (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF) {
-    g_object_ref(pg->bg->pixbuf);
+    if (pg->bg->pixbuf != NULL) g_object_ref(pg->bg->pixbuf);
     refstring_ref(pg->bg->filename);
   }
   pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
@@ -130,6 +134,7 @@ struct Page *new_page_with_bg(struct Background *bg, double width, double height
   l->nitems = 0;
   pg->layers = g_list_append(NULL, l);
   pg->nlayers = 1;
+  pg->lazy_layers = NULL;
   pg->bg = bg;
   pg->bg->canvas_item = NULL;
   pg->height = height;
@@ -147,44 +152,14 @@ struct Page *new_page_with_bg(struct Background *bg, double width, double height
 // change the current page if necessary for pointer at pt
 void set_current_page(gdouble *pt)
 {
-  gboolean page_change;
-  struct Page *tmppage;
-
-  page_change = FALSE;
-  tmppage = ui.cur_page;
-  if (ui.view_continuous == VIEW_MODE_CONTINUOUS) {
-    while (pt[1] < - VIEW_CONTINUOUS_SKIP) {
-      if (ui.pageno == 0) break;
-      page_change = TRUE;
-      ui.pageno--;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
-      pt[1] += tmppage->height + VIEW_CONTINUOUS_SKIP;
-    }
-    while (pt[1] > tmppage->height + VIEW_CONTINUOUS_SKIP) {
-      if (ui.pageno == journal.npages-1) break;
-      pt[1] -= tmppage->height + VIEW_CONTINUOUS_SKIP;
-      page_change = TRUE;
-      ui.pageno++;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
-    }
-  }
-  if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
-    while (pt[0] < - VIEW_CONTINUOUS_SKIP) {
-      if (ui.pageno == 0) break;
-      page_change = TRUE;
-      ui.pageno--;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
-      pt[0] += tmppage->width + VIEW_CONTINUOUS_SKIP;
-    }
-    while (pt[0] > tmppage->width + VIEW_CONTINUOUS_SKIP) {
-      if (ui.pageno == journal.npages-1) break;
-      pt[0] -= tmppage->width + VIEW_CONTINUOUS_SKIP;
-      page_change = TRUE;
-      ui.pageno++;
-      tmppage = g_list_nth_data(journal.pages, ui.pageno);
-    }
-  }
-  if (page_change) do_switch_page(ui.pageno, FALSE, FALSE);
+  int pageno;
+
+  pageno = ui.pageno;
+  if (ui.view_continuous == VIEW_MODE_CONTINUOUS)
+    pageno = find_page_at(ui.pageno, pt+1, VIEW_CONTINUOUS_SKIP);
+  if (ui.view_continuous == VIEW_MODE_HORIZONTAL)
+    pageno = find_page_at(ui.pageno, pt, VIEW_CONTINUOUS_SKIP);
+  if (pageno != ui.pageno) do_switch_page(pageno, FALSE, FALSE);
 }
 
 void realloc_cur_path(int n)
@@ -201,15 +176,68 @@ void realloc_cur_widths(int n)
   ui.cur_widths = g_realloc(ui.cur_widths, (n+100)*sizeof(double));
 }
 
+/* The save snapshot shares stroke coordinates and widths with the journal
+   rather than copying them: the GnomeCanvasPoints are refcounted already,
+   and widths arrays lent to a snapshot are counted in lent_widths. Code
+   that changes either in place must call unshare_stroke() first. */
+
+static GHashTable *lent_widths; // widths -> how many others hold it
+
+gdouble *lend_widths(gdouble *widths)
+{
+  int n;
+
+  if (widths == NULL) return NULL;
+  if (lent_widths == NULL)
+    lent_widths = g_hash_table_new(g_direct_hash, g_direct_equal);
+  n = GPOINTER_TO_INT(g_hash_table_lookup(lent_widths, widths));
+  g_hash_table_insert(lent_widths, widths, GINT_TO_POINTER(n+1));
+  return widths;
+}
+
+void free_widths(gdouble *widths)
+{
+  int n;
+
+  if (widths == NULL) return;
+  n = (lent_widths != NULL) ? GPOINTER_TO_INT(g_hash_table_lookup(lent_widths, widths)) : 0;
+  if (n == 0) g_free(widths);
+  else if (n == 1) g_hash_table_remove(lent_widths, widths);
+  else g_hash_table_insert(lent_widths, widths, GINT_TO_POINTER(n-1));
+}
+
+void unshare_stroke(struct Item *item)
+{
+  GnomeCanvasPoints *path;
+  gdouble *widths;
+
+  if (item->type != ITEM_STROKE) return;
+  if (item->path->ref_count > 1) {
+    path = gnome_canvas_points_new(item->path->num_points);
+    g_memmove(path->coords, item->path->coords, 2*item->path->num_points*sizeof(double));
+    gnome_canvas_points_free(item->path);
+    item->path = path;
+  }
+  if (item->brush.variable_width && lent_widths != NULL &&
+      g_hash_table_lookup(lent_widths, item->widths) != NULL) {
+    widths = g_memdup(item->widths, (item->path->num_points-1)*sizeof(double));
+    free_widths(item->widths);
+    item->widths = widths;
+  }
+}
+
 // undo utility functions
 
 void prepare_new_undo(void)
 {
   struct UndoItem *u;
+  // the previous operation is complete, note it in the edit log
+  if (undo != NULL && !undo->logged) editlog_note_undo(undo);
   // add a new UndoItem on the stack  
   u = (struct UndoItem *)g_malloc(sizeof(struct UndoItem));
   u->next = undo;
   u->multiop = 0;
+  u->logged = FALSE;
   undo = u;
   ui.saved = FALSE;
   ui.need_autosave = TRUE;
@@ -231,7 +259,7 @@ void clear_redo_stack(void)
   while (redo!=NULL) {
     if (redo->type == ITEM_STROKE) {
       gnome_canvas_points_free(redo->item->path);
-      if (redo->item->brush.variable_width) g_free(redo->item->widths);
+      if (redo->item->brush.variable_width) free_widths(redo->item->widths);
       g_free(redo->item);
       /* the strokes are unmapped, so there are no associated canvas items */
     }
@@ -241,8 +269,8 @@ void clear_redo_stack(void)
       g_free(redo->item);
     }
     else if (redo->type == ITEM_IMAGE) {
-      g_object_unref(redo->item->image);
-      g_free(redo->item->image_png);
+      if (redo->item->image != NULL) g_object_unref(redo->item->image);
+      unref_image_data(redo->item->image_png);
       g_free(redo->item);
     }
     else if (redo->type == ITEM_ERASURE || redo->type == ITEM_RECOGNIZER) {
@@ -251,7 +279,7 @@ void clear_redo_stack(void)
         for (repl = erasure->replacement_items; repl!=NULL; repl=repl->next) {
           it = (struct Item *)repl->data;
           gnome_canvas_points_free(it->path);
-          if (it->brush.variable_width) g_free(it->widths);
+          if (it->brush.variable_width) free_widths(it->widths);
           g_free(it);
         }
         g_list_free(erasure->replacement_items);
@@ -282,7 +310,7 @@ void clear_redo_stack(void)
         it = (struct Item *)list->data;
         if (it->type == ITEM_STROKE) {
           gnome_canvas_points_free(it->path);
-          if (it->brush.variable_width) g_free(it->widths);
+          if (it->brush.variable_width) free_widths(it->widths);
         }
         g_free(it);
       }
@@ -317,13 +345,13 @@ void clear_undo_stack(void)
         erasure = (struct UndoErasureData *)list->data;
         if (erasure->item->type == ITEM_STROKE) {
           gnome_canvas_points_free(erasure->item->path);
-          if (erasure->item->brush.variable_width) g_free(erasure->item->widths);
+          if (erasure->item->brush.variable_width) free_widths(erasure->item->widths);
         }
         if (erasure->item->type == ITEM_TEXT)
           { g_free(erasure->item->text); g_free(erasure->item->font_name); }
         if (erasure->item->type == ITEM_IMAGE) {
-          g_object_unref(erasure->item->image);
-          g_free(erasure->item->image_png);
+          if (erasure->item->image != NULL) g_object_unref(erasure->item->image);
+          unref_image_data(erasure->item->image_png);
         }
         g_free(erasure->item);
         g_list_free(erasure->replacement_items);
@@ -376,6 +404,8 @@ void delete_journal(struct Journal *j)
     delete_page((struct Page *)j->pages->data);
     j->pages = g_list_delete_link(j->pages, j->pages);
   }
+  if (j->image_ids != NULL) g_hash_table_destroy(j->image_ids);
+  j->image_ids = NULL;
 }
 
 void delete_page(struct Page *pg)
@@ -388,14 +418,17 @@ void delete_page(struct Page *pg)
     delete_layer(l);
     pg->layers = g_list_delete_link(pg->layers, pg->layers);
   }
+  if (pg->lazy_layers != NULL) refstring_unref(pg->lazy_layers);
   if (pg->group!=NULL) gtk_object_destroy(GTK_OBJECT(pg->group));
               // this also destroys the background's canvas items
   if (pg->bg->type == BG_PIXMAP || pg->bg->type == BG_PDF) {
     if (pg->bg->pixbuf != NULL) g_object_unref(pg->bg->pixbuf);
     if (pg->bg->filename != NULL) refstring_unref(pg->bg->filename);
   }
+  forget_pdf_page_user(pg);
   g_free(pg->bg);
   g_free(pg);
+  forget_layer_pages();
 }
 
 void delete_layer(struct Layer *l)
@@ -406,14 +439,14 @@ void delete_layer(struct Layer *l)
     item = (struct Item *)l->items->data;
     if (item->type == ITEM_STROKE && item->path != NULL) {
       gnome_canvas_points_free(item->path);
-      if (item->brush.variable_width) g_free(item->widths);
+      if (item->brush.variable_width) free_widths(item->widths);
     }
     if (item->type == ITEM_TEXT) {
       g_free(item->font_name); g_free(item->text);
     }
     if (item->type == ITEM_IMAGE) {
-      g_object_unref(item->image);
-      g_free(item->image_png);
+      if (item->image != NULL) g_object_unref(item->image);
+      unref_image_data(item->image_png);
     }
     // don't need to delete the canvas_item, as it's part of the group destroyed below
     g_free(item);
@@ -421,6 +454,251 @@ void delete_layer(struct Layer *l)
   }
   if (l->group!= NULL) gtk_object_destroy(GTK_OBJECT(l->group));
   g_free(l);
+  forget_layer_pages();
+}
+
+/* The pages are also kept in an array by number, along with their
+   cumulative offsets along the view in continuous and horizontal modes,
+   so that finding a page by number or by position is a lookup or a binary
+   search rather than a walk down journal.pages. Offsets are recomputed
+   lazily, starting from the first page that was inserted, removed or
+   resized. Each page also knows its own number, renumbered along with
+   the array, so journal_page_number() needn't search. */
+
+static struct Page **page_array = NULL;
+static double *page_starts = NULL; // offset of each page along the view, then the total length + skip
+static double *page_breadth = NULL; // largest size across the view of the pages up to this one
+static int page_array_alloc = 0, page_array_len = 0;
+static gboolean page_array_stale = TRUE;
+static int page_starts_valid = 0; // number of pages whose offsets are up to date
+static int page_starts_mode = -1; // the view mode they were computed for
+static struct Page *one_page_shown = NULL; // the page group shown in one-page mode
+
+static void renumber_pages(int from)
+{
+  int i;
+
+  for (i = from; i < page_array_len; i++) page_array[i]->pageno = i;
+}
+
+static void grow_page_array(int n)
+{
+  if (n <= page_array_alloc) return;
+  page_array_alloc = n + n/2 + 16;
+  page_array = g_realloc(page_array, page_array_alloc*sizeof(struct Page *));
+  page_starts = g_realloc(page_starts, (page_array_alloc+1)*sizeof(double));
+  page_breadth = g_realloc(page_breadth, page_array_alloc*sizeof(double));
+}
+
+static void check_page_array(void)
+{
+  GList *pglist;
+  int i;
+
+  if (!page_array_stale && page_array_len == journal.npages) return;
+  grow_page_array(journal.npages);
+  for (i=0, pglist = journal.pages; pglist!=NULL && i<journal.npages; i++, pglist = pglist->next)
+    page_array[i] = (struct Page *)pglist->data;
+  page_array_len = i;
+  renumber_pages(0);
+  page_array_stale = FALSE;
+  page_starts_valid = 0;
+}
+
+/* The pages showing each page of the background PDF, so that a new or
+   evicted rendering reaches them without a walk through the journal.
+   update_canvas_bg() notes a page whenever its background is set, and
+   delete_page() forgets it; a journal that was loaded as a whole is
+   indexed on first use. Pages deleted but kept for undo stay listed, so
+   callers skip those that journal_page_number() doesn't know. */
+
+static GPtrArray *pdf_page_users = NULL; // PDF page number-1 -> GSList of pages
+static GHashTable *pdf_page_of = NULL; // page -> the PDF page it's listed under
+static gboolean pdf_page_users_stale = TRUE;
+
+void forget_pdf_page_user(struct Page *pg)
+{
+  int n;
+
+  if (pdf_page_of == NULL) return;
+  n = GPOINTER_TO_INT(g_hash_table_lookup(pdf_page_of, pg));
+  if (n == 0) return;
+  g_hash_table_remove(pdf_page_of, pg);
+  g_ptr_array_index(pdf_page_users, n-1) =
+    g_slist_remove((GSList *)g_ptr_array_index(pdf_page_users, n-1), pg);
+}
+
+void note_pdf_page_user(struct Page *pg)
+{
+  int n;
+
+  if (pdf_page_users_stale) return; // will be indexed anyway
+  n = (pg->bg->type == BG_PDF) ? pg->bg->file_page_seq : 0;
+  if (GPOINTER_TO_INT(g_hash_table_lookup(pdf_page_of, pg)) == n) return;
+  forget_pdf_page_user(pg);
+  if (n < 1) return;
+  if (n > (int)pdf_page_users->len) g_ptr_array_set_size(pdf_page_users, n);
+  g_hash_table_insert(pdf_page_of, pg, GINT_TO_POINTER(n));
+  g_ptr_array_index(pdf_page_users, n-1) =
+    g_slist_prepend((GSList *)g_ptr_array_index(pdf_page_users, n-1), pg);
+}
+
+GSList *pages_with_pdf_page(int pageno)
+{
+  GList *list;
+  guint i;
+
+  if (pdf_page_users_stale) {
+    if (pdf_page_users == NULL) {
+      pdf_page_users = g_ptr_array_new();
+      pdf_page_of = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+    for (i = 0; i < pdf_page_users->len; i++)
+      g_slist_free((GSList *)g_ptr_array_index(pdf_page_users, i));
+    g_ptr_array_set_size(pdf_page_users, 0);
+    g_hash_table_remove_all(pdf_page_of);
+    pdf_page_users_stale = FALSE;
+    for (list = journal.pages; list!=NULL; list = list->next)
+      note_pdf_page_user((struct Page *)list->data);
+  }
+  if (pageno < 1 || pageno > (int)pdf_page_users->len) return NULL;
+  return (GSList *)g_ptr_array_index(pdf_page_users, pageno-1);
+}
+
+// call this when journal.pages was replaced as a whole
+void reset_page_index(void)
+{
+  page_array_stale = TRUE;
+  one_page_shown = NULL;
+  pdf_page_users_stale = TRUE;
+}
+
+// call this when the pages from pageno on have been resized or moved
+void journal_pages_changed(int pageno)
+{
+  if (pageno < 0) pageno = 0;
+  if (pageno < page_starts_valid) page_starts_valid = pageno;
+}
+
+struct Page *journal_page(int pageno)
+{
+  check_page_array();
+  if (pageno < 0 || pageno >= page_array_len) return NULL;
+  return page_array[pageno];
+}
+
+// the page's number, or -1 if it's not in the journal (e.g. deleted)
+int journal_page_number(struct Page *pg)
+{
+  check_page_array();
+  if (pg == NULL || pg->pageno < 0 || pg->pageno >= page_array_len ||
+      page_array[pg->pageno] != pg) return -1;
+  return pg->pageno;
+}
+
+void journal_insert_page(struct Page *pg, int pageno)
+{
+  check_page_array();
+  if (pageno < 0 || pageno > page_array_len) pageno = page_array_len;
+  journal.pages = g_list_insert(journal.pages, pg, pageno);
+  journal.npages++;
+  grow_page_array(journal.npages);
+  g_memmove(page_array+pageno+1, page_array+pageno,
+            (page_array_len-pageno)*sizeof(struct Page *));
+  page_array[pageno] = pg;
+  page_array_len++;
+  renumber_pages(pageno);
+  note_pdf_page_user(pg); // e.g. back from the undo stack
+  journal_pages_changed(pageno);
+}
+
+void journal_remove_page(struct Page *pg)
+{
+  int pageno;
+
+  pageno = journal_page_number(pg);
+  if (pageno < 0) return;
+  journal.pages = g_list_remove(journal.pages, pg);
+  journal.npages--;
+  g_memmove(page_array+pageno, page_array+pageno+1,
+            (page_array_len-pageno-1)*sizeof(struct Page *));
+  page_array_len--;
+  renumber_pages(pageno);
+  pg->pageno = -1;
+  if (pg == one_page_shown) one_page_shown = NULL;
+  journal_pages_changed(pageno);
+}
+
+// bring the page offsets up to date, and move the page groups with them
+static void update_page_offsets(void)
+{
+  struct Page *pg;
+  int i;
+
+  check_page_array();
+  if (page_starts_mode != ui.view_continuous) {
+    page_starts_mode = ui.view_continuous;
+    page_starts_valid = 0;
+  }
+  page_starts[0] = 0.;
+  for (i = page_starts_valid; i < page_array_len; i++) {
+    pg = page_array[i];
+    if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
+      pg->hoffset = page_starts[i]; pg->voffset = 0.;
+      page_starts[i+1] = page_starts[i] + pg->width + VIEW_CONTINUOUS_SKIP;
+      page_breadth[i] = pg->height;
+    } else {
+      pg->hoffset = 0.; 
+      pg->voffset = (ui.view_continuous == VIEW_MODE_CONTINUOUS) ? page_starts[i] : 0.;
+      page_starts[i+1] = page_starts[i] + pg->height + VIEW_CONTINUOUS_SKIP;
+      page_breadth[i] = pg->width;
+    }
+    if (i > 0 && page_breadth[i-1] > page_breadth[i]) page_breadth[i] = page_breadth[i-1];
+    if (pg->group == NULL) continue;
+    gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
+        "x", pg->hoffset, "y", pg->voffset, NULL);
+    if (ui.view_continuous != VIEW_MODE_ONE_PAGE)
+      gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
+    else if (pg != ui.cur_page)
+      gnome_canvas_item_hide(GNOME_CANVAS_ITEM(pg->group));
+  }
+  page_starts_valid = page_array_len;
+}
+
+// the last page starting at or before pos along the view
+int page_at_offset(double pos)
+{
+  int lo, hi, mid;
+
+  update_page_offsets();
+  if (page_array_len == 0) return 0;
+  lo = 0; hi = page_array_len-1;
+  while (lo < hi) {
+    mid = (lo + hi + 1)/2;
+    if (page_starts[mid] <= pos) lo = mid;
+    else hi = mid-1;
+  }
+  return lo;
+}
+
+/* the page at *pos along the view, *pos being relative to page pageno;
+   we only go back a page when more than upmargin above it, and forward
+   when past the skip below it. Updates *pos relative to the new page. */
+int find_page_at(int pageno, double *pos, double upmargin)
+{
+  double abs_pos;
+  int newpage;
+
+  update_page_offsets();
+  if (pageno < 0 || pageno >= page_array_len) return pageno;
+  abs_pos = *pos + page_starts[pageno];
+  if (abs_pos < page_starts[pageno] - upmargin)
+    newpage = page_at_offset(abs_pos + upmargin);
+  else if (abs_pos > page_starts[pageno+1])
+    newpage = page_at_offset(abs_pos);
+  else newpage = pageno;
+  *pos = abs_pos - page_starts[newpage];
+  return newpage;
 }
 
 // referenced strings
@@ -615,6 +893,7 @@ void make_page_clipbox(struct Page *pg)
 {
   GnomeCanvasPathDef *pg_clip;
   
+  if (pg->group == NULL) return;
   pg_clip = gnome_canvas_path_def_new_sized(4);
   gnome_canvas_path_def_moveto(pg_clip, 0., 0.);
   gnome_canvas_path_def_lineto(pg_clip, 0., pg->height);
@@ -628,9 +907,7 @@ void make_page_clipbox(struct Page *pg)
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item)
 {
   PangoFontDescription *font_desc;
-  GnomeCanvasPoints points;
   GtkWidget *dialog;
-  int j;
 
   if (item->type == ITEM_STROKE) {
     if (!item->brush.variable_width)
@@ -639,20 +916,9 @@ void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item)
             "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
             "fill-color-rgba", item->brush.color_rgba,  
             "width-units", item->brush.thickness, NULL);
-    else {
-      item->canvas_item = gnome_canvas_item_new(group,
-            gnome_canvas_group_get_type(), NULL);
-      points.num_points = 2;
-      points.ref_count = 1;
-      for (j = 0; j < item->path->num_points-1; j++) {
-        points.coords = item->path->coords+2*j;
-        gnome_canvas_item_new((GnomeCanvasGroup *) item->canvas_item,
-              gnome_canvas_line_get_type(), "points", &points, 
-              "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND, 
-              "fill-color-rgba", item->brush.color_rgba,
-              "width-units", item->widths[j], NULL);
-      }
-    }
+    else
+      item->canvas_item = stroke_item_new(group, item->brush.color_rgba,
+            item->path->coords, item->widths, item->path->num_points);
   }
   if (item->type == ITEM_TEXT) {
 #ifdef WIN32  // fontconfig cache generation takes forever, show hourglass
@@ -693,94 +959,191 @@ void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item)
   }
 }
 
-void make_canvas_items(void)
+/* Only the pages near the view have canvas items: the others have
+   pg->group == NULL, and the canvas items of their layers and items are
+   NULL too. They get created when the page comes within
+   ui.canvas_page_margin pages of the view, or when something needs them. */
+
+// create the missing canvas items of a page
+void make_page_canvas_items(struct Page *pg)
 {
-  struct Page *pg;
   struct Layer *l;
   struct Item *item;
-  GList *pagelist, *layerlist, *itemlist;
+  GList *layerlist, *itemlist;
+
+  if (pg->group == NULL) {
+    pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
+       gnome_canvas_root(canvas), gnome_canvas_clipgroup_get_type(), NULL);
+    make_page_clipbox(pg);
+  }
+  if (pg->bg->canvas_item == NULL) update_canvas_bg(pg);
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    if (l->group == NULL) {
+      l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
+         pg->group, gnome_canvas_group_get_type(), NULL);
+      if (ui.batch_layer_render) batch_layer_strokes(l);
+    }
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
+      item = (struct Item *)itemlist->data;
+      if (item->canvas_item == NULL && !item_is_batched(item))
+        make_canvas_item_one(l->group, item);
+    }
+  }
+}
+
+void make_canvas_items(void)
+{
+  struct Page *pg;
+  GList *pagelist;
+  int i;
   
+  for (i=0, pagelist = journal.pages; pagelist!=NULL; i++, pagelist = pagelist->next) {
+    pg = (struct Page *)pagelist->data;
+    if (pg->group == NULL && ABS(i - ui.pageno) > ui.canvas_page_margin) continue;
+    make_page_canvas_items(pg);
+  }
+}
+
+// give a page its canvas items, in place
+void materialize_page(struct Page *pg)
+{
+  if (pg == NULL || pg->group != NULL) return;
+  make_page_canvas_items(pg);
+  gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
+      "x", pg->hoffset, "y", pg->voffset, NULL);
+  if (ui.view_continuous == VIEW_MODE_ONE_PAGE && pg != ui.cur_page)
+    gnome_canvas_item_hide(GNOME_CANVAS_ITEM(pg->group));
+}
+
+void dematerialize_page(struct Page *pg)
+{
+  GList *layerlist, *itemlist;
+  struct Layer *l;
+
+  if (pg->group == NULL) return;
+  gtk_object_destroy(GTK_OBJECT(pg->group));
+  pg->group = NULL;
+  pg->bg->canvas_item = NULL;
+  for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
+    l = (struct Layer *)layerlist->data;
+    l->group = NULL;
+    for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next)
+      ((struct Item *)itemlist->data)->canvas_item = NULL;
+  }
+}
+
+/* the page a layer is on, or NULL if it's not in the journal. Layers never
+   move between pages, so the answers are cached, and the cache is only
+   rebuilt when it turns out wrong (layers added since, or deleted pages).
+   It is emptied whenever a page or layer is freed, so it never holds
+   dangling pointers. */
+
+static GHashTable *layer_pages = NULL; // layer -> page
+
+void forget_layer_pages(void)
+{
+  if (layer_pages != NULL) g_hash_table_remove_all(layer_pages);
+}
+
+struct Page *find_layer_page(struct Layer *l)
+{
+  GList *pagelist, *layerlist;
+  struct Page *pg;
+
+  if (l == NULL) return NULL;
+  if (layer_pages == NULL) layer_pages = g_hash_table_new(g_direct_hash, g_direct_equal);
+  pg = (struct Page *)g_hash_table_lookup(layer_pages, l);
+  if (pg != NULL && journal_page_number(pg) >= 0 && g_list_find(pg->layers, l) != NULL)
+    return pg;
+
+  g_hash_table_remove_all(layer_pages);
   for (pagelist = journal.pages; pagelist!=NULL; pagelist = pagelist->next) {
     pg = (struct Page *)pagelist->data;
-    if (pg->group == NULL) {
-      pg->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
-         gnome_canvas_root(canvas), gnome_canvas_clipgroup_get_type(), NULL);
-      make_page_clipbox(pg);
-    }
-    if (pg->bg->canvas_item == NULL) update_canvas_bg(pg);
-    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next) {
-      l = (struct Layer *)layerlist->data;
-      if (l->group == NULL)
-        l->group = (GnomeCanvasGroup *) gnome_canvas_item_new(
-           pg->group, gnome_canvas_group_get_type(), NULL);
-      for (itemlist = l->items; itemlist!=NULL; itemlist = itemlist->next) {
-        item = (struct Item *)itemlist->data;
-        if (item->canvas_item == NULL)
-          make_canvas_item_one(l->group, item);
-      }
-    }
+    for (layerlist = pg->layers; layerlist!=NULL; layerlist = layerlist->next)
+      g_hash_table_insert(layer_pages, layerlist->data, pg);
+  }
+  return (struct Page *)g_hash_table_lookup(layer_pages, l);
+}
+
+// pages that must keep their canvas items wherever the view is
+gboolean page_is_busy(struct Page *pg)
+{
+  if (pg == ui.cur_page) return TRUE;
+  if (ui.selection != NULL && 
+      (g_list_find(pg->layers, ui.selection->layer) != NULL ||
+       g_list_find(pg->layers, ui.selection->move_layer) != NULL))
+    return TRUE;
+  return FALSE;
+}
+
+static void update_canvas_page(int pageno, int first, int last)
+{
+  struct Page *pg;
+  int dist;
+
+  pg = journal_page(pageno);
+  if (pageno < first) dist = first - pageno;
+  else if (pageno > last) dist = pageno - last;
+  else dist = 0;
+  if (dist <= ui.canvas_page_margin) materialize_page(pg);
+  else if (dist > ui.canvas_page_margin + CANVAS_PAGE_HYSTERESIS && !page_is_busy(pg))
+    dematerialize_page(pg);
+}
+
+/* create the canvas items of the pages near the view, drop those far away.
+   Only the pages around the view, now and at the previous call, are looked
+   at: a page gets dropped by the first call that finds it too far, since
+   it was still close to the view at the call before. */
+void update_canvas_pages(void)
+{
+  static int prev_first = 0, prev_last = -1;
+  int i, first, last, range;
+
+  get_visible_pages(&first, &last);
+  range = ui.canvas_page_margin + CANVAS_PAGE_HYSTERESIS + 2;
+  for (i = MAX(prev_first - range, 0); i <= MIN(prev_last + range, journal.npages-1); i++)
+    if (i < first - range || i > last + range) update_canvas_page(i, first, last);
+  for (i = MAX(first - range, 0); i <= MIN(last + range, journal.npages-1); i++)
+    update_canvas_page(i, first, last);
+  prev_first = first;
+  prev_last = last;
+}
+
+// before undoing or redoing, give the pages involved their canvas items
+void materialize_undo_pages(struct UndoItem *u)
+{
+  if (u->type == ITEM_NEW_BG_ONE || u->type == ITEM_NEW_BG_RESIZE ||
+      u->type == ITEM_PAPER_RESIZE || u->type == ITEM_NEW_LAYER || 
+      u->type == ITEM_DELETE_LAYER || u->type == ITEM_DELETE_PAGE) {
+    if (journal_page_number(u->page) >= 0) materialize_page(u->page);
   }
+  if (u->type == ITEM_STROKE || u->type == ITEM_ERASURE || u->type == ITEM_PASTE ||
+      u->type == ITEM_MOVESEL || u->type == ITEM_TEXT || u->type == ITEM_TEXT_EDIT ||
+      u->type == ITEM_RECOGNIZER || u->type == ITEM_IMAGE)
+    materialize_page(find_layer_page(u->layer));
+  if (u->type == ITEM_MOVESEL)
+    materialize_page(find_layer_page(u->layer2));
 }
 
 void update_canvas_bg(struct Page *pg)
 {
   GnomeCanvasGroup *group;
-  GnomeCanvasPoints *seg;
   GdkPixbuf *scaled_pix;
-  double *pt;
-  double x, y;
-  int w, h;
   gboolean is_well_scaled;
   
+  note_pdf_page_user(pg); // the bg may be new
   if (pg->bg->canvas_item != NULL)
     gtk_object_destroy(GTK_OBJECT(pg->bg->canvas_item));
   pg->bg->canvas_item = NULL;
   
+  if (pg->group == NULL) return; // no canvas items while far from view
+
   if (pg->bg->type == BG_SOLID)
   {
-    pg->bg->canvas_item = gnome_canvas_item_new(pg->group,
-                               gnome_canvas_group_get_type(), NULL);
-    group = GNOME_CANVAS_GROUP(pg->bg->canvas_item);
+    pg->bg->canvas_item = ruling_item_new(pg->group, pg->bg->color_rgba,
+                               pg->bg->ruling, pg->width, pg->height);
     lower_canvas_item_to(pg->group, pg->bg->canvas_item, NULL);
-    gnome_canvas_item_new(group, gnome_canvas_rect_get_type(),
-      "x1", 0., "x2", pg->width, "y1", 0., "y2", pg->height,
-      "fill-color-rgba", pg->bg->color_rgba, NULL);
-    if (pg->bg->ruling == RULING_NONE) return;
-    seg = gnome_canvas_points_new(2);
-    pt = seg->coords;
-    if (pg->bg->ruling == RULING_GRAPH) {
-      pt[1] = 0; pt[3] = pg->height;
-      for (x=RULING_GRAPHSPACING; x<pg->width-1; x+=RULING_GRAPHSPACING) {
-        pt[0] = pt[2] = x;
-        gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-           "points", seg, "fill-color-rgba", RULING_COLOR,
-           "width-units", RULING_THICKNESS, NULL);
-      }      
-      pt[0] = 0; pt[2] = pg->width;
-      for (y=RULING_GRAPHSPACING; y<pg->height-1; y+=RULING_GRAPHSPACING) {
-        pt[1] = pt[3] = y;
-        gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-           "points", seg, "fill-color-rgba", RULING_COLOR,
-           "width-units", RULING_THICKNESS, NULL);
-      }      
-      gnome_canvas_points_free(seg);
-      return;
-    }
-    pt[0] = 0; pt[2] = pg->width;
-    for (y=RULING_TOPMARGIN; y<pg->height-1; y+=RULING_SPACING) {
-      pt[1] = pt[3] = y;
-      gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-         "points", seg, "fill-color-rgba", RULING_COLOR,
-         "width-units", RULING_THICKNESS, NULL);
-    }      
-    if (pg->bg->ruling == RULING_LINED) {
-      pt[0] = pt[2] = RULING_LEFTMARGIN;
-      pt[1] = 0; pt[3] = pg->height;
-      gnome_canvas_item_new(group, gnome_canvas_line_get_type(),
-         "points", seg, "fill-color-rgba", RULING_MARGIN_COLOR,
-         "width-units", RULING_THICKNESS, NULL);
-    }
-    gnome_canvas_points_free(seg);
     return;
   }
   
@@ -798,23 +1161,85 @@ void update_canvas_bg(struct Page *pg)
 
   if (pg->bg->type == BG_PDF)
   {
-    if (pg->bg->pixbuf == NULL) return;
+    // a group: the whole-page pixbuf, if any, then the tiles over it
+    pg->bg->canvas_item = gnome_canvas_item_new(pg->group,
+                               gnome_canvas_group_get_type(), NULL);
+    group = GNOME_CANVAS_GROUP(pg->bg->canvas_item);
+    lower_canvas_item_to(pg->group, pg->bg->canvas_item, NULL);
+    if (pg->bg->pixbuf == NULL) { show_bgpdf_tiles(pg); return; }
     is_well_scaled = (fabs(pg->bg->pixel_width - pg->width*ui.zoom) < 2.
                    && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
-    if (is_well_scaled)
-      pg->bg->canvas_item = gnome_canvas_item_new(pg->group, 
+    // a rendering at a higher zoom level gets scaled down if in view
+    if (!is_well_scaled && pg->bg->pixel_width > pg->width*ui.zoom && is_visible(pg)) {
+      scaled_pix = gdk_pixbuf_scale_simple(pg->bg->pixbuf, 
+          (int)(pg->width*ui.zoom + 0.5), (int)(pg->height*ui.zoom + 0.5), 
+          GDK_INTERP_BILINEAR);
+      gnome_canvas_item_new(group, 
+          gnome_canvas_pixbuf_get_type(), 
+          "pixbuf", scaled_pix,
+          "width-in-pixels", TRUE, "height-in-pixels", TRUE, 
+          NULL);
+      g_object_unref(scaled_pix);
+    }
+    else if (is_well_scaled)
+      gnome_canvas_item_new(group, 
           gnome_canvas_pixbuf_get_type(), 
           "pixbuf", pg->bg->pixbuf,
           "width-in-pixels", TRUE, "height-in-pixels", TRUE, 
           NULL);
     else
-      pg->bg->canvas_item = gnome_canvas_item_new(pg->group, 
+      gnome_canvas_item_new(group, 
           gnome_canvas_pixbuf_get_type(), 
           "pixbuf", pg->bg->pixbuf,
           "width", pg->width, "height", pg->height, 
           "width-set", TRUE, "height-set", TRUE, 
           NULL);
-    lower_canvas_item_to(pg->group, pg->bg->canvas_item, NULL);
+    show_bgpdf_tiles(pg);
+  }
+}
+
+// the canvas item showing the whole-page pixbuf of a PDF bg
+
+GnomeCanvasItem *pdf_bg_pixbuf_item(struct Page *pg)
+{
+  GList *list;
+
+  if (pg->bg->canvas_item == NULL || pg->bg->pixbuf == NULL) return NULL;
+  list = GNOME_CANVAS_GROUP(pg->bg->canvas_item)->item_list;
+  return (list != NULL) ? GNOME_CANVAS_ITEM(list->data) : NULL;
+}
+
+// show a tile of a PDF bg, rendered at the current zoom
+
+void add_canvas_bg_tile(struct Page *pg, struct BgPdfTile *tile)
+{
+  gnome_canvas_item_new(GNOME_CANVAS_GROUP(pg->bg->canvas_item),
+      gnome_canvas_pixbuf_get_type(), 
+      "pixbuf", tile->pixbuf,
+      "x", tile->x * BGPDF_TILE_SIZE / tile->zoom,
+      "y", tile->y * BGPDF_TILE_SIZE / tile->zoom,
+      "width-in-pixels", TRUE, "height-in-pixels", TRUE, 
+      NULL);
+}
+
+// remove the tiles shown over a PDF bg (only those showing pixbuf if not NULL)
+
+void remove_canvas_bg_tiles(struct Page *pg, GdkPixbuf *pixbuf)
+{
+  GList *list, *next;
+  GdkPixbuf *pix;
+
+  if (pg->bg->canvas_item == NULL) return;
+  list = GNOME_CANVAS_GROUP(pg->bg->canvas_item)->item_list;
+  if (pdf_bg_pixbuf_item(pg) != NULL) list = list->next;
+  for (; list != NULL; list = next) {
+    next = list->next;
+    if (pixbuf != NULL) {
+      g_object_get(G_OBJECT(list->data), "pixbuf", &pix, NULL);
+      if (pix != NULL) g_object_unref(pix);
+      if (pix != pixbuf) continue;
+    }
+    gtk_object_destroy(GTK_OBJECT(list->data));
   }
 }
 
@@ -841,45 +1266,190 @@ gboolean is_visible(struct Page *pg)
   return FALSE;
 }
 
-void rescale_bg_pixmaps(void)
+// the range of pages in view, or just the current page if none is
+
+void get_visible_pages(int *first, int *last)
+{
+  GtkAdjustment *adj;
+  double top, bottom;
+  int i, j;
+
+  *first = *last = ui.pageno;
+  if (ui.view_continuous == VIEW_MODE_ONE_PAGE) return;
+  if (ui.view_continuous == VIEW_MODE_HORIZONTAL)
+    adj = gtk_layout_get_hadjustment(GTK_LAYOUT(canvas));
+  else
+    adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  top = adj->value/ui.zoom;
+  bottom = (adj->value + adj->page_size) / ui.zoom;
+  i = page_at_offset(top);
+  if (i < page_array_len-1 && top >= page_starts[i+1] - VIEW_CONTINUOUS_SKIP) i++;
+  j = page_at_offset(bottom);
+  if (j > 0 && page_starts[j] >= bottom) j--;
+  if (i > j || !is_visible(page_array[i])) return;
+  *first = i;
+  *last = j;
+}
+
+// the part of a page that is in view, in page coordinates
+
+gboolean get_visible_rect(struct Page *pg, struct BBox *rect)
+{
+  GtkAdjustment *adj;
+
+  adj = gtk_layout_get_hadjustment(GTK_LAYOUT(canvas));
+  rect->left = MAX(0, adj->value/ui.zoom - pg->hoffset);
+  rect->right = MIN(pg->width, (adj->value + adj->page_size)/ui.zoom - pg->hoffset);
+  adj = gtk_layout_get_vadjustment(GTK_LAYOUT(canvas));
+  rect->top = MAX(0, adj->value/ui.zoom - pg->voffset);
+  rect->bottom = MIN(pg->height, (adj->value + adj->page_size)/ui.zoom - pg->voffset);
+  return (rect->left < rect->right && rect->top < rect->bottom);
+}
+
+// parse the pages that have scrolled into view if loaded lazily, and
+// decode their images
+
+void load_visible_pages(void)
+{
+  struct Page *pg;
+  gboolean decoded;
+  int i, first, last;
+  
+  decoded = FALSE;
+  get_visible_pages(&first, &last);
+  for (i = first; i <= last; i++) {
+    pg = journal_page(i);
+    if (!is_visible(pg)) continue;
+    if (pg->lazy_layers != NULL) load_page(pg);
+    if (decode_page_images(pg)) decoded = TRUE;
+  }
+  if (decoded) trim_image_memory();
+  update_canvas_pages();
+}
+
+/* PDF pages get rendered at a few zoom levels a factor sqrt(2) apart, up to
+   MAX_SAFE_RENDER_DPI, or MAX_UNTILED_RENDER_DPI for the pages that can't
+   be completed with tiles at higher zooms. The pages in view are shown scaled down from the
+   level above the zoom, and a rendering is kept as long as it's between
+   the zoom and twice the zoom level, so zooming in and out needs no new
+   rendering. */
+
+double bgpdf_zoom_level(double zoom, double max_dpi)
+{
+  double level;
+
+  level = pow(2., ceil(2*log(zoom)/log(2.) - 1e-6)/2);
+  return MIN(level, max_dpi/72.0);
+}
+
+static void rescale_bg_page(int pageno, int first, int last, gboolean all_pages)
 {
-  GList *pglist;
   struct Page *pg;
   GdkPixbuf *pix;
-  gboolean is_well_scaled;
+  GnomeCanvasItem *item;
+  gboolean in_pixels, is_copy, fits, good_enough, tiled;
   gdouble zoom_to_request;
+  int dist, priority;
+  struct BBox rect;
+
+  pg = journal_page(pageno);
+  if (pageno < first) dist = first - pageno;
+  else if (pageno > last) dist = pageno - last;
+  else dist = 0;
+  if (dist == 0 || (pageno < first) == (ui.scroll_direction < 0)) priority = dist;
+  else priority = dist + ui.progressive_bg_prefetch; // behind the view
+  if (pg->bg->type == BG_PDF) set_bgpdf_priority(pg->bg->file_page_seq, priority);
+
+  // show PDF bg's scaled to the zoom in view, stretched elsewhere
+  item = (pg->bg->type == BG_PDF) ? pdf_bg_pixbuf_item(pg) : NULL;
+  if (item != NULL) {
+    g_object_get(item, "pixbuf", &pix, "width-in-pixels", &in_pixels, NULL);
+    is_copy = (pix != pg->bg->pixbuf);
+    fits = (pix != NULL && fabs(gdk_pixbuf_get_width(pix) - pg->width*ui.zoom) < 2.
+                        && fabs(gdk_pixbuf_get_height(pix) - pg->height*ui.zoom) < 2.);
+    if (pix != NULL) g_object_unref(pix);
+    if (is_copy ? (!fits || priority > ui.progressive_bg_prefetch) :
+          (!fits && priority == 0 && pg->bg->pixel_width > pg->width*ui.zoom))
+      update_canvas_bg(pg);
+    else if (in_pixels && !fits)
+      gnome_canvas_item_set(item,
+        "width", pg->width, "height", pg->height, 
+        "width-in-pixels", FALSE, "height-in-pixels", FALSE, 
+        "width-set", TRUE, "height-set", TRUE, 
+        NULL);
+  }
+  // past the prefetch, only request pages when asked for all of them, or
+  // the pages evicted from the cache would get rendered again and again
+  if (!all_pages && priority > ui.progressive_bg_prefetch) return;
+
+  if (pg->bg->type == BG_PIXMAP && pg->bg->canvas_item!=NULL) {
+    g_object_get(G_OBJECT(pg->bg->canvas_item), "pixbuf", &pix, NULL);
+    if (pix!=pg->bg->pixbuf)
+      gnome_canvas_item_set(pg->bg->canvas_item, "pixbuf", pg->bg->pixbuf, NULL);
+    pg->bg->pixbuf_scale = 0;
+  }
+  if (pg->bg->type == BG_PDF) { 
+    // beyond MAX_SAFE_RENDER_DPI, what's in view also gets rendered in tiles
+    tiled = bgpdf_can_tile(pg);
+    if (tiled && priority == 0 && 72*ui.zoom > MAX_SAFE_RENDER_DPI && get_visible_rect(pg, &rect))
+      request_bgpdf_tiles(pg, &rect);
+    // request an asynchronous update to a better pixmap if needed
+    zoom_to_request = bgpdf_zoom_level(ui.zoom,
+                        tiled ? MAX_SAFE_RENDER_DPI : MAX_UNTILED_RENDER_DPI);
+    good_enough = (pg->bg->pixbuf_scale >= zoom_to_request && 
+                   pg->bg->pixbuf_scale <= 2*zoom_to_request);
+    if (priority <= ui.progressive_bg_prefetch)
+      use_bgpdf_page(pg->bg->file_page_seq, good_enough); // not to be evicted
+    if (good_enough) return;
+    if (add_bgpdf_request(pg->bg->file_page_seq, zoom_to_request, priority))
+      pg->bg->pixbuf_scale = zoom_to_request;
+  }
+}
+
+/* PDF pages get rendered by distance from the view, the pages ahead in the
+   scroll direction first. In progressive mode we only scale the pages in
+   view and the next few ahead, and drop the requests for pages that have
+   gone a little further than that. Only the pages within that distance of
+   the view, now and at the previous call, are looked at; except that in
+   non-progressive mode, a new zoom or a new PDF gets all the pages
+   requested. */
+
+void rescale_bg_pixmaps(void)
+{
+  GList *pglist;
+  struct Page *pg;
+  int i, first, last, range, max_priority;
+  static gdouble tiles_zoom = 0, all_zoom = 0;
+  static int all_serial = -1, prev_first = 0, prev_last = -1;
   
-  for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
-    pg = (struct Page *)pglist->data;
-    // in progressive mode we scale only visible pages
-    if (ui.progressive_bg && !is_visible(pg)) continue;
-
-    if (pg->bg->type == BG_PIXMAP && pg->bg->canvas_item!=NULL) {
-      g_object_get(G_OBJECT(pg->bg->canvas_item), "pixbuf", &pix, NULL);
-      if (pix!=pg->bg->pixbuf)
-        gnome_canvas_item_set(pg->bg->canvas_item, "pixbuf", pg->bg->pixbuf, NULL);
-      pg->bg->pixbuf_scale = 0;
-    }
-    if (pg->bg->type == BG_PDF) { 
-      // make pixmap scale to correct size if current one is wrong
-      is_well_scaled = (fabs(pg->bg->pixel_width - pg->width*ui.zoom) < 2.
-                     && fabs(pg->bg->pixel_height - pg->height*ui.zoom) < 2.);
-      if (pg->bg->canvas_item != NULL && !is_well_scaled) {
-        g_object_get(pg->bg->canvas_item, "width-in-pixels", &is_well_scaled, NULL);
-        if (is_well_scaled)
-          gnome_canvas_item_set(pg->bg->canvas_item,
-            "width", pg->width, "height", pg->height, 
-            "width-in-pixels", FALSE, "height-in-pixels", FALSE, 
-            "width-set", TRUE, "height-set", TRUE, 
-            NULL);
-      }
-      // request an asynchronous update to a better pixmap if needed
-      zoom_to_request = MIN(ui.zoom, MAX_SAFE_RENDER_DPI/72.0);
-      if (pg->bg->pixbuf_scale == zoom_to_request) continue;
-      if (add_bgpdf_request(pg->bg->file_page_seq, zoom_to_request))
-        pg->bg->pixbuf_scale = zoom_to_request;
+  // the tiles of PDF bg's are only good at the zoom they were rendered at
+  if (ui.zoom != tiles_zoom) {
+    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
+      pg = (struct Page *)pglist->data;
+      if (pg->bg->type == BG_PDF) remove_canvas_bg_tiles(pg, NULL);
     }
+    tiles_zoom = ui.zoom;
+  }
+
+  get_visible_pages(&first, &last);
+  max_priority = ui.progressive_bg_prefetch + BGPDF_CANCEL_MARGIN;
+  range = max_priority + 1;
+  begin_bgpdf_priorities();
+  if (!ui.progressive_bg && (ui.zoom != all_zoom || bgpdf.serial != all_serial)) {
+    for (i = 0; i < journal.npages; i++)
+      rescale_bg_page(i, first, last, TRUE);
+    all_zoom = ui.zoom;
+    all_serial = bgpdf.serial;
+  } else {
+    for (i = MAX(prev_first - range, 0); i <= MIN(prev_last + range, journal.npages-1); i++)
+      if (i < first - range || i > last + range) rescale_bg_page(i, first, last, FALSE);
+    for (i = MAX(first - range, 0); i <= MIN(last + range, journal.npages-1); i++)
+      rescale_bg_page(i, first, last, FALSE);
   }
+  if (ui.progressive_bg) all_zoom = 0; // request everything when it gets turned off
+  prev_first = first;
+  prev_last = last;
+  end_bgpdf_priorities(ui.progressive_bg ? max_priority : G_MAXINT);
 }
 
 gboolean have_intersect(struct BBox *a, struct BBox *b)
@@ -1413,11 +1983,13 @@ void do_switch_page(int pg, gboolean rescroll, gboolean refresh_all)
         gnome_canvas_item_show(GNOME_CANVAS_ITEM(layer->group));
     }
   
-  ui.cur_page = g_list_nth_data(journal.pages, ui.pageno);
+  ui.cur_page = journal_page(ui.pageno);
+  load_page(ui.cur_page);
+  materialize_page(ui.cur_page);
   ui.layerno = ui.cur_page->nlayers-1;
   ui.cur_layer = (struct Layer *)(g_list_last(ui.cur_page->layers)->data);
   update_page_stuff();
-  if (ui.progressive_bg) rescale_bg_pixmaps();
+  rescale_bg_pixmaps();
  
   if (rescroll) { // scroll and force a refresh
     gnome_canvas_get_scroll_offsets(canvas, &cx, &cy);
@@ -1438,59 +2010,25 @@ void update_page_stuff(void)
 {
   gchar tmp[10];
   GtkComboBox *layerbox;
-  int i;
-  GList *pglist;
   GtkSpinButton *spin;
-  struct Page *pg;
-  double vertpos, maxwidth, horizpos, maxheight;
+  double length;
 
   // move the page groups to their rightful locations or hide them
-  if (ui.view_continuous == VIEW_MODE_CONTINUOUS) {
-    vertpos = 0.; 
-    maxwidth = 0.;
-    for (i=0, pglist = journal.pages; pglist!=NULL; i++, pglist = pglist->next) {
-      pg = (struct Page *)pglist->data;
-      if (pg->group!=NULL) {
-        pg->hoffset = 0.; pg->voffset = vertpos;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
-        gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
-      }
-      vertpos += pg->height + VIEW_CONTINUOUS_SKIP;
-      if (pg->width > maxwidth) maxwidth = pg->width;
-    }
-    vertpos -= VIEW_CONTINUOUS_SKIP;
-    gnome_canvas_set_scroll_region(canvas, 0, 0, maxwidth, vertpos);
-  } 
-  else if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
-    horizpos = 0.; 
-    maxheight = 0.;
-    for (i=0, pglist = journal.pages; pglist!=NULL; i++, pglist = pglist->next) {
-      pg = (struct Page *)pglist->data;
-      if (pg->group!=NULL) {
-        pg->hoffset = horizpos; pg->voffset = 0.;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
-        gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
-      }
-      horizpos += pg->width + VIEW_CONTINUOUS_SKIP;
-      if (pg->height > maxheight) maxheight = pg->height;
-    }
-    horizpos -= VIEW_CONTINUOUS_SKIP;
-    gnome_canvas_set_scroll_region(canvas, 0, 0, horizpos, maxheight);
-  } 
+  update_page_offsets();
+  length = page_starts[page_array_len] - VIEW_CONTINUOUS_SKIP;
+  if (ui.view_continuous == VIEW_MODE_CONTINUOUS)
+    gnome_canvas_set_scroll_region(canvas, 0, 0, page_breadth[page_array_len-1], length);
+  else if (ui.view_continuous == VIEW_MODE_HORIZONTAL)
+    gnome_canvas_set_scroll_region(canvas, 0, 0, length, page_breadth[page_array_len-1]);
   else { // VIEW_MODE_ONE_PAGE
-    for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
-      pg = (struct Page *)pglist->data;
-      if (pg == ui.cur_page && pg->group!=NULL) {
-        pg->hoffset = 0.; pg->voffset = 0.;
-        gnome_canvas_item_set(GNOME_CANVAS_ITEM(pg->group), 
-            "x", pg->hoffset, "y", pg->voffset, NULL);
-        gnome_canvas_item_show(GNOME_CANVAS_ITEM(pg->group));
-      } else {
-        if (pg->group!=NULL) gnome_canvas_item_hide(GNOME_CANVAS_ITEM(pg->group));
-      }
+    if (one_page_shown != NULL && one_page_shown != ui.cur_page && one_page_shown->group != NULL)
+      gnome_canvas_item_hide(GNOME_CANVAS_ITEM(one_page_shown->group));
+    if (ui.cur_page->group != NULL) {
+      gnome_canvas_item_set(GNOME_CANVAS_ITEM(ui.cur_page->group), 
+          "x", ui.cur_page->hoffset, "y", ui.cur_page->voffset, NULL);
+      gnome_canvas_item_show(GNOME_CANVAS_ITEM(ui.cur_page->group));
     }
+    one_page_shown = ui.cur_page;
     gnome_canvas_set_scroll_region(canvas, 0, 0, ui.cur_page->width, ui.cur_page->height);
   }
 
@@ -1711,6 +2249,7 @@ void recolor_temp_text(int color_no, guint color_rgba)
     prepare_new_undo();
     undo->type = ITEM_TEXT_ATTRIB;
     undo->item = ui.cur_item;
+    undo->layer = ui.cur_layer;
     undo->str = g_strdup(ui.cur_item->font_name);
     undo->val_x = ui.cur_item->font_size;
     undo->brush = (struct Brush *)g_memdup(&(ui.cur_item->brush), sizeof(struct Brush));
@@ -1893,6 +2432,7 @@ gboolean ok_to_close(void)
   GtkWidget *dialog;
   GtkResponseType response;
 
+  wait_for_background_save(); // so that ui.saved is accurate
   if (ui.saved) return TRUE;
   dialog = gtk_message_dialog_new(GTK_WINDOW (winMain), GTK_DIALOG_DESTROY_WITH_PARENT,
     GTK_MESSAGE_WARNING, GTK_BUTTONS_NONE, _("Save changes to '%s'?"),
@@ -1907,6 +2447,7 @@ gboolean ok_to_close(void)
     return FALSE; // aborted
   if (response == GTK_RESPONSE_YES) {
     on_fileSave_activate(NULL, NULL);
+    wait_for_background_save();
     if (!ui.saved) return FALSE; // if save failed, then we abort
   }
   return TRUE;
@@ -1951,6 +2492,7 @@ void move_journal_items_by(GList *itemlist, double dx, double dy,
   
   while (itemlist!=NULL) {
     item = (struct Item *)itemlist->data;
+    unshare_stroke(item);
     if (item->type == ITEM_STROKE)
       for (pt=item->path->coords, i=0; i<item->path->num_points; i++, pt+=2)
         { pt[0] += dx; pt[1] += dy; }
@@ -2005,6 +2547,7 @@ void resize_journal_items_by(GList *itemlist, double scaling_x, double scaling_y
 
   for (list = itemlist; list != NULL; list = list->next) {
     item = (struct Item *)list->data;
+    unshare_stroke(item);
     if (item->type == ITEM_STROKE) {
       item->brush.thickness = item->brush.thickness * mean_scaling;
       for (i=0, pt=item->path->coords; i<item->path->num_points; i++, pt+=2) {
@@ -23,6 +23,9 @@ struct Page *new_page_with_bg(struct Background *bg, double width, double height
 void set_current_page(gdouble *pt);
 void realloc_cur_path(int n);
 void realloc_cur_widths(int n);
+gdouble *lend_widths(gdouble *widths);
+void free_widths(gdouble *widths);
+void unshare_stroke(struct Item *item);
 void clear_redo_stack(void);
 void clear_undo_stack(void);
 void prepare_new_undo(void);
@@ -30,6 +33,20 @@ void delete_journal(struct Journal *j);
 void delete_page(struct Page *pg);
 void delete_layer(struct Layer *l);
 
+// the page index
+
+void reset_page_index(void);
+void journal_pages_changed(int pageno);
+struct Page *journal_page(int pageno);
+int journal_page_number(struct Page *pg);
+void note_pdf_page_user(struct Page *pg);
+void forget_pdf_page_user(struct Page *pg);
+GSList *pages_with_pdf_page(int pageno);
+void journal_insert_page(struct Page *pg, int pageno);
+void journal_remove_page(struct Page *pg);
+int page_at_offset(double pos);
+int find_page_at(int pageno, double *pos, double upmargin);
+
 // referenced strings
 
 struct Refstring *new_refstring(const char *s);
@@ -46,10 +63,25 @@ void fix_xinput_coords(GdkEvent *event);
 void emergency_enable_xinput(GdkInputMode mode);
 void update_item_bbox(struct Item *item);
 void make_page_clipbox(struct Page *pg);
+void make_page_canvas_items(struct Page *pg);
 void make_canvas_items(void);
+void materialize_page(struct Page *pg);
+void dematerialize_page(struct Page *pg);
+void forget_layer_pages(void);
+struct Page *find_layer_page(struct Layer *l);
+gboolean page_is_busy(struct Page *pg);
+void update_canvas_pages(void);
+void materialize_undo_pages(struct UndoItem *u);
 void make_canvas_item_one(GnomeCanvasGroup *group, struct Item *item);
 void update_canvas_bg(struct Page *pg);
+GnomeCanvasItem *pdf_bg_pixbuf_item(struct Page *pg);
+void add_canvas_bg_tile(struct Page *pg, struct BgPdfTile *tile);
+void remove_canvas_bg_tiles(struct Page *pg, GdkPixbuf *pixbuf);
 gboolean is_visible(struct Page *pg);
+void get_visible_pages(int *first, int *last);
+gboolean get_visible_rect(struct Page *pg, struct BBox *rect);
+void load_visible_pages(void);
+double bgpdf_zoom_level(double zoom, double max_dpi);
 void rescale_bg_pixmaps(void);
 
 gboolean have_intersect(struct BBox *a, struct BBox *b);
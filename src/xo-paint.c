@@ -28,6 +28,8 @@
 #include "xo-support.h"
 #include "xo-misc.h"
 #include "xo-paint.h"
+#include "xo-stroke.h"
+#include "xo-layer.h"
 
 /************** drawing nice cursors *********/
 
@@ -241,8 +243,8 @@ void create_new_stroke(GdkEvent *event)
       "width-units", ui.cur_item->brush.thickness, NULL);
     ui.cur_item->brush.variable_width = FALSE;
   } else
-    ui.cur_item->canvas_item = gnome_canvas_item_new(
-      ui.cur_layer->group, gnome_canvas_group_get_type(), NULL);
+    ui.cur_item->canvas_item = stroke_item_new(ui.cur_layer->group,
+      ui.cur_item->brush.color_rgba, ui.cur_path.coords, NULL, 1);
 }
 
 void continue_stroke(GdkEvent *event)
@@ -280,22 +282,18 @@ void continue_stroke(GdkEvent *event)
     ui.cur_path.num_points++;
   }
 
-  seg.coords = pt; 
-  seg.num_points = 2;
-  seg.ref_count = 1;
+  if (ui.cur_brush->ruler) {
+    seg.coords = pt; 
+    seg.num_points = 2;
+    seg.ref_count = 1;
   
-  /* note: we're using a piece of the cur_path array. This is ok because
-     upon creation the line just copies the contents of the GnomeCanvasPoints
-     into an internal structure */
-
-  if (ui.cur_brush->ruler)
+    /* note: we're using a piece of the cur_path array. This is ok because
+       upon creation the line just copies the contents of the GnomeCanvasPoints
+       into an internal structure */
     gnome_canvas_item_set(ui.cur_item->canvas_item, "points", &seg, NULL);
+  }
   else
-    gnome_canvas_item_new((GnomeCanvasGroup *)ui.cur_item->canvas_item,
-       gnome_canvas_line_get_type(), "points", &seg,
-       "cap-style", GDK_CAP_ROUND, "join-style", GDK_JOIN_ROUND,
-       "fill-color-rgba", ui.cur_item->brush.color_rgba,
-       "width-units", current_width, NULL);
+    stroke_item_append(ui.cur_item->canvas_item, pt[2], pt[3], current_width);
 }
 
 void abort_stroke(void)
@@ -396,6 +394,7 @@ void erase_stroke_portions(struct Item *item, double x, double y, double radius,
       // FIXME: need to test if line SEGMENT hits the circle
       // hide the canvas item, and create erasure data if needed
       if (erasure == NULL) {
+        unbatch_item(item); // while still a stroke, so it gets its own canvas item
         item->type = ITEM_TEMP_STROKE;
         gnome_canvas_item_hide(item->canvas_item);  
             /*  we'll use this hidden item as an insertion point later */
@@ -440,7 +439,7 @@ void erase_stroke_portions(struct Item *item, double x, double y, double radius,
       if (item->type == ITEM_STROKE) { 
         // it's inside an erasure list - we destroy it
         gnome_canvas_points_free(item->path);
-        if (item->brush.variable_width) g_free(item->widths);
+        if (item->brush.variable_width) free_widths(item->widths);
         if (item->canvas_item != NULL) 
           gtk_object_destroy(GTK_OBJECT(item->canvas_item));
         erasure->nrepl--;
@@ -780,13 +779,14 @@ struct Item *click_is_in_text_or_image(struct Layer *layer, double x, double y)
   return val;
 }
 
-void refont_text_item(struct Item *item, gchar *font_name, double font_size)
+void refont_text_item(struct Item *item, struct Layer *layer, gchar *font_name, double font_size)
 {
   if (!strcmp(font_name, item->font_name) && font_size==item->font_size) return;
   if (item->text!=NULL) {
     prepare_new_undo();
     undo->type = ITEM_TEXT_ATTRIB;
     undo->item = item;
+    undo->layer = layer;
     undo->str = item->font_name;
     undo->val_x = item->font_size;
     undo->brush = (struct Brush *)g_memdup(&(item->brush), sizeof(struct Brush));
@@ -818,7 +818,7 @@ void process_font_sel(gchar *str)
   undo_cont = FALSE;   
   // if there's a current text item, re-font it
   if (ui.cur_item_type == ITEM_TEXT) {
-    refont_text_item(ui.cur_item, str, size);
+    refont_text_item(ui.cur_item, ui.cur_layer, str, size);
     undo_cont = (ui.cur_item->text!=NULL);   
   }
   // if there's a current selection, re-font it
@@ -827,7 +827,7 @@ void process_font_sel(gchar *str)
       it = (struct Item *)list->data;
       if (it->type == ITEM_TEXT) {   
         if (undo_cont) undo->multiop |= MULTIOP_CONT_REDO;
-        refont_text_item(it, str, size);
+        refont_text_item(it, ui.selection->layer, str, size);
         if (undo_cont) undo->multiop |= MULTIOP_CONT_UNDO;
         undo_cont = TRUE;
       }
@@ -44,6 +44,7 @@
 #include "xo-paint.h"
 #include "xo-print.h"
 #include "xo-file.h"
+#include "xo-image.h"
 
 #define RGBA_RED(rgba) (((rgba>>24)&0xff)/255.0)
 #define RGBA_GREEN(rgba) (((rgba>>16)&0xff)/255.0)
@@ -484,7 +485,7 @@ gboolean pdf_parse_info(GString *pdfbuf, struct PdfInfo *pdfinfo, struct XrefTab
   int offs;
   struct PdfObj *obj, *pages;
 
-  xref->n_alloc = xref->last = 0;
+  xref->n_alloc = xref->last = xref->base = 0;
   xref->data = NULL;
   p = pdfbuf->str + pdfbuf->len-1;
   
@@ -530,7 +531,7 @@ void make_xref(struct XrefTable *xref, int nobj, int offset)
     xref->data = g_realloc(xref->data, xref->n_alloc*sizeof(int));
   }
   if (xref->last < nobj) xref->last = nobj;
-  xref->data[nobj] = offset;
+  xref->data[nobj] = xref->base + offset;
 }
 
 // a wrapper for deflate
@@ -795,6 +796,23 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
   int height, width, stride, x, y, chan;
   GString *zpix;
 
+  width = gdk_pixbuf_get_width(image->pixbuf);
+  height = gdk_pixbuf_get_height(image->pixbuf);
+  // JPEG data can go in as is
+  chan = (image->jpeg != NULL) ? jpeg_components(image->jpeg, image->jpeg_len) : 0;
+  if (chan == 1 || chan == 3) {
+    make_xref(xref, image->n_obj, pdfbuf->len);
+    g_string_append_printf(pdfbuf, 
+      "%d 0 obj\n<< /Length %d /Filter /DCTDecode /Type /Xobject "
+      "/Subtype /Image /Width %d /Height %d /ColorSpace /%s "
+      "/BitsPerComponent 8 >> stream\n",
+      image->n_obj, (int)image->jpeg_len, width, height, 
+      (chan == 1) ? "DeviceGray" : "DeviceRGB");
+    g_string_append_len(pdfbuf, image->jpeg, image->jpeg_len);
+    g_string_append(pdfbuf, "\nendstream\nendobj\n");
+    return TRUE;
+  }
+
   if (gdk_pixbuf_get_bits_per_sample(image->pixbuf) != 8 ||
       gdk_pixbuf_get_colorspace(image->pixbuf) != GDK_COLORSPACE_RGB) {
     return FALSE;
@@ -819,7 +837,7 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
   zpix = do_deflate(buf, 3*width*height);
   g_free(buf);
 
-  xref->data[image->n_obj] = pdfbuf->len;
+  make_xref(xref, image->n_obj, pdfbuf->len);
   g_string_append_printf(pdfbuf, 
     "%d 0 obj\n<< /Length %d /Filter /FlateDecode /Type /Xobject "
     "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceRGB "
@@ -848,7 +866,7 @@ gboolean pdf_draw_image(PdfImage *image, struct XrefTable *xref, GString *pdfbuf
     zpix = do_deflate(buf, width*height);
     g_free(buf);
     
-    xref->data[image->n_obj_smask] = pdfbuf->len;
+    make_xref(xref, image->n_obj_smask, pdfbuf->len);
     g_string_append_printf(pdfbuf, 
       "%d 0 obj\n<< /Length %d /Filter /FlateDecode /Type /Xobject "
       "/Subtype /Image /Width %d /Height %d /ColorSpace /DeviceGray "
@@ -1062,7 +1080,7 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
      in TrueType case, encoding lists the used charcodes by index,
                        glyphs   list the used glyph no's by index
                        font->glyphmap maps charcodes to indices        */
-  xref->data[font->n_obj] = pdfbuf->len;
+  make_xref(xref, font->n_obj, pdfbuf->len);
   if (font->is_truetype) lastchar = encoding[font->num_glyphs_used];
   else lastchar = font->num_glyphs_used;
   if (fallback) {
@@ -1102,10 +1120,12 @@ void embed_pdffont(GString *pdfbuf, struct XrefTable *xref, struct PdfFont *font
 
 // Pdf images
 
-struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf *pixbuf)
+struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf *pixbuf,
+                              const gchar *data, gsize datalen)
 {
   GList *list;
   struct PdfImage *image;
+  const gchar *format;
   
   image = g_malloc(sizeof(struct PdfImage));
   *images = g_list_append(*images, image);
@@ -1117,6 +1137,13 @@ struct PdfImage *new_pdfimage(struct XrefTable *xref, GList **images, GdkPixbuf
     make_xref(xref, xref->last+1, 0); // will give it a value later
   }
   image->pixbuf = pixbuf;
+  image->jpeg = NULL;
+  image->jpeg_len = 0;
+  format = image_data_format(data, datalen);
+  if (!image->has_alpha && format != NULL && !strcmp(format, "jpeg")) {
+    image->jpeg = data;
+    image->jpeg_len = datalen;
+  }
 
   return image;
 }
@@ -1282,7 +1309,9 @@ void pdf_draw_page(struct Page *pg, GString *str, gboolean *use_hiliter,
         g_object_unref(layout);
       }
       else if  (item->type == ITEM_IMAGE) {
-        cur_image = new_pdfimage(xref, pdfimages, item->image);
+        decode_image_item(item);
+        if (item->image == NULL) continue;
+        cur_image = new_pdfimage(xref, pdfimages, item->image, item->image_png, item->image_png_len);
 	cur_image->used_in_this_page = TRUE;
         g_string_append_printf(str, "\nq 1 0 0 1 %.2f %.2f cm %.2f 0 0 %.2f 0 %.2f cm /Im%d Do Q ",
            item->bbox.left, item->bbox.top, // translation
@@ -1306,6 +1335,8 @@ gboolean print_to_pdf(char *filename)
 {
   FILE *f;
   GString *pdfbuf, *pgstrm, *zpgstrm, *tmpstr;
+  GString origbuf; // the background PDF, not a real GString
+  char version;
   int n_obj_catalog, n_obj_pages_offs, n_page, n_obj_bgpix, n_obj_prefix;
   int i, startxref;
   struct XrefTable xref;
@@ -1332,19 +1363,23 @@ gboolean print_to_pdf(char *filename)
   n_page = 0;
   for (pglist = journal.pages; pglist!=NULL; pglist = pglist->next) {
     pg = (struct Page *)pglist->data;
+    load_page(pg);
     if (pg->bg->type == BG_PDF) uses_pdf = TRUE;
     if (ui.exportpdf_layers) n_page += pg->nlayers; 
     else n_page++;
   }
   
+  /* The existing PDF file is parsed in place (bgpdf.file_contents is
+     null-terminated), and copied out to the file as it is; our objects go
+     into pdfbuf, which is written after it. */
+  origbuf.str = NULL;
+  origbuf.len = origbuf.allocated_len = 0;
   if (uses_pdf && bgpdf.status != STATUS_NOT_INIT && 
       bgpdf.file_contents!=NULL && !strncmp(bgpdf.file_contents, "%PDF-1.", 7)) {
-    // parse the existing PDF file
-    pdfbuf = g_string_new_len(bgpdf.file_contents, bgpdf.file_length);
-    if (pdfbuf->str[7]<'4') pdfbuf->str[7] = '4'; // upgrade to 1.4
-    annot = pdf_parse_info(pdfbuf, &pdfinfo, &xref);
+    origbuf.str = bgpdf.file_contents; // a read-only view
+    origbuf.len = bgpdf.file_length;
+    annot = pdf_parse_info(&origbuf, &pdfinfo, &xref);
     if (!annot) {
-      g_string_free(pdfbuf, TRUE);
       if (xref.data != NULL) g_free(xref.data);
     }
   }
@@ -1355,9 +1390,13 @@ gboolean print_to_pdf(char *filename)
     return FALSE;
   }
 
-  if (!annot) {
+  if (annot) {
+    pdfbuf = g_string_new("");
+    xref.base = origbuf.len;
+  }
+  else {
     pdfbuf = g_string_new("%PDF-1.4\n%\370\357\365\362\n");
-    xref.n_alloc = xref.last = 0;
+    xref.n_alloc = xref.last = xref.base = 0;
     xref.data = NULL;
   }
     
@@ -1431,7 +1470,7 @@ gboolean print_to_pdf(char *filename)
       "%d 0 obj\n<< /Type /Page /Parent %d 0 R /MediaBox [0 0 %.2f %.2f] ",
       n_obj_pages_offs+n_page, n_obj_catalog+1, pg->width, pg->height);
     if (n_obj_prefix>0) {
-      obj = get_pdfobj(pdfbuf, &xref, pdfinfo.pages[pg->bg->file_page_seq-1].contents);
+      obj = get_pdfobj(&origbuf, &xref, pdfinfo.pages[pg->bg->file_page_seq-1].contents);
       if (obj->type != PDFTYPE_ARRAY) {
         free_pdfobj(obj);
         obj = dup_pdfobj(pdfinfo.pages[pg->bg->file_page_seq-1].contents);
@@ -1463,24 +1502,24 @@ gboolean print_to_pdf(char *filename)
       obj->elts = NULL;
       obj->names = NULL;
     }
-    add_dict_subentry(pdfbuf, &xref,
+    add_dict_subentry(&origbuf, &xref,
         obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/PDF"));
     if (n_obj_bgpix>0 || pdfimages!=NULL)
-      add_dict_subentry(pdfbuf, &xref,
+      add_dict_subentry(&origbuf, &xref,
         obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/ImageC"));
     if (use_hiliter)
-      add_dict_subentry(pdfbuf, &xref,
+      add_dict_subentry(&origbuf, &xref,
         obj, "/ExtGState", PDFTYPE_DICT, "/XoHi", mk_pdfref(n_obj_catalog+2));
     if (n_obj_bgpix>0)
-      add_dict_subentry(pdfbuf, &xref,
+      add_dict_subentry(&origbuf, &xref,
         obj, "/XObject", PDFTYPE_DICT, "/ImBg", mk_pdfref(n_obj_bgpix));
     for (list=pdffonts; list!=NULL; list = list->next) {
       font = (struct PdfFont *)list->data;
       if (font->used_in_this_page) {
-        add_dict_subentry(pdfbuf, &xref,
+        add_dict_subentry(&origbuf, &xref,
           obj, "/ProcSet", PDFTYPE_ARRAY, NULL, mk_pdfname("/Text"));
         tmpbuf = g_strdup_printf("/F%d", font->n_obj);
-        add_dict_subentry(pdfbuf, &xref,
+        add_dict_subentry(&origbuf, &xref,
           obj, "/Font", PDFTYPE_DICT, tmpbuf, mk_pdfref(font->n_obj));
         g_free(tmpbuf);
       }
@@ -1489,7 +1528,7 @@ gboolean print_to_pdf(char *filename)
       image = (struct PdfImage *)list->data;
       if (image->used_in_this_page) {
         tmpbuf = g_strdup_printf("/Im%d", image->n_obj);
-        add_dict_subentry(pdfbuf, &xref,
+        add_dict_subentry(&origbuf, &xref,
           obj, "/XObject", PDFTYPE_DICT, tmpbuf, mk_pdfref(image->n_obj));
         g_free(tmpbuf);
       }
@@ -1521,7 +1560,7 @@ gboolean print_to_pdf(char *filename)
   g_list_free(pdfimages);
   
   // PDF trailer
-  startxref = pdfbuf->len;
+  startxref = xref.base + pdfbuf->len;
   if (annot) g_string_append_printf(pdfbuf,
         "xref\n%d %d\n", n_obj_catalog, xref.last-n_obj_catalog+1);
   else g_string_append_printf(pdfbuf, 
@@ -1557,6 +1596,15 @@ gboolean print_to_pdf(char *filename)
   }
   
   setlocale(LC_NUMERIC, "");
+  if (annot) { // the original, upgraded to PDF 1.4 if needed
+    version = (origbuf.str[7] < '4') ? '4' : origbuf.str[7];
+    if (fwrite(origbuf.str, 1, 7, f) < 7 || fputc(version, f) == EOF ||
+        fwrite(origbuf.str+8, 1, origbuf.len-8, f) < origbuf.len-8) {
+      fclose(f);
+      g_string_free(pdfbuf, TRUE);
+      return FALSE;
+    }
+  }
   if (fwrite(pdfbuf->str, 1, pdfbuf->len, f) < pdfbuf->len) {
     fclose(f);
     g_string_free(pdfbuf, TRUE);
@@ -1648,6 +1696,9 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
   int i;
   double *pt;
   PangoFontDescription *font_desc;
+  const gchar *format;
+  cairo_surface_t *surface;
+  guchar *jpeg;
 
   scale = MIN(width/pg->width, height/pg->height);
   cairo_translate(cr, (width-scale*pg->width)/2, (height-scale*pg->height)/2);
@@ -1702,11 +1753,22 @@ void print_page_to_cairo(cairo_t *cr, struct Page *pg, gdouble width, gdouble he
         cairo_move_to(cr, item->bbox.left, item->bbox.top);
         pango_cairo_show_layout(cr, layout);
       }
-      if (item->type == ITEM_IMAGE) {
+      if (item->type == ITEM_IMAGE) decode_image_item(item);
+      if (item->type == ITEM_IMAGE && item->image != NULL) {
         double scalex = (item->bbox.right-item->bbox.left)/gdk_pixbuf_get_width(item->image);
         double scaley = (item->bbox.bottom-item->bbox.top)/gdk_pixbuf_get_height(item->image);
         cairo_scale(cr, scalex, scaley);
         gdk_cairo_set_source_pixbuf(cr,item->image, item->bbox.left/scalex, item->bbox.top/scaley);
+#if CAIRO_VERSION >= CAIRO_VERSION_ENCODE(1, 10, 0)
+        // let the PDF surface embed a JPEG as is rather than re-compress it
+        format = image_data_format(item->image_png, item->image_png_len);
+        if (format != NULL && !strcmp(format, "jpeg") && 
+            cairo_pattern_get_surface(cairo_get_source(cr), &surface) == CAIRO_STATUS_SUCCESS) {
+          jpeg = g_memdup(item->image_png, item->image_png_len);
+          cairo_surface_set_mime_data(surface, CAIRO_MIME_TYPE_JPEG, jpeg, 
+            item->image_png_len, g_free, jpeg);
+        }
+#endif
         cairo_scale(cr, 1/scalex, 1/scaley);
         cairo_paint(cr);
         old_rgba = predef_colors_rgba[COLOR_BLACK];
@@ -1725,7 +1787,8 @@ void print_job_render_page(GtkPrintOperation *print, GtkPrintContext *context, g
   struct Page *pg;
   PangoLayout *layout;
         
-  pg = (struct Page *)g_list_nth_data(journal.pages, pageno);
+  pg = journal_page(pageno);
+  load_page(pg);
   cr = gtk_print_context_get_cairo_context(context);
   width = gtk_print_context_get_width(context);
   height = gtk_print_context_get_height(context);
@@ -1749,6 +1812,7 @@ gboolean print_to_pdf_cairo(char *filename)
   surface = cairo_pdf_surface_create(filename, ui.default_page.width, ui.default_page.height);
   for (list = journal.pages; list!=NULL; list = list->next) {
     pg = (struct Page *)list->data;
+    load_page(pg);
     if (ui.exportpdf_layers) last_layer = pg->layers; else last_layer = NULL;
     do {
       if (last_layer!=NULL) last_layer = last_layer->next;
@@ -17,6 +17,7 @@ typedef struct XrefTable {
   int *data;
   int last;
   int n_alloc;
+  int base; // file offset of the output buffer (after the original PDF)
 } XrefTable;
 
 typedef struct PdfPageDesc {
@@ -65,6 +66,8 @@ typedef struct PdfImage {
   gboolean has_alpha;
   int n_obj_smask;              /* only if has_alpha */
   GdkPixbuf *pixbuf;
+  const gchar *jpeg;            /* the original JPEG data, if any */
+  gsize jpeg_len;
   gboolean used_in_this_page;
 } PdfImage;
 
@@ -0,0 +1,244 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+
+#include "xournal.h"
+#include "xo-misc.h"
+#include "xo-ruling.h"
+
+/* The ruling of a page is the same horizontal lines across its whole width
+   and vertical lines across its whole height, so at a given zoom it is
+   described by the line coverage of each pixel row and of each pixel column.
+   These profiles are shared by all pages with the same ruling and size. */
+
+typedef struct RulingPattern {
+  int ruling;
+  double width, height, zoom;
+  int pixel_width, pixel_height;
+  guchar *cols, *rows; // line coverage of each pixel column/row, 0-255
+} RulingPattern;
+
+static GnomeCanvasItemClass *parent_class = NULL;
+static GList *ruling_patterns = NULL; // most recently used first
+
+static void add_line_coverage(guchar *cov, int n, double pos, double zoom)
+{
+  double lo, hi, a;
+  int i, v;
+
+  lo = (pos - RULING_THICKNESS/2)*zoom;
+  hi = (pos + RULING_THICKNESS/2)*zoom;
+  for (i = (int)floor(lo); i < hi && i < n; i++) {
+    if (i < 0) continue;
+    a = MIN(hi, i+1) - MAX(lo, i);
+    if (a <= 0) continue;
+    v = cov[i] + (int)(255*a + 0.5);
+    cov[i] = MIN(v, 255);
+  }
+}
+
+static RulingPattern *get_ruling_pattern(int ruling, double width, double height, double zoom)
+{
+  GList *list;
+  RulingPattern *pat;
+  double x, y;
+
+  for (list = ruling_patterns; list != NULL; list = list->next) {
+    pat = (RulingPattern *)list->data;
+    if (pat->ruling == ruling && pat->width == width && pat->height == height
+        && pat->zoom == zoom) {
+      if (list != ruling_patterns) {
+        ruling_patterns = g_list_remove_link(ruling_patterns, list);
+        ruling_patterns = g_list_concat(list, ruling_patterns);
+      }
+      return pat;
+    }
+  }
+
+  pat = g_new(RulingPattern, 1);
+  pat->ruling = ruling;
+  pat->width = width;
+  pat->height = height;
+  pat->zoom = zoom;
+  pat->pixel_width = (int)floor(width*zoom + 0.5);
+  pat->pixel_height = (int)floor(height*zoom + 0.5);
+  pat->cols = g_malloc0(pat->pixel_width + 1);
+  pat->rows = g_malloc0(pat->pixel_height + 1);
+
+  if (ruling == RULING_GRAPH) {
+    for (x=RULING_GRAPHSPACING; x<width-1; x+=RULING_GRAPHSPACING)
+      add_line_coverage(pat->cols, pat->pixel_width, x, zoom);
+    for (y=RULING_GRAPHSPACING; y<height-1; y+=RULING_GRAPHSPACING)
+      add_line_coverage(pat->rows, pat->pixel_height, y, zoom);
+  }
+  else if (ruling != RULING_NONE) {
+    for (y=RULING_TOPMARGIN; y<height-1; y+=RULING_SPACING)
+      add_line_coverage(pat->rows, pat->pixel_height, y, zoom);
+    if (ruling == RULING_LINED)
+      add_line_coverage(pat->cols, pat->pixel_width, RULING_LEFTMARGIN, zoom);
+  }
+
+  ruling_patterns = g_list_prepend(ruling_patterns, pat);
+  list = g_list_nth(ruling_patterns, RULING_PATTERN_CACHE);
+  if (list != NULL) {
+    pat = (RulingPattern *)list->data;
+    g_free(pat->cols);
+    g_free(pat->rows);
+    g_free(pat);
+    ruling_patterns = g_list_delete_link(ruling_patterns, list);
+  }
+  return (RulingPattern *)ruling_patterns->data;
+}
+
+static void blend_pixel(guchar *p, guint color_rgba, int coverage)
+{
+  int a;
+
+  a = ((color_rgba & 0xff) * coverage + 127)/255;
+  if (a == 0) return;
+  p[0] += ((int)((color_rgba>>24)&0xff) - p[0]) * a / 255;
+  p[1] += ((int)((color_rgba>>16)&0xff) - p[1]) * a / 255;
+  p[2] += ((int)((color_rgba>>8)&0xff) - p[2]) * a / 255;
+}
+
+static void ruling_item_update(GnomeCanvasItem *item, double *affine,
+                               ArtSVP *clip_path, int flags)
+{
+  RulingItem *ruling = RULING_ITEM(item);
+  int i;
+
+  if (parent_class->update)
+    (*parent_class->update)(item, affine, clip_path, flags);
+
+  for (i=0; i<6; i++) ruling->affine[i] = affine[i];
+  gnome_canvas_update_bbox(item, (int)floor(affine[4]), (int)floor(affine[5]),
+    (int)ceil(affine[4] + ruling->width*affine[0]) + 1,
+    (int)ceil(affine[5] + ruling->height*affine[3]) + 1);
+}
+
+static void ruling_item_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  RulingItem *ruling = RULING_ITEM(item);
+  RulingPattern *pat;
+  guint cols_color;
+  gboolean cols_on_top;
+  int ox, oy, x0, y0, x1, y1, px, py, rowcov;
+  guchar *p;
+
+  pat = get_ruling_pattern(ruling->ruling, ruling->width, ruling->height,
+                           ruling->affine[0]);
+  ox = (int)floor(ruling->affine[4] + 0.5);
+  oy = (int)floor(ruling->affine[5] + 0.5);
+  x0 = MAX(buf->rect.x0, ox);
+  y0 = MAX(buf->rect.y0, oy);
+  x1 = MIN(buf->rect.x1, ox + pat->pixel_width);
+  y1 = MIN(buf->rect.y1, oy + pat->pixel_height);
+  if (x0 >= x1 || y0 >= y1) return;
+
+  gnome_canvas_buf_ensure_buf(buf);
+  buf->is_bg = 0;
+
+  // the margin line goes over the ruling; graph paper has rows over columns
+  cols_on_top = (ruling->ruling == RULING_LINED);
+  cols_color = cols_on_top ? RULING_MARGIN_COLOR : RULING_COLOR;
+
+  for (py = y0; py < y1; py++) {
+    p = buf->buf + (py - buf->rect.y0)*buf->buf_rowstride + (x0 - buf->rect.x0)*3;
+    rowcov = pat->rows[py - oy];
+    for (px = x0; px < x1; px++, p+=3) {
+      blend_pixel(p, ruling->color_rgba, 255);
+      if (!cols_on_top) blend_pixel(p, cols_color, pat->cols[px - ox]);
+      if (rowcov) blend_pixel(p, RULING_COLOR, rowcov);
+      if (cols_on_top) blend_pixel(p, cols_color, pat->cols[px - ox]);
+    }
+  }
+}
+
+static double ruling_item_point(GnomeCanvasItem *item, double x, double y,
+                                int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  RulingItem *ruling = RULING_ITEM(item);
+  double dx, dy;
+
+  *actual_item = item;
+  dx = MAX(0., MAX(-x, x - ruling->width));
+  dy = MAX(0., MAX(-y, y - ruling->height));
+  return hypot(dx, dy) * GNOME_CANVAS(item->canvas)->pixels_per_unit;
+}
+
+static void ruling_item_bounds(GnomeCanvasItem *item, double *x1, double *y1,
+                               double *x2, double *y2)
+{
+  RulingItem *ruling = RULING_ITEM(item);
+
+  *x1 = 0.;
+  *y1 = 0.;
+  *x2 = ruling->width;
+  *y2 = ruling->height;
+}
+
+static void ruling_item_class_init(RulingItemClass *klass)
+{
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  parent_class = g_type_class_peek_parent(klass);
+  item_class->update = ruling_item_update;
+  item_class->render = ruling_item_render;
+  item_class->point = ruling_item_point;
+  item_class->bounds = ruling_item_bounds;
+}
+
+GType ruling_item_get_type(void)
+{
+  static GType ruling_item_type = 0;
+
+  if (!ruling_item_type) {
+    static const GTypeInfo ruling_item_info = {
+      sizeof(RulingItemClass),
+      NULL, NULL,
+      (GClassInitFunc) ruling_item_class_init,
+      NULL, NULL,
+      sizeof(RulingItem),
+      0, NULL, NULL
+    };
+    ruling_item_type = g_type_register_static(GNOME_TYPE_CANVAS_ITEM,
+                            "XournalRulingItem", &ruling_item_info, 0);
+  }
+  return ruling_item_type;
+}
+
+GnomeCanvasItem *ruling_item_new(GnomeCanvasGroup *group, guint color_rgba,
+                                 int ruling, double width, double height)
+{
+  GnomeCanvasItem *item;
+  RulingItem *ruling_item;
+
+  item = gnome_canvas_item_new(group, ruling_item_get_type(), NULL);
+  ruling_item = RULING_ITEM(item);
+  ruling_item->color_rgba = color_rgba;
+  ruling_item->ruling = ruling;
+  ruling_item->width = width;
+  ruling_item->height = height;
+  gnome_canvas_item_request_update(item);
+  return item;
+}
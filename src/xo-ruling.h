@@ -0,0 +1,36 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// a canvas item drawing a solid page background and its ruling
+
+#define RULING_PATTERN_CACHE 8 // number of (ruling, size, zoom) patterns kept
+
+typedef struct RulingItem {
+  GnomeCanvasItem item;
+  guint color_rgba;
+  int ruling;
+  double width, height;
+  double affine[6];
+} RulingItem;
+
+typedef struct RulingItemClass {
+  GnomeCanvasItemClass parent_class;
+} RulingItemClass;
+
+#define RULING_ITEM(o) (G_TYPE_CHECK_INSTANCE_CAST((o), ruling_item_get_type(), RulingItem))
+
+GType ruling_item_get_type(void);
+GnomeCanvasItem *ruling_item_new(GnomeCanvasGroup *group, guint color_rgba,
+                                 int ruling, double width, double height);
@@ -32,6 +32,8 @@
 #include "xo-misc.h"
 #include "xo-paint.h"
 #include "xo-selection.h"
+#include "xo-layer.h"
+#include "xo-file.h"
 
 /************ selection tools ***********/
 
@@ -97,7 +99,8 @@ void finalize_selectrect(void)
     item = (struct Item *)itemlist->data;
     if (item->bbox.left >= x1 && item->bbox.right <= x2 &&
           item->bbox.top >= y1 && item->bbox.bottom <= y2) {
-      ui.selection->items = g_list_append(ui.selection->items, item); 
+      unbatch_item(item);
+      ui.selection->items = g_list_append(ui.selection->items, item);
     }
   }
   
@@ -105,6 +108,7 @@ void finalize_selectrect(void)
     // if we clicked inside a text zone or image?  
     item = click_is_in_text_or_image(ui.selection->layer, x1, y1);
     if (item!=NULL && item==click_is_in_text_or_image(ui.selection->layer, x2, y2)) {
+      unbatch_item(item);
       ui.selection->items = g_list_append(ui.selection->items, item);
       g_memmove(&(ui.selection->bbox), &(item->bbox), sizeof(struct BBox));
       gnome_canvas_item_set(ui.selection->canvas_item,
@@ -228,7 +232,8 @@ void finalize_selectregion(void)
       if (ui.selection->items==NULL || ui.selection->bbox.bottom<item->bbox.bottom)
         ui.selection->bbox.bottom = item->bbox.bottom;
       // add the item
-      ui.selection->items = g_list_append(ui.selection->items, item); 
+      unbatch_item(item);
+      ui.selection->items = g_list_append(ui.selection->items, item);
     }
   }
   art_svp_free(lassosvp);
@@ -253,6 +258,7 @@ void finalize_selectregion(void)
       }
     }
     if (item!=NULL) {
+      unbatch_item(item);
       ui.selection->items = g_list_append(ui.selection->items, item);
       g_memmove(&(ui.selection->bbox), &(item->bbox), sizeof(struct BBox));
     }
@@ -371,7 +377,8 @@ void start_vertspace(GdkEvent *event)
   for (itemlist = ui.cur_layer->items; itemlist!=NULL; itemlist = itemlist->next) {
     item = (struct Item *)itemlist->data;
     if (item->bbox.top >= pt[1]) {
-      ui.selection->items = g_list_append(ui.selection->items, item); 
+      unbatch_item(item);
+      ui.selection->items = g_list_append(ui.selection->items, item);
       if (item->bbox.bottom > ui.selection->bbox.bottom)
         ui.selection->bbox.bottom = item->bbox.bottom;
     }
@@ -393,7 +400,7 @@ void start_vertspace(GdkEvent *event)
 
 void continue_movesel(GdkEvent *event)
 {
-  double pt[2], dx, dy, upmargin;
+  double pt[2], dx, dy, upmargin, oldpos;
   GList *list;
   struct Item *item;
   int tmppageno;
@@ -409,48 +416,28 @@ void continue_movesel(GdkEvent *event)
     upmargin = ui.selection->bbox.bottom - ui.selection->bbox.top;
   else upmargin = VIEW_CONTINUOUS_SKIP;
   tmppageno = ui.selection->move_pageno;
-  tmppage = g_list_nth_data(journal.pages, tmppageno);
   if (ui.view_continuous == VIEW_MODE_CONTINUOUS) {
-    while (pt[1] < - upmargin) {
-      if (tmppageno == 0) break;
-      tmppageno--;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
-      pt[1] += tmppage->height + VIEW_CONTINUOUS_SKIP;
-      ui.selection->move_pagedelta += tmppage->height + VIEW_CONTINUOUS_SKIP;
-    }
-    while (pt[1] > tmppage->height+VIEW_CONTINUOUS_SKIP) {
-      if (tmppageno == journal.npages-1) break;
-      pt[1] -= tmppage->height + VIEW_CONTINUOUS_SKIP;
-      ui.selection->move_pagedelta -= tmppage->height + VIEW_CONTINUOUS_SKIP;
-      tmppageno++;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
-    }
+    oldpos = pt[1];
+    tmppageno = find_page_at(tmppageno, pt+1, upmargin);
+    ui.selection->move_pagedelta += pt[1] - oldpos;
   }
   if (ui.view_continuous == VIEW_MODE_HORIZONTAL) {
-    while (pt[0] < -VIEW_CONTINUOUS_SKIP) {
-      if (tmppageno == 0) break;
-      tmppageno--;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
-      pt[0] += tmppage->width + VIEW_CONTINUOUS_SKIP;
-      ui.selection->move_pagedelta += tmppage->width + VIEW_CONTINUOUS_SKIP;
-    }
-    while (pt[0] > tmppage->width+VIEW_CONTINUOUS_SKIP) {
-      if (tmppageno == journal.npages-1) break;
-      pt[0] -= tmppage->width + VIEW_CONTINUOUS_SKIP;
-      ui.selection->move_pagedelta -= tmppage->width + VIEW_CONTINUOUS_SKIP;
-      tmppageno++;
-      tmppage = g_list_nth_data(journal.pages, tmppageno);
-    }
+    oldpos = pt[0];
+    tmppageno = find_page_at(tmppageno, pt, VIEW_CONTINUOUS_SKIP);
+    ui.selection->move_pagedelta += pt[0] - oldpos;
   }
   
   if (tmppageno != ui.selection->move_pageno) {
     // move to a new page !
     ui.selection->move_pageno = tmppageno;
+    tmppage = journal_page(tmppageno);
     if (tmppageno == ui.selection->orig_pageno)
       ui.selection->move_layer = ui.selection->layer;
-    else
-      ui.selection->move_layer = (struct Layer *)(g_list_last(
-        ((struct Page *)g_list_nth_data(journal.pages, tmppageno))->layers)->data);
+    else {
+      load_page(tmppage);
+      materialize_page(tmppage);
+      ui.selection->move_layer = (struct Layer *)(g_list_last(tmppage->layers)->data);
+    }
     gnome_canvas_item_reparent(ui.selection->canvas_item, ui.selection->move_layer->group);
     for (list = ui.selection->items; list!=NULL; list = list->next) {
       item = (struct Item *)list->data;
@@ -573,6 +560,7 @@ void finalize_resizesel(void)
     // create the undo information
     prepare_new_undo();
     undo->type = ITEM_RESIZESEL;
+    undo->layer = ui.selection->layer;
     undo->itemlist = g_list_copy(ui.selection->items);
     undo->auxlist = NULL;
 
@@ -649,6 +637,7 @@ void recolor_selection(int color_no, guint color_rgba)
   if (ui.selection == NULL) return;
   prepare_new_undo();
   undo->type = ITEM_REPAINTSEL;
+  undo->layer = ui.selection->layer;
   undo->itemlist = NULL;
   undo->auxlist = NULL;
   for (itemlist = ui.selection->items; itemlist!=NULL; itemlist = itemlist->next) {
@@ -686,6 +675,7 @@ void rethicken_selection(int val)
   if (ui.selection == NULL) return;
   prepare_new_undo();
   undo->type = ITEM_REPAINTSEL;
+  undo->layer = ui.selection->layer;
   undo->itemlist = NULL;
   undo->auxlist = NULL;
   for (itemlist = ui.selection->items; itemlist!=NULL; itemlist = itemlist->next) {
@@ -26,6 +26,7 @@
 #include "xo-shapes.h"
 #include "xo-paint.h"
 #include "xo-misc.h"
+#include "xo-layer.h"
 
 typedef struct Inertia {
   double mass, sx, sy, sxx, sxy, syy;
@@ -311,6 +312,7 @@ void remove_recognized_strokes(struct RecoSegment *rs, int num_old_items)
     erasure->nrepl = 0;
     erasure->replacement_items = NULL;
     undo->erasurelist = g_list_append(undo->erasurelist, erasure);
+    unbatch_item(old_item); // else the layer item would still draw it
     if (old_item->canvas_item != NULL)
       gtk_object_destroy(GTK_OBJECT(old_item->canvas_item));
     ui.cur_layer->items = g_list_remove(ui.cur_layer->items, old_item);
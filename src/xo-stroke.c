@@ -0,0 +1,310 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <math.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <libgnomecanvas/libgnomecanvas.h>
+#include <libart_lgpl/art_svp_vpath.h>
+#include <libart_lgpl/art_svp_wind.h>
+
+#include "xournal.h"
+#include "xo-stroke.h"
+
+/* A pressure stroke used to be a group of one line item per segment.
+   Here each segment becomes a round-capped quad in a single vector path,
+   and the union of a chunk of these is filled as one antialiased SVP,
+   the same way as gnome_canvas_line renders a plain stroke. */
+
+static GnomeCanvasItemClass *parent_class = NULL;
+
+static void expand_rect(ArtDRect *rect, double x, double y)
+{
+  if (x < rect->x0) rect->x0 = x;
+  if (x > rect->x1) rect->x1 = x;
+  if (y < rect->y0) rect->y0 = y;
+  if (y > rect->y1) rect->y1 = y;
+}
+
+// outline of segments [first, last) in canvas pixels
+static ArtSVP *stroke_outline(StrokeItem *stroke, int first, int last, ArtDRect *rect)
+{
+  ArtVpath *vpath, *v;
+  ArtSVP *svp, *svp2;
+  double *pt, expansion, ax, ay, bx, by, dx, dy, nx, ny, len, r, c, s;
+  int i, k, steps;
+
+  expansion = art_affine_expansion(stroke->affine);
+  vpath = g_new(ArtVpath, (last-first)*(2*16+4) + 1);
+  v = vpath;
+  rect->x0 = rect->y0 = G_MAXDOUBLE;
+  rect->x1 = rect->y1 = -G_MAXDOUBLE;
+
+  for (i = first; i < last; i++) {
+    pt = stroke->coords + 2*i;
+    ax = stroke->affine[0]*pt[0] + stroke->affine[2]*pt[1] + stroke->affine[4];
+    ay = stroke->affine[1]*pt[0] + stroke->affine[3]*pt[1] + stroke->affine[5];
+    bx = stroke->affine[0]*pt[2] + stroke->affine[2]*pt[3] + stroke->affine[4];
+    by = stroke->affine[1]*pt[2] + stroke->affine[3]*pt[3] + stroke->affine[5];
+    r = stroke->widths[i]*expansion/2;
+    if (r < 0.25) r = 0.25; // keep hairlines visible
+    steps = (r < 2) ? 4 : (r < 8) ? 8 : 16;
+
+    dx = bx - ax; dy = by - ay;
+    len = hypot(dx, dy);
+    if (len < 1e-6) { dx = 1.; dy = 0.; }
+    else { dx /= len; dy /= len; }
+    nx = -dy; ny = dx;
+
+    v->code = ART_MOVETO; v->x = ax + r*nx; v->y = ay + r*ny; v++;
+    v->code = ART_LINETO; v->x = bx + r*nx; v->y = by + r*ny; v++;
+    for (k = 1; k < steps; k++) {
+      c = r*cos(k*M_PI/steps); s = r*sin(k*M_PI/steps);
+      v->code = ART_LINETO; v->x = bx + c*nx + s*dx; v->y = by + c*ny + s*dy; v++;
+    }
+    v->code = ART_LINETO; v->x = bx - r*nx; v->y = by - r*ny; v++;
+    v->code = ART_LINETO; v->x = ax - r*nx; v->y = ay - r*ny; v++;
+    for (k = 1; k < steps; k++) {
+      c = r*cos(k*M_PI/steps); s = r*sin(k*M_PI/steps);
+      v->code = ART_LINETO; v->x = ax - c*nx - s*dx; v->y = ay - c*ny - s*dy; v++;
+    }
+    v->code = ART_LINETO; v->x = ax + r*nx; v->y = ay + r*ny; v++;
+
+    expand_rect(rect, MIN(ax, bx) - r, MIN(ay, by) - r);
+    expand_rect(rect, MAX(ax, bx) + r, MAX(ay, by) + r);
+  }
+  v->code = ART_END; v->x = v->y = 0.;
+
+  svp = art_svp_from_vpath(vpath);
+  g_free(vpath);
+  svp2 = art_svp_uncross(svp);
+  art_svp_free(svp);
+  svp = art_svp_rewind_uncrossed(svp2, ART_WIND_RULE_NONZERO);
+  art_svp_free(svp2);
+  return svp;
+}
+
+static void free_stroke_outlines(StrokeItem *stroke)
+{
+  int i;
+
+  for (i = 0; i < stroke->num_chunks; i++)
+    art_svp_free(stroke->svps[i]);
+  g_free(stroke->svps);
+  g_free(stroke->rects);
+  stroke->svps = NULL;
+  stroke->rects = NULL;
+  stroke->num_chunks = 0;
+  stroke->dirty_chunk = 0;
+}
+
+static void stroke_item_update(GnomeCanvasItem *item, double *affine,
+                               ArtSVP *clip_path, int flags)
+{
+  StrokeItem *stroke = STROKE_ITEM(item);
+  gboolean full;
+  int i, num_segs, num_chunks;
+  ArtDRect bbox;
+
+  if (parent_class->update)
+    (*parent_class->update)(item, affine, clip_path, flags);
+
+  // a new zoom or position means new outlines; otherwise only appends
+  full = (!stroke->affine_set || memcmp(stroke->affine, affine, 6*sizeof(double)) != 0);
+  if (full) {
+    free_stroke_outlines(stroke);
+    for (i = 0; i < 6; i++) stroke->affine[i] = affine[i];
+    stroke->affine_set = TRUE;
+  }
+
+  num_segs = MAX(stroke->num_points - 1, 0);
+  num_chunks = (num_segs + STROKE_CHUNK_SIZE - 1)/STROKE_CHUNK_SIZE;
+  if (num_chunks > stroke->num_chunks) {
+    stroke->svps = g_renew(ArtSVP *, stroke->svps, num_chunks);
+    stroke->rects = g_renew(ArtDRect, stroke->rects, num_chunks);
+  }
+  for (i = stroke->dirty_chunk; i < num_chunks; i++) {
+    if (i < stroke->num_chunks) art_svp_free(stroke->svps[i]);
+    stroke->svps[i] = stroke_outline(stroke, i*STROKE_CHUNK_SIZE,
+               MIN(num_segs, (i+1)*STROKE_CHUNK_SIZE), stroke->rects+i);
+    // chunks only grow, so redrawing the new outline is enough
+    if (!full)
+      gnome_canvas_request_redraw(item->canvas,
+        (int)floor(stroke->rects[i].x0), (int)floor(stroke->rects[i].y0),
+        (int)ceil(stroke->rects[i].x1) + 1, (int)ceil(stroke->rects[i].y1) + 1);
+  }
+  stroke->num_chunks = num_chunks;
+  stroke->dirty_chunk = num_chunks;
+
+  if (num_chunks == 0) {
+    gnome_canvas_update_bbox(item, 0, 0, 0, 0);
+    return;
+  }
+  bbox = stroke->rects[0];
+  for (i = 1; i < num_chunks; i++) {
+    expand_rect(&bbox, stroke->rects[i].x0, stroke->rects[i].y0);
+    expand_rect(&bbox, stroke->rects[i].x1, stroke->rects[i].y1);
+  }
+  if (full)
+    gnome_canvas_update_bbox(item, (int)floor(bbox.x0), (int)floor(bbox.y0),
+                             (int)ceil(bbox.x1) + 1, (int)ceil(bbox.y1) + 1);
+  else {
+    item->x1 = floor(bbox.x0);
+    item->y1 = floor(bbox.y0);
+    item->x2 = ceil(bbox.x1) + 1;
+    item->y2 = ceil(bbox.y1) + 1;
+  }
+}
+
+static void stroke_item_render(GnomeCanvasItem *item, GnomeCanvasBuf *buf)
+{
+  StrokeItem *stroke = STROKE_ITEM(item);
+  ArtDRect *rect;
+  int i;
+
+  for (i = 0; i < stroke->num_chunks; i++) {
+    rect = stroke->rects + i;
+    if (rect->x1 < buf->rect.x0 || rect->x0 > buf->rect.x1 ||
+        rect->y1 < buf->rect.y0 || rect->y0 > buf->rect.y1) continue;
+    gnome_canvas_render_svp(buf, stroke->svps[i], stroke->color_rgba);
+  }
+}
+
+static double stroke_item_point(GnomeCanvasItem *item, double x, double y,
+                                int cx, int cy, GnomeCanvasItem **actual_item)
+{
+  StrokeItem *stroke = STROKE_ITEM(item);
+  double *pt, dx, dy, len2, t, dist, best;
+  int i;
+
+  *actual_item = item;
+  best = G_MAXDOUBLE;
+  for (i = 0, pt = stroke->coords; i < stroke->num_points-1; i++, pt+=2) {
+    dx = pt[2]-pt[0]; dy = pt[3]-pt[1];
+    len2 = dx*dx + dy*dy;
+    t = (len2 > 0) ? ((x-pt[0])*dx + (y-pt[1])*dy)/len2 : 0.;
+    t = CLAMP(t, 0., 1.);
+    dist = hypot(x - pt[0] - t*dx, y - pt[1] - t*dy) - stroke->widths[i]/2;
+    if (dist < best) best = dist;
+  }
+  if (best < 0) best = 0.;
+  return best * GNOME_CANVAS(item->canvas)->pixels_per_unit;
+}
+
+static void stroke_item_bounds(GnomeCanvasItem *item, double *x1, double *y1,
+                               double *x2, double *y2)
+{
+  StrokeItem *stroke = STROKE_ITEM(item);
+  double *pt, r;
+  int i;
+
+  *x1 = *y1 = G_MAXDOUBLE;
+  *x2 = *y2 = -G_MAXDOUBLE;
+  for (i = 0, pt = stroke->coords; i < stroke->num_points; i++, pt+=2) {
+    r = stroke->widths[MIN(i, stroke->num_points-2)]/2;
+    if (stroke->num_points < 2) r = 0.;
+    *x1 = MIN(*x1, pt[0]-r); *x2 = MAX(*x2, pt[0]+r);
+    *y1 = MIN(*y1, pt[1]-r); *y2 = MAX(*y2, pt[1]+r);
+  }
+  if (stroke->num_points == 0) *x1 = *y1 = *x2 = *y2 = 0.;
+}
+
+static void stroke_item_finalize(GObject *object)
+{
+  StrokeItem *stroke = STROKE_ITEM(object);
+
+  free_stroke_outlines(stroke);
+  g_free(stroke->coords);
+  g_free(stroke->widths);
+  G_OBJECT_CLASS(parent_class)->finalize(object);
+}
+
+static void stroke_item_class_init(StrokeItemClass *klass)
+{
+  GnomeCanvasItemClass *item_class = GNOME_CANVAS_ITEM_CLASS(klass);
+
+  parent_class = g_type_class_peek_parent(klass);
+  G_OBJECT_CLASS(klass)->finalize = stroke_item_finalize;
+  item_class->update = stroke_item_update;
+  item_class->render = stroke_item_render;
+  item_class->point = stroke_item_point;
+  item_class->bounds = stroke_item_bounds;
+}
+
+GType stroke_item_get_type(void)
+{
+  static GType stroke_item_type = 0;
+
+  if (!stroke_item_type) {
+    static const GTypeInfo stroke_item_info = {
+      sizeof(StrokeItemClass),
+      NULL, NULL,
+      (GClassInitFunc) stroke_item_class_init,
+      NULL, NULL,
+      sizeof(StrokeItem),
+      0, NULL, NULL
+    };
+    stroke_item_type = g_type_register_static(GNOME_TYPE_CANVAS_ITEM,
+                            "XournalStrokeItem", &stroke_item_info, 0);
+  }
+  return stroke_item_type;
+}
+
+// widths[i] is the width of the segment from point i to point i+1
+GnomeCanvasItem *stroke_item_new(GnomeCanvasGroup *group, guint color_rgba,
+                       double *coords, double *widths, int num_points)
+{
+  GnomeCanvasItem *item;
+  StrokeItem *stroke;
+
+  item = gnome_canvas_item_new(group, stroke_item_get_type(), NULL);
+  stroke = STROKE_ITEM(item);
+  stroke->color_rgba = color_rgba;
+  stroke->alloc_points = MAX(num_points, 16);
+  stroke->coords = g_new(double, 2*stroke->alloc_points);
+  stroke->widths = g_new(double, stroke->alloc_points);
+  stroke->num_points = num_points;
+  g_memmove(stroke->coords, coords, 2*num_points*sizeof(double));
+  if (num_points > 1)
+    g_memmove(stroke->widths, widths, (num_points-1)*sizeof(double));
+  gnome_canvas_item_request_update(item);
+  return item;
+}
+
+// add a point, with the width of the segment leading to it
+void stroke_item_append(GnomeCanvasItem *item, double x, double y, double width)
+{
+  StrokeItem *stroke = STROKE_ITEM(item);
+  int chunk;
+
+  if (stroke->num_points == stroke->alloc_points) {
+    stroke->alloc_points *= 2;
+    stroke->coords = g_renew(double, stroke->coords, 2*stroke->alloc_points);
+    stroke->widths = g_renew(double, stroke->widths, stroke->alloc_points);
+  }
+  stroke->coords[2*stroke->num_points] = x;
+  stroke->coords[2*stroke->num_points+1] = y;
+  if (stroke->num_points > 0)
+    stroke->widths[stroke->num_points-1] = width;
+  stroke->num_points++;
+
+  chunk = (stroke->num_points - 2)/STROKE_CHUNK_SIZE;
+  if (chunk >= 0 && chunk < stroke->dirty_chunk) stroke->dirty_chunk = chunk;
+  gnome_canvas_item_request_update(item);
+}
@@ -0,0 +1,42 @@
+/*
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2 of the License, or (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// a canvas item drawing a whole variable-width stroke
+
+#define STROKE_CHUNK_SIZE 32 // segments per outline; appends rebuild only the last one
+
+typedef struct StrokeItem {
+  GnomeCanvasItem item;
+  guint color_rgba;
+  int num_points, alloc_points;
+  double *coords; // 2 per point
+  double *widths; // 1 per segment
+  ArtSVP **svps;  // outlines in canvas pixels, one per chunk of segments
+  ArtDRect *rects; // their bounding boxes
+  int num_chunks, dirty_chunk;
+  gboolean affine_set;
+  double affine[6];
+} StrokeItem;
+
+typedef struct StrokeItemClass {
+  GnomeCanvasItemClass parent_class;
+} StrokeItemClass;
+
+#define STROKE_ITEM(o) (G_TYPE_CHECK_INSTANCE_CAST((o), stroke_item_get_type(), StrokeItem))
+
+GType stroke_item_get_type(void);
+GnomeCanvasItem *stroke_item_new(GnomeCanvasGroup *group, guint color_rgba,
+                       double *coords, double *widths, int num_points);
+void stroke_item_append(GnomeCanvasItem *item, double x, double y, double width);
@@ -22,6 +22,14 @@
    and want to list the input events received by xournal. Caution, lots
    of output (redirect to a file). */
 
+// #define SAVE_DEBUG
+/* uncomment this line to print how long each save takes and the
+   resulting (uncompressed) throughput. */
+
+// #define LOAD_DEBUG
+/* uncomment this line to print how many stroke points have been read
+   so far and the time spent converting them. */
+
 // #define ENABLE_XINPUT_BUGFIX
 /* uncomment this line if you are experiencing calibration problems with
    XInput and want to try things differently. Especially useful on older
@@ -38,6 +46,7 @@
 #define MRU_FILE "recent-files"
 #define MRU_SIZE 8 
 #define CONFIG_FILE "config"
+#define CACHE_DIR "cache"
 
 // apparently, not all Win32/64 compilers define WIN32 (?)
 
@@ -62,7 +71,13 @@
 #define DISPLAY_DPI_DEFAULT 96.0
 #define MIN_ZOOM 0.2
 #define RESIZE_MARGIN 6.0
-#define MAX_SAFE_RENDER_DPI 720 // max dpi at which PDF bg's get rendered
+#define MAX_SAFE_RENDER_DPI 240 // max dpi at which whole PDF bg pages get rendered
+#define MAX_UNTILED_RENDER_DPI 720 // same, for pages that can't be shown in tiles
+#define BGPDF_TILE_SIZE 256 // beyond MAX_SAFE_RENDER_DPI, PDF bg's are rendered in tiles of this many pixels
+#define BGPDF_CANCEL_MARGIN 2 // pages past the prefetch before a PDF bg request is dropped
+#define BGPDF_PREVIEW_DPI 24 // dpi of the quick first rendering of PDF bg pages
+#define BGPDF_KEY_SAMPLE 65536 // bytes at each end of the PDF hashed for the disk cache
+#define CANVAS_PAGE_HYSTERESIS 2 // pages past the margin before canvas items are dropped
 
 #define VBOX_MAIN_NITEMS 5 // number of interface items in vboxMain
 
@@ -78,6 +93,16 @@ typedef struct Refstring {
 } Refstring;
 
 
+/* a file holding an attached background, as it was when we last read or
+   wrote it: if it hasn't changed since, we can copy it rather than encode
+   the background again */
+
+typedef struct BgFile {
+  char *path;
+  gsize size;
+  gint64 mtime;
+} BgFile;
+
 /* The journal is mostly a list of pages. Each page is a list of layers,
    and a background. Each layer is a list of items, from bottom to top.
 */
@@ -184,8 +209,8 @@ typedef struct Item {
   gdouble font_size;
   GtkWidget *widget; // the widget while text is being edited (ITEM_TEMP_TEXT)
   // the following fields for ITEM_IMAGE:
-  GdkPixbuf *image;  // the image
-  gchar *image_png;  // PNG of original image, for save and clipboard
+  GdkPixbuf *image;  // the image (NULL if not decoded yet, see decode_image_item())
+  gchar *image_png;  // encoded image (PNG, or JPEG as inserted), for save and clipboard
   gsize image_png_len;
 } Item;
 
@@ -233,14 +258,42 @@ typedef struct Page {
   double hoffset, voffset; // offsets of canvas group rel. to canvas root
   struct Background *bg;
   GnomeCanvasGroup *group;
+  int pageno; // its index in journal.pages, kept up to date by the page index
+  struct Refstring *lazy_layers; // XML of the layers if not parsed yet (then layers==NULL),
+                                 // shared with save snapshots
 } Page;
 
 typedef struct Journal {
   GList *pages;  // the pages in the journal
   int npages;
   int last_attach_no; // for naming of attached backgrounds
+  GHashTable *image_ids; // id in the file -> image data, for <image ref="...">
 } Journal;
 
+/* a copy of the journal being saved, possibly by a worker thread; pages
+   and items are private copies, only bg filenames and pixbufs are shared */
+
+typedef struct SaveJob {
+  char *filename;
+  gboolean is_auto;
+  gboolean image_refs; // write repeated images once, with id= and ref=
+  GList *pages; // copied struct Page's, with copied layers and items
+  struct PdfData *pdf_data; // a reference to the attached PDF background
+  struct BgFile *pdf_file; // or a file holding it, then pdf_data is NULL
+  struct BgFile *pdf_written; // where the worker wrote the PDF
+  GHashTable *bg_files; // pixbuf -> struct BgFile, for attached bg's
+  GHashTable *bg_written; // same, for the bg's that the worker wrote
+  gboolean success;
+  GList *written_files; // files created, for autosaves
+  GList *bg_errors; // attached backgrounds that couldn't be written
+  GString *xml; // if not NULL, write the XML here rather than to filename
+  GHashTable *attached; // if not NULL, attached bg's already written
+  GThread *thread; // the worker thread, or NULL
+  int serial;
+  void (*callback)(struct SaveJob *job); // run from the main loop when done
+  gpointer user_data;
+} SaveJob;
+
 typedef struct Selection {
   int type;  // ITEM_SELECTRECT, ITEM_MOVESEL_VERT, ITEM_SELECTREGION
   BBox bbox; // the rectangle bbox of the selection
@@ -309,8 +362,11 @@ typedef struct UIData {
   GdkCursor *cursor;
   GdkPixbuf *pen_cursor_pix, *hiliter_cursor_pix;
   gboolean pen_cursor; // use pencil cursor (default is a dot in current color)
-  gboolean progressive_bg; // update PDF bg's one at a time
+  gboolean progressive_bg; // update PDF bg's near the view only, prefetching ahead
+  int progressive_bg_prefetch; // how many pages ahead of the view to prefetch
+  int scroll_direction; // +1 or -1, the direction of the last scroll
   char *mrufile, *configfile; // file names for MRU & config
+  char *cachedir; // directory for the rendered pages of PDF backgrounds
   char *mru[MRU_SIZE]; // MRU data
   GtkWidget *mrumenu[MRU_SIZE];
   gboolean bg_apply_all_pages;
@@ -330,6 +386,23 @@ typedef struct UIData {
   GList *autosave_filename_list;
   int autosave_delay;
   gboolean need_autosave;
+  gboolean background_save; // write files from a worker thread
+  gboolean lazy_page_loading; // only parse the layers of a page when needed
+  gboolean save_image_refs; // write repeated images once (not readable by older versions)
+  int gzip_threads; // threads for (de)compressing files, 0 = one per processor
+  int pdf_render_threads; // threads for rendering PDF pages, 0 = one per processor
+  int image_cache_size; // MB of decoded images kept for offscreen pages
+  int pdf_cache_size; // MB of rendered PDF pages kept
+  int pdf_disk_cache_size; // MB of rendered PDF pages kept on disk, 0 = none
+  gboolean batch_layer_render; // draw the strokes of loaded layers with a LayerItem
+  int canvas_page_margin; // pages around the view that keep their canvas items
+  struct SaveJob *bg_save_job; // background save in progress, or NULL
+  char *editlog_base, *editlog_filename; // autosave edit log, and the file it applies to
+  gboolean editlog_started; // editlog_filename has been created
+  struct BgFile *editlog_base_id; // editlog_base as it was when the log was started
+  GHashTable *editlog_dirty; // pages modified since the last edit log record
+  GHashTable *editlog_index; // page -> 1 + its index at the last edit log record
+  GHashTable *editlog_attached; // attached bg's already written next to the edit log
 #if GLIB_CHECK_VERSION(2,6,0)
   GKeyFile *config_data;
 #endif
@@ -348,7 +421,6 @@ typedef struct UIData {
 #if GTK_CHECK_VERSION(2,10,0)
   GtkPrintSettings *print_settings;
 #endif
-  gboolean poppler_force_cairo; // force poppler to use cairo
   gboolean warned_generate_fontconfig; // for win32 fontconfig cache
 } UIData;
 
@@ -366,7 +438,7 @@ typedef struct UndoErasureData {
 typedef struct UndoItem {
   int type;
   struct Item *item; // for ITEM_STROKE, ITEM_TEXT, ITEM_TEXT_EDIT, ITEM_TEXT_ATTRIB, ITEM_IMAGE
-  struct Layer *layer; // for ITEM_STROKE, ITEM_ERASURE, ITEM_PASTE, ITEM_NEW_LAYER, ITEM_DELETE_LAYER, ITEM_MOVESEL, ITEM_TEXT, ITEM_TEXT_EDIT, ITEM_RECOGNIZER, ITEM_IMAGE
+  struct Layer *layer; // for ITEM_STROKE, ITEM_ERASURE, ITEM_PASTE, ITEM_NEW_LAYER, ITEM_DELETE_LAYER, ITEM_MOVESEL, ITEM_TEXT, ITEM_TEXT_EDIT, ITEM_RECOGNIZER, ITEM_IMAGE, and the layer holding the items for ITEM_TEXT_ATTRIB, ITEM_REPAINTSEL, ITEM_RESIZESEL
   struct Layer *layer2; // for ITEM_DELETE_LAYER with val=-1, ITEM_MOVESEL
   struct Page *page;  // for ITEM_NEW_BG_ONE/RESIZE, ITEM_NEW_PAGE, ITEM_NEW_LAYER, ITEM_DELETE_LAYER, ITEM_DELETE_PAGE
   GList *erasurelist; // for ITEM_ERASURE, ITEM_RECOGNIZER
@@ -380,33 +452,82 @@ typedef struct UndoItem {
   struct Brush *brush; // for ITEM_TEXT_ATTRIB
   struct UndoItem *next;
   int multiop;
+  gboolean logged; // already accounted for in the edit log
 } UndoItem;
 
 #define MULTIOP_CONT_REDO 1 // not the last in a multiop, so keep redoing
 #define MULTIOP_CONT_UNDO 2 // not the first in a multiop, so keep undoing
 
 
+typedef struct BgPdfTile {
+  int pageno;
+  double zoom;
+  int x, y; // position in the page, in units of BGPDF_TILE_SIZE pixels
+  GdkPixbuf *pixbuf;
+  GList *lru_link; // our link in bgpdf.tile_lru, once rendered
+  guint stamp; // the value of bgpdf.clock when last in view
+} BgPdfTile;
+
 typedef struct BgPdfRequest {
   int pageno;
   double dpi;
+  struct BgPdfTile *tile; // the tile to render, or NULL for the whole page
+  gboolean preview; // a quick rendering at BGPDF_PREVIEW_DPI, run first
+  int serial; // the value of bgpdf.serial when the request was made
+  int priority; // lower runs first: the distance of the page from the view
+  guint order; // then the older request first
+  gint cancelled; // set atomically, read by the render threads
+  GdkPixbuf *pixbuf; // the result of rendering, if any
+  int pixel_height, pixel_width; // pixel size of pixbuf
 } BgPdfRequest;
 
 typedef struct BgPdfPage {
+  int pageno;
   double dpi;
-  GdkPixbuf *pixbuf;
+  GdkPixbuf *pixbuf; // the rendering at dpi, if any
   int pixel_height, pixel_width; // pixel size of pixbuf
+  GdkPixbuf *preview; // the rendering at BGPDF_PREVIEW_DPI, if any
+  double width, height; // page size in points, once needed
+  GList *lru_link; // our link in bgpdf.lru, if we hold a pixbuf or preview
+  guint stamp; // the value of bgpdf.clock when last in view
 } BgPdfPage;
 
+/* the contents of the background PDF, shared by the reader and any save
+   in progress: freed (or unmapped) when the last reference is dropped */
+
+typedef struct PdfData {
+  gint ref_count;
+  gchar *contents; // null-terminated
+  gsize length;
+  GMappedFile *mapped; // if not NULL, contents is mapped from the file
+} PdfData;
+
 typedef struct BgPdf {
   int status; // the rest only makes sense if this is not STATUS_NOT_INIT
-  guint pid; // the identifier of the idle callback
+  GThreadPool *pool; // the threads rendering the requests
+  GAsyncQueue *documents; // poppler documents for the render threads
+  int serial; // bumped at shutdown, so stale results are discarded
   Refstring *filename;
   int file_domain;
-  gchar *file_contents; // buffer containing a copy of file data
-  gsize file_length;  // size of above buffer
+  struct PdfData *data; // the file data, shared by poppler
+  gchar *file_contents; // = data->contents
+  gsize file_length;  // = data->length
+  struct BgFile *file_saved; // a file with the same data, if still valid
+  gchar *cache_key; // hash identifying the file, for the disk cache (or NULL)
   int npages;
-  GList *pages; // a list of BgPdfPage structures
-  GList *requests; // a list of BgPdfRequest structures
+  GPtrArray *pages; // the BgPdfPage structures, by page number-1
+  GQueue *lru; // the BgPdfPage's holding a rendering, most recently used first
+  gsize cache_bytes; // the memory held by their pixbufs
+  GHashTable *tiles; // the rendered BgPdfTile's, by page, zoom and position
+  GQueue *tile_lru; // the same, most recently used first
+  guint clock; // bumped each time the view changes
+  guint cache_hits, cache_misses, cache_evictions;
+  gint disk_hits; // pages read from the disk cache, updated atomically
+  gint disk_written; // KB written to the disk cache since its last trim, same
+  gint disk_trimming; // a render thread is trimming the disk cache
+  GHashTable *requests; // the pending BgPdfRequest structures, by page number
+  GHashTable *tile_requests; // the pending tile requests, by tile
+  GHashTable *preview_requests; // the pending preview requests, by page number
   gboolean has_failed; // has failed in the past...
   PopplerDocument *document; // the poppler document
 } BgPdf;